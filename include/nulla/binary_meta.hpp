@@ -0,0 +1,453 @@
+#ifndef __NULLA_BINARY_META_HPP
+#define __NULLA_BINARY_META_HPP
+
+#include "nulla/sample.hpp"
+
+#include <endian.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// Flat little-endian metadata layout, it uses the same objects as v4 msgpack layout does.
+//
+// Header object is @binary_media_header followed by @track_count fixed-width @binary_track_record
+// entries and blob area with strings, descriptors and sample chunk directories, which are addressed
+// by @binary_ref offsets from the start of the object.
+//
+// Every sample table chunk object is @binary_sample_table_header followed by @count @binary_sample
+// records, record layout matches struct sample, thus chunk is used right from the read buffer
+// or mmaped file without any parsing if it is suitably aligned.
+
+static const u32 binary_media_magic = 0x424d4c4e; // "NLMB"
+static const u32 binary_sample_table_magic = 0x54534c4e; // "NLST"
+
+static const u16 binary_media_version_1 = 1;
+static const u16 binary_sample_table_version_1 = 1;
+
+struct binary_ref {
+	u32		offset;
+	u32		size;
+};
+
+struct binary_media_header {
+	u32		magic;
+	u16		version;
+	u16		track_count;
+	// readers use this as a stride, newer versions may only append fields to the record
+	u32		track_record_size;
+	u32		size;
+};
+
+struct binary_track_record {
+	u32		media_type;
+	u32		media_subtype;
+	u32		media_subtype_mpeg4;
+	u32		media_timescale;
+	u64		media_duration;
+
+	u32		id;
+	u32		number;
+	u32		timescale;
+	u32		bandwidth;
+	u64		duration;
+	u64		data_size;
+
+	u32		audio_sample_rate;
+	u32		audio_channels;
+
+	u32		video_width;
+	u32		video_height;
+	u32		video_fps_num;
+	u32		video_fps_denum;
+	u32		video_sar_w;
+	u32		video_sar_h;
+
+	u32		dconf_object_type_indication;
+	u32		dconf_buffer_size_db;
+	u32		dconf_max_bitrate;
+	u32		dconf_avg_bitrate;
+	u16		dconf_predefined_rvc_config;
+	u8		audio_bps;
+	u8		dconf_tag;
+	u8		dconf_stream_type;
+	u8		dconf_upstream;
+	u8		dsi_tag;
+	u8		rvc_tag;
+
+	binary_ref	mime_type;
+	binary_ref	codec;
+	binary_ref	slconf;
+	binary_ref	dsi;
+	binary_ref	rvc;
+
+	// array of @binary_sample_chunk entries, size is in bytes
+	binary_ref	chunks;
+};
+
+struct binary_sample_chunk {
+	u64		dts_start;
+	u32		sample_start;
+	u32		sample_count;
+};
+
+struct binary_sample_table_header {
+	u32		magic;
+	u16		version;
+	u16		record_size;
+	u64		count;
+};
+
+// @is_rap is always 0 or 1, padding is zeroed
+struct binary_sample {
+	u32		length;
+	u32		di;
+	u64		offset;
+	u64		dts;
+	u64		cts_offset;
+	u8		is_rap;
+	u8		reserved[7];
+};
+
+static_assert(sizeof(binary_media_header) == 16, "binary media header must be 16 bytes");
+static_assert(sizeof(binary_track_record) == 160, "binary track record must be 160 bytes");
+static_assert(sizeof(binary_sample_chunk) == 16, "binary sample chunk must be 16 bytes");
+static_assert(sizeof(binary_sample_table_header) == 16, "binary sample table header must be 16 bytes");
+
+// binary sample records are used as struct sample in place
+static_assert(sizeof(bool) == 1, "bool must be 1 byte");
+static_assert(sizeof(binary_sample) == sizeof(sample), "binary sample size must match struct sample");
+static_assert(offsetof(binary_sample, length) == offsetof(sample, length) &&
+		offsetof(binary_sample, di) == offsetof(sample, di) &&
+		offsetof(binary_sample, offset) == offsetof(sample, offset) &&
+		offsetof(binary_sample, dts) == offsetof(sample, dts) &&
+		offsetof(binary_sample, cts_offset) == offsetof(sample, cts_offset) &&
+		offsetof(binary_sample, is_rap) == offsetof(sample, is_rap),
+		"binary sample layout must match struct sample");
+
+static inline u32 binary_magic(const char *data, size_t size) {
+	u32 magic = 0;
+	if (size >= sizeof(magic))
+		memcpy(&magic, data, sizeof(magic));
+
+	return le32toh(magic);
+}
+
+static inline bool is_binary_media(const char *data, size_t size) {
+	return binary_magic(data, size) == binary_media_magic;
+}
+
+static inline bool is_binary_sample_table(const char *data, size_t size) {
+	return binary_magic(data, size) == binary_sample_table_magic;
+}
+
+static inline binary_ref binary_append(std::string &out, const void *data, size_t size, size_t align) {
+	while (out.size() % align)
+		out.push_back('\0');
+
+	binary_ref ref;
+	ref.offset = htole32(out.size());
+	ref.size = htole32(size);
+	out.append((const char *)data, size);
+	return ref;
+}
+
+static inline binary_ref binary_append(std::string &out, const std::string &str) {
+	return binary_append(out, str.data(), str.size(), 1);
+}
+
+static inline binary_ref binary_append(std::string &out, const std::vector<char> &data) {
+	return binary_append(out, data.data(), data.size(), 1);
+}
+
+static inline const char *binary_blob(const char *data, size_t size, const binary_ref &ref, size_t &blob_size) {
+	size_t offset = le32toh(ref.offset);
+	blob_size = le32toh(ref.size);
+
+	if (offset > size || blob_size > size - offset) {
+		std::ostringstream ss;
+		ss << "binary metadata: blob is out of bounds: offset: " << offset <<
+			", size: " << blob_size <<
+			", object size: " << size;
+		throw std::runtime_error(ss.str());
+	}
+
+	return data + offset;
+}
+
+// @chunks[i] is the chunk directory of the @tracks[i]
+static inline std::string pack_binary_media(const std::vector<track> &tracks,
+		const std::vector<std::vector<sample_chunk>> &chunks) {
+	std::string out(sizeof(binary_media_header) + tracks.size() * sizeof(binary_track_record), '\0');
+	std::vector<binary_track_record> records(tracks.size());
+
+	for (size_t i = 0; i < tracks.size(); ++i) {
+		const track &t = tracks[i];
+		binary_track_record &rec = records[i];
+
+		memset(&rec, 0, sizeof(rec));
+		rec.media_type = htole32(t.media_type);
+		rec.media_subtype = htole32(t.media_subtype);
+		rec.media_subtype_mpeg4 = htole32(t.media_subtype_mpeg4);
+		rec.media_timescale = htole32(t.media_timescale);
+		rec.media_duration = htole64(t.media_duration);
+
+		rec.id = htole32(t.id);
+		rec.number = htole32(t.number);
+		rec.timescale = htole32(t.timescale);
+		rec.bandwidth = htole32(t.bandwidth);
+		rec.duration = htole64(t.duration);
+		rec.data_size = htole64(t.data_size);
+
+		rec.audio_sample_rate = htole32(t.audio.sample_rate);
+		rec.audio_channels = htole32(t.audio.channels);
+		rec.audio_bps = t.audio.bps;
+
+		rec.video_width = htole32(t.video.width);
+		rec.video_height = htole32(t.video.height);
+		rec.video_fps_num = htole32(t.video.fps_num);
+		rec.video_fps_denum = htole32(t.video.fps_denum);
+		rec.video_sar_w = htole32(t.video.sar_w);
+		rec.video_sar_h = htole32(t.video.sar_h);
+
+		const decoder_config &dconf = t.esd.dconf;
+		rec.dconf_tag = dconf.tag;
+		rec.dconf_object_type_indication = htole32(dconf.objectTypeIndication);
+		rec.dconf_stream_type = dconf.streamType;
+		rec.dconf_upstream = dconf.upstream;
+		rec.dconf_buffer_size_db = htole32(dconf.bufferSizeDB);
+		rec.dconf_max_bitrate = htole32(dconf.maxBitrate);
+		rec.dconf_avg_bitrate = htole32(dconf.avgBitrate);
+		rec.dconf_predefined_rvc_config = htole16(dconf.predefined_rvc_config);
+		rec.dsi_tag = dconf.decoderSpecificInfo.tag;
+		rec.rvc_tag = dconf.rvc_config.tag;
+
+		rec.mime_type = binary_append(out, t.mime_type);
+		rec.codec = binary_append(out, t.codec);
+		rec.slconf = binary_append(out, t.esd.slconf);
+		rec.dsi = binary_append(out, dconf.decoderSpecificInfo.data);
+		rec.rvc = binary_append(out, dconf.rvc_config.data);
+
+		std::vector<binary_sample_chunk> dir(chunks[i].size());
+		for (size_t idx = 0; idx < dir.size(); ++idx) {
+			dir[idx].dts_start = htole64(chunks[i][idx].dts_start);
+			dir[idx].sample_start = htole32(chunks[i][idx].sample_start);
+			dir[idx].sample_count = htole32(chunks[i][idx].sample_count);
+		}
+		rec.chunks = binary_append(out, dir.data(), dir.size() * sizeof(binary_sample_chunk), alignof(binary_sample_chunk));
+	}
+
+	binary_media_header hdr;
+	hdr.magic = htole32(binary_media_magic);
+	hdr.version = htole16(binary_media_version_1);
+	hdr.track_count = htole16(tracks.size());
+	hdr.track_record_size = htole32(sizeof(binary_track_record));
+	hdr.size = htole32(out.size());
+
+	memcpy((char *)out.data(), &hdr, sizeof(hdr));
+	if (!records.empty())
+		memcpy((char *)out.data() + sizeof(hdr), records.data(), records.size() * sizeof(binary_track_record));
+
+	return out;
+}
+
+// only track headers are unpacked, every track gets its sample chunk directory,
+// sample tables are stored in the chunk objects
+static inline void unpack_binary_media(const char *data, size_t size, std::vector<track> &tracks) {
+	binary_media_header hdr;
+	if (size < sizeof(hdr)) {
+		std::ostringstream ss;
+		ss << "binary metadata: object is too small: " << size;
+		throw std::runtime_error(ss.str());
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (le32toh(hdr.magic) != binary_media_magic || le16toh(hdr.version) != binary_media_version_1) {
+		std::ostringstream ss;
+		ss << "binary metadata: magic/version mismatch: magic: " << std::hex << le32toh(hdr.magic) <<
+			", version: " << std::dec << le16toh(hdr.version) <<
+			", must be: " << binary_media_version_1;
+		throw std::runtime_error(ss.str());
+	}
+
+	const size_t track_count = le16toh(hdr.track_count);
+	const size_t record_size = le32toh(hdr.track_record_size);
+	if (le32toh(hdr.size) != size || record_size < sizeof(binary_track_record) ||
+			track_count * record_size > size - sizeof(hdr)) {
+		std::ostringstream ss;
+		ss << "binary metadata: header mismatch: object size: " << size <<
+			", header size: " << le32toh(hdr.size) <<
+			", tracks: " << track_count <<
+			", track record size: " << record_size;
+		throw std::runtime_error(ss.str());
+	}
+
+	tracks.resize(track_count);
+	for (size_t i = 0; i < track_count; ++i) {
+		binary_track_record rec;
+		memcpy(&rec, data + sizeof(hdr) + i * record_size, sizeof(rec));
+
+		track &t = tracks[i];
+		t.media_type = le32toh(rec.media_type);
+		t.media_subtype = le32toh(rec.media_subtype);
+		t.media_subtype_mpeg4 = le32toh(rec.media_subtype_mpeg4);
+		t.media_timescale = le32toh(rec.media_timescale);
+		t.media_duration = le64toh(rec.media_duration);
+
+		t.id = le32toh(rec.id);
+		t.number = le32toh(rec.number);
+		t.timescale = le32toh(rec.timescale);
+		t.bandwidth = le32toh(rec.bandwidth);
+		t.duration = le64toh(rec.duration);
+		t.data_size = le64toh(rec.data_size);
+
+		t.audio.sample_rate = le32toh(rec.audio_sample_rate);
+		t.audio.channels = le32toh(rec.audio_channels);
+		t.audio.bps = rec.audio_bps;
+
+		t.video.width = le32toh(rec.video_width);
+		t.video.height = le32toh(rec.video_height);
+		t.video.fps_num = le32toh(rec.video_fps_num);
+		t.video.fps_denum = le32toh(rec.video_fps_denum);
+		t.video.sar_w = le32toh(rec.video_sar_w);
+		t.video.sar_h = le32toh(rec.video_sar_h);
+
+		decoder_config &dconf = t.esd.dconf;
+		dconf.tag = rec.dconf_tag;
+		dconf.objectTypeIndication = le32toh(rec.dconf_object_type_indication);
+		dconf.streamType = rec.dconf_stream_type;
+		dconf.upstream = rec.dconf_upstream;
+		dconf.bufferSizeDB = le32toh(rec.dconf_buffer_size_db);
+		dconf.maxBitrate = le32toh(rec.dconf_max_bitrate);
+		dconf.avgBitrate = le32toh(rec.dconf_avg_bitrate);
+		dconf.predefined_rvc_config = le16toh(rec.dconf_predefined_rvc_config);
+		dconf.decoderSpecificInfo.tag = rec.dsi_tag;
+		dconf.rvc_config.tag = rec.rvc_tag;
+
+		size_t blob_size;
+		const char *blob;
+
+		blob = binary_blob(data, size, rec.mime_type, blob_size);
+		t.mime_type.assign(blob, blob_size);
+		blob = binary_blob(data, size, rec.codec, blob_size);
+		t.codec.assign(blob, blob_size);
+		blob = binary_blob(data, size, rec.slconf, blob_size);
+		t.esd.slconf.assign(blob, blob + blob_size);
+		blob = binary_blob(data, size, rec.dsi, blob_size);
+		dconf.decoderSpecificInfo.data.assign(blob, blob + blob_size);
+		blob = binary_blob(data, size, rec.rvc, blob_size);
+		dconf.rvc_config.data.assign(blob, blob + blob_size);
+
+		blob = binary_blob(data, size, rec.chunks, blob_size);
+		t.chunks.resize(blob_size / sizeof(binary_sample_chunk));
+		for (size_t idx = 0; idx < t.chunks.size(); ++idx) {
+			binary_sample_chunk ch;
+			memcpy(&ch, blob + idx * sizeof(ch), sizeof(ch));
+
+			t.chunks[idx].dts_start = le64toh(ch.dts_start);
+			t.chunks[idx].sample_start = le32toh(ch.sample_start);
+			t.chunks[idx].sample_count = le32toh(ch.sample_count);
+		}
+	}
+}
+
+static inline std::string pack_binary_sample_table(const sample *samples, size_t count) {
+	std::string out(sizeof(binary_sample_table_header) + count * sizeof(binary_sample), '\0');
+
+	binary_sample_table_header hdr;
+	hdr.magic = htole32(binary_sample_table_magic);
+	hdr.version = htole16(binary_sample_table_version_1);
+	hdr.record_size = htole16(sizeof(binary_sample));
+	hdr.count = htole64(count);
+	memcpy((char *)out.data(), &hdr, sizeof(hdr));
+
+	char *dst = (char *)out.data() + sizeof(hdr);
+	for (size_t i = 0; i < count; ++i) {
+		binary_sample rec;
+		memset(&rec, 0, sizeof(rec));
+
+		rec.length = htole32(samples[i].length);
+		rec.di = htole32(samples[i].di);
+		rec.offset = htole64(samples[i].offset);
+		rec.dts = htole64(samples[i].dts);
+		rec.cts_offset = htole64(samples[i].cts_offset);
+		rec.is_rap = samples[i].is_rap ? 1 : 0;
+
+		memcpy(dst + i * sizeof(rec), &rec, sizeof(rec));
+	}
+
+	return out;
+}
+
+// record with @is_rap other than 0 or 1 (written by a buggy or foreign writer) can not be used as bool in place
+static inline bool binary_rap_flags_valid(const char *records, u64 count) {
+	for (u64 i = 0; i < count; ++i) {
+		const u8 is_rap = (u8)records[i * sizeof(binary_sample) + offsetof(binary_sample, is_rap)];
+		if (is_rap > 1)
+			return false;
+	}
+
+	return true;
+}
+
+// returns samples stored in binary sample table @data, @owner must keep @data alive,
+// returned span points right into @data on little-endian hosts if records are aligned
+// and their @is_rap flags are valid, otherwise samples are decoded into newly allocated memory
+static inline sample_span unpack_binary_sample_table(const char *data, size_t size,
+		const std::shared_ptr<const void> &owner) {
+	binary_sample_table_header hdr;
+	if (size < sizeof(hdr)) {
+		std::ostringstream ss;
+		ss << "binary sample table: object is too small: " << size;
+		throw std::runtime_error(ss.str());
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+
+	const u64 count = le64toh(hdr.count);
+	if (le32toh(hdr.magic) != binary_sample_table_magic ||
+			le16toh(hdr.version) != binary_sample_table_version_1 ||
+			le16toh(hdr.record_size) != sizeof(binary_sample) ||
+			count > (size - sizeof(hdr)) / sizeof(binary_sample)) {
+		std::ostringstream ss;
+		ss << "binary sample table: header mismatch: object size: " << size <<
+			", magic: " << std::hex << le32toh(hdr.magic) <<
+			", version: " << std::dec << le16toh(hdr.version) <<
+			", record size: " << le16toh(hdr.record_size) <<
+			", count: " << count;
+		throw std::runtime_error(ss.str());
+	}
+
+	const char *records = data + sizeof(hdr);
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	if (((uintptr_t)records % alignof(sample)) == 0 && binary_rap_flags_valid(records, count)) {
+		return sample_span(owner, (const sample *)records, count);
+	}
+#endif
+
+	std::vector<sample> samples(count);
+	for (size_t i = 0; i < count; ++i) {
+		binary_sample rec;
+		memcpy(&rec, records + i * sizeof(rec), sizeof(rec));
+
+		samples[i].length = le32toh(rec.length);
+		samples[i].di = le32toh(rec.di);
+		samples[i].offset = le64toh(rec.offset);
+		samples[i].dts = le64toh(rec.dts);
+		samples[i].cts_offset = le64toh(rec.cts_offset);
+		samples[i].is_rap = rec.is_rap != 0;
+	}
+
+	return sample_span(std::move(samples));
+}
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_BINARY_META_HPP
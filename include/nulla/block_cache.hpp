@@ -0,0 +1,432 @@
+#ifndef __NULLA_BLOCK_CACHE_HPP
+#define __NULLA_BLOCK_CACHE_HPP
+
+#include "nulla/storage.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#include <string.h>
+
+namespace ioremap { namespace nulla {
+
+// In-memory read-through cache of the media data.
+//
+// Segment requests read sample ranges which depend on chunk duration and start of the playlist,
+// so two playlists over the same file almost never read the same range. Cache rounds every range
+// read to @block_size aligned blocks of (bucket, key), missing blocks are read from the backend
+// storage by one request per contiguous run, concurrent requests for a block being read wait for it
+// instead of reading it again. Requested range is assembled from the blocks, it is a slice of the
+// backend reply without copying when all blocks came from the same backend read.
+// Cached blocks of a multi-block run are copied out of the reply, so that every cached block
+// holds only its own memory and the cache size bounds memory it uses.
+// Whole-object reads (metadata) and writes bypass the cache, blocks of the object are dropped
+// by @invalidate() when it has been uploaded again. Invalidation only reaches the cache of the server
+// which has handled the upload, blocks are read from the backend again after @ttl_sec seconds,
+// zero @ttl_sec keeps them until they are evicted.
+class block_cache_storage : public storage {
+public:
+	block_cache_storage(const std::shared_ptr<storage> &backend, uint64_t size, uint64_t block_size, long ttl_sec) :
+		m_backend(backend), m_capacity(size), m_block_size(block_size), m_ttl_sec(ttl_sec)
+	{
+	}
+
+	virtual const char *name() const {
+		return m_backend->name();
+	}
+
+	virtual void read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		if (bucket.empty() || size == 0) {
+			m_backend->read(bucket, key, offset, size, trace, handler);
+			return;
+		}
+
+		const uint64_t first = offset / m_block_size;
+		const uint64_t last = (offset + size - 1) / m_block_size;
+
+		auto state = std::make_shared<request_state>();
+		state->offset = offset;
+		state->size = size;
+		state->first = first;
+		state->handler = handler;
+
+		// contiguous runs of blocks which have to be read from the backend: [first, last]
+		std::vector<std::pair<uint64_t, uint64_t>> runs;
+
+		const std::string object = object_key(bucket, key);
+		uint64_t generation;
+		// once the lock is released, fetches of other requests can complete this one,
+		// @state->remaining must not be read after that
+		bool all_cached;
+
+		const auto now = std::chrono::steady_clock::now();
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			generation = generation_locked(object);
+
+			for (uint64_t b = first; b <= last; ++b) {
+				const std::string bkey = block_key(object, b);
+				const size_t idx = state->blocks.size();
+				state->blocks.emplace_back();
+
+				auto it = m_index.find(bkey);
+				if (it != m_index.end() && m_ttl_sec && it->second.expires_at <= now) {
+					erase_locked(it);
+					m_expirations++;
+					it = m_index.end();
+				}
+
+				if (it != m_index.end()) {
+					m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+					state->blocks[idx] = it->second;
+
+					// object ends within this block, there is nothing to read after it
+					if (it->second.size < m_block_size)
+						break;
+
+					continue;
+				}
+
+				state->remaining++;
+
+				// reads started before the object has been uploaded again are not joined
+				const std::string fkey = fetch_key(bkey, generation);
+
+				auto pending = m_pending.find(fkey);
+				if (pending != m_pending.end()) {
+					pending->second.push_back(std::bind(&block_cache_storage::on_block, this, state, idx,
+								std::placeholders::_1, std::placeholders::_2));
+					continue;
+				}
+
+				m_pending[fkey].push_back(std::bind(&block_cache_storage::on_block, this, state, idx,
+							std::placeholders::_1, std::placeholders::_2));
+
+				if (!runs.empty() && runs.back().second + 1 == b) {
+					runs.back().second = b;
+				} else {
+					runs.push_back(std::make_pair(b, b));
+				}
+			}
+
+			all_cached = state->remaining == 0;
+		}
+
+		if (all_cached) {
+			m_hits++;
+			complete(state);
+			return;
+		}
+
+		m_misses++;
+		for (const auto &run: runs) {
+			m_fetches++;
+			m_backend->read(bucket, key, run.first * m_block_size, (run.second - run.first + 1) * m_block_size,
+					trace, std::bind(&block_cache_storage::on_fetch, this, object, generation,
+						run.first, run.second, std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	virtual void bulk_read(const std::string &bucket, const std::vector<std::string> &keys,
+			const storage_trace &trace, const bulk_read_handler_t &handler) {
+		m_backend->bulk_read(bucket, keys, trace, handler);
+	}
+
+	virtual void write(const std::string &bucket, const std::string &key, const elliptics::data_pointer &data,
+			uint64_t offset, const write_handler_t &handler) {
+		m_backend->write(bucket, key, data, offset, handler);
+	}
+
+	virtual void remove(const std::string &bucket, const std::string &key, const write_handler_t &handler) {
+		drop(bucket, key);
+		m_backend->remove(bucket, key, handler);
+	}
+
+	virtual void invalidate(const std::string &bucket, const std::string &key) {
+		drop(bucket, key);
+		m_backend->invalidate(bucket, key);
+	}
+
+	virtual void get_statistics(std::map<std::string, std::string> &stats) const {
+		stats["block_cache_hits"] = std::to_string(m_hits);
+		stats["block_cache_misses"] = std::to_string(m_misses);
+		stats["block_cache_fetches"] = std::to_string(m_fetches);
+		stats["block_cache_evictions"] = std::to_string(m_evictions);
+		stats["block_cache_invalidations"] = std::to_string(m_invalidations);
+		stats["block_cache_expirations"] = std::to_string(m_expirations);
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			stats["block_cache_blocks"] = std::to_string(m_index.size());
+			stats["block_cache_bytes"] = std::to_string(m_bytes);
+		}
+		stats["block_cache_capacity_bytes"] = std::to_string(m_capacity);
+
+		m_backend->get_statistics(stats);
+	}
+
+private:
+	// drops cached data of the object held by this cache only
+	void drop(const std::string &bucket, const std::string &key) {
+		const std::string object = object_key(bucket, key);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		generation_locked(object)++;
+
+		auto it = m_objects.find(object);
+		if (it != m_objects.end()) {
+			const std::set<uint64_t> blocks = it->second;
+			for (uint64_t b: blocks) {
+				auto blk = m_index.find(block_key(object, b));
+				if (blk != m_index.end()) {
+					erase_locked(blk);
+					m_invalidations++;
+				}
+			}
+		}
+	}
+
+	// block is a part of the backend reply @run starting at @run_offset,
+	// it is shorter than block size only if object ends within it
+	struct block {
+		elliptics::data_pointer		run;
+		uint64_t			run_offset = 0;
+		uint64_t			size = 0;
+		std::string			object;
+		uint64_t			number = 0;
+		std::chrono::steady_clock::time_point expires_at;
+		std::list<std::string>::iterator lru;
+	};
+
+	typedef std::function<void (const block &, const elliptics::error_info &)> waiter_t;
+
+	struct request_state {
+		uint64_t			offset = 0;
+		uint64_t			size = 0;
+		uint64_t			first = 0;
+		read_handler_t			handler;
+
+		std::mutex			lock;
+		std::vector<block>		blocks;
+		size_t				remaining = 0;
+		elliptics::error_info		error;
+	};
+
+	std::shared_ptr<storage> m_backend;
+	uint64_t m_capacity;
+	uint64_t m_block_size;
+	long m_ttl_sec;
+
+	mutable std::mutex m_lock;
+	std::unordered_map<std::string, block> m_index;
+	// most recently used block is at the front
+	std::list<std::string> m_lru;
+	// blocks being read from the backend and requests waiting for them, see @fetch_key()
+	std::unordered_map<std::string, std::vector<waiter_t>> m_pending;
+	// cached blocks of every object, see @invalidate()
+	std::unordered_map<std::string, std::set<uint64_t>> m_objects;
+	// bumped by invalidation of any object hashed into the entry, blocks read from the backend
+	// before that are not cached, collisions only cost a missed insertion
+	std::vector<uint64_t> m_generations = std::vector<uint64_t>(4096, 0);
+	// every cached block owns its buffer, so this is the memory held by the cache
+	uint64_t m_bytes = 0;
+
+	std::atomic<uint64_t> m_hits{0};
+	std::atomic<uint64_t> m_misses{0};
+	std::atomic<uint64_t> m_fetches{0};
+	std::atomic<uint64_t> m_evictions{0};
+	std::atomic<uint64_t> m_invalidations{0};
+	std::atomic<uint64_t> m_expirations{0};
+
+	static std::string object_key(const std::string &bucket, const std::string &key) {
+		std::string ret;
+		ret.reserve(bucket.size() + key.size() + 1);
+		ret.append(bucket);
+		ret.push_back('\0');
+		ret.append(key);
+		return ret;
+	}
+
+	static std::string block_key(const std::string &object, uint64_t block) {
+		return object + '\0' + std::to_string(block);
+	}
+
+	// backend read of the block which has been started at @generation of its object
+	static std::string fetch_key(const std::string &bkey, uint64_t generation) {
+		return bkey + '\0' + std::to_string(generation);
+	}
+
+	uint64_t &generation_locked(const std::string &object) {
+		return m_generations[std::hash<std::string>()(object) % m_generations.size()];
+	}
+
+	void on_fetch(const std::string &object, uint64_t generation, uint64_t first, uint64_t last,
+			const elliptics::data_pointer &data, const elliptics::error_info &error) {
+		std::vector<std::pair<std::vector<waiter_t>, block>> ready;
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+
+			// object has been uploaded again after this data was read
+			const bool cache = generation == generation_locked(object);
+
+			for (uint64_t b = first; b <= last; ++b) {
+				const std::string bkey = block_key(object, b);
+
+				block blk;
+				blk.run = data;
+				blk.run_offset = (b - first) * m_block_size;
+				if (!error && blk.run_offset < data.size()) {
+					blk.size = std::min(m_block_size, data.size() - blk.run_offset);
+					if (cache)
+						insert_locked(bkey, object, b, blk);
+				}
+
+				auto pending = m_pending.find(fetch_key(bkey, generation));
+				if (pending != m_pending.end()) {
+					ready.push_back(std::make_pair(std::move(pending->second), blk));
+					m_pending.erase(pending);
+				}
+			}
+		}
+
+		for (const auto &r: ready) {
+			for (const auto &waiter: r.first) {
+				waiter(r.second, error);
+			}
+		}
+	}
+
+	// waiters get @blk as a view of the whole backend reply, while the cached block is copied out of it
+	// unless the reply holds just this block, otherwise one cached block would keep the whole reply alive
+	void insert_locked(const std::string &bkey, const std::string &object, uint64_t number, const block &blk) {
+		auto it = m_index.find(bkey);
+		if (it != m_index.end())
+			erase_locked(it);
+
+		block cached;
+		if (blk.run.size() == blk.size) {
+			cached.run = blk.run;
+		} else {
+			cached.run = elliptics::data_pointer::copy(blk.run.data<char>() + blk.run_offset, blk.size);
+		}
+		cached.size = blk.size;
+		cached.object = object;
+		cached.number = number;
+		cached.expires_at = std::chrono::steady_clock::now() + std::chrono::seconds(m_ttl_sec);
+
+		m_lru.push_front(bkey);
+		cached.lru = m_lru.begin();
+		m_index.insert(std::make_pair(bkey, cached));
+		m_objects[object].insert(number);
+		m_bytes += cached.size;
+
+		while (m_bytes > m_capacity && !m_lru.empty()) {
+			erase_locked(m_index.find(m_lru.back()));
+			m_evictions++;
+		}
+	}
+
+	void erase_locked(std::unordered_map<std::string, block>::iterator it) {
+		const block &blk = it->second;
+
+		auto obj = m_objects.find(blk.object);
+		if (obj != m_objects.end()) {
+			obj->second.erase(blk.number);
+			if (obj->second.empty())
+				m_objects.erase(obj);
+		}
+
+		m_bytes -= blk.size;
+		m_lru.erase(blk.lru);
+		m_index.erase(it);
+	}
+
+	void on_block(const std::shared_ptr<request_state> &state, size_t idx,
+			const block &blk, const elliptics::error_info &error) {
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+
+			state->blocks[idx] = blk;
+			if (error && !state->error)
+				state->error = error;
+
+			if (--state->remaining != 0)
+				return;
+		}
+
+		complete(state);
+	}
+
+	void complete(const std::shared_ptr<request_state> &state) {
+		if (state->error) {
+			state->handler(elliptics::data_pointer(), state->error);
+			return;
+		}
+
+		const uint64_t skip = state->offset - state->first * m_block_size;
+
+		// blocks after the one where object ends are not used
+		uint64_t available = 0;
+		size_t count = 0;
+		for (const auto &blk: state->blocks) {
+			available += blk.size;
+			count++;
+			if (blk.size < m_block_size)
+				break;
+		}
+
+		if (available <= skip) {
+			state->handler(elliptics::data_pointer(), elliptics::error_info());
+			return;
+		}
+
+		const uint64_t size = std::min(state->size, available - skip);
+
+		bool contiguous = true;
+		for (size_t i = 1; i < count && contiguous; ++i) {
+			const block &prev = state->blocks[i - 1];
+			const block &blk = state->blocks[i];
+
+			contiguous = blk.run.data() == prev.run.data() && blk.run_offset == prev.run_offset + prev.size;
+		}
+
+		const block &front = state->blocks.front();
+		if (contiguous) {
+			state->handler(front.run.slice(front.run_offset + skip, size), elliptics::error_info());
+			return;
+		}
+
+		elliptics::data_pointer data = elliptics::data_pointer::allocate(size);
+
+		uint64_t copied = 0;
+		uint64_t pos = 0;
+		for (size_t i = 0; i < count && copied < size; ++i) {
+			const block &blk = state->blocks[i];
+
+			const uint64_t from = std::max(pos, skip);
+			const uint64_t to = std::min(pos + blk.size, skip + size);
+			if (from < to) {
+				memcpy(data.data<char>() + copied,
+						blk.run.data<char>() + blk.run_offset + (from - pos), to - from);
+				copied += to - from;
+			}
+
+			pos += blk.size;
+		}
+
+		state->handler(data, elliptics::error_info());
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_BLOCK_CACHE_HPP
@@ -0,0 +1,64 @@
+#ifndef __NULLA_DEDUP_HPP
+#define __NULLA_DEDUP_HPP
+
+#include <msgpack.hpp>
+
+#include <sstream>
+#include <string>
+
+namespace ioremap { namespace nulla {
+
+// Content-addressed upload deduplication.
+//
+// When object and its metadata have been uploaded, content index object @content_key(sha256 of the data)
+// is written, it points to the bucket and key of that object. When the same content is uploaded
+// again under different key, alias object @alias_key(bucket, key) pointing to the original object
+// is written instead of the data and metadata, metadata previously uploaded under that key is removed.
+// Both objects live in metadata groups. Manifest request resolves alias if there is no metadata
+// for the requested key.
+//
+// Keys can be uploaded again with different content, so content owned by every object is recorded
+// in @object_content_key(bucket, key). Content index entry and alias are only trusted if the object
+// they point to still owns the content, and upload of the other content removes the record together
+// with the index entry of the previous content.
+struct content_ref {
+	std::string	bucket;
+	std::string	key;
+	uint64_t	size = 0;
+	// sha256 of the content, entries written by older versions do not have it
+	std::string	sha256;
+
+	MSGPACK_DEFINE(bucket, key, size, sha256);
+};
+
+static inline std::string content_key(const std::string &sha256_hex) {
+	return "nulla.content." + sha256_hex;
+}
+
+// the same key in different buckets names different objects
+static inline std::string alias_key(const std::string &bucket, const std::string &key) {
+	return "nulla.alias." + bucket + "/" + key;
+}
+
+// holds sha256 hex of the content of the object
+static inline std::string object_content_key(const std::string &bucket, const std::string &key) {
+	return "nulla.owner." + bucket + "/" + key;
+}
+
+static inline std::string pack_content_ref(const content_ref &ref) {
+	std::stringstream buffer;
+	msgpack::pack(buffer, ref);
+	return buffer.str();
+}
+
+// throws on invalid data
+static inline void unpack_content_ref(const char *data, size_t size, content_ref &ref) {
+	msgpack::unpacked result;
+	msgpack::unpack(&result, data, size);
+
+	result.get().convert(&ref);
+}
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_DEDUP_HPP
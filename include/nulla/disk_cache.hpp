@@ -0,0 +1,536 @@
+#ifndef __NULLA_DISK_CACHE_HPP
+#define __NULLA_DISK_CACHE_HPP
+
+#include "nulla/storage.hpp"
+#include "nulla/thread_pool.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace ioremap { namespace nulla {
+
+struct disk_cache_options {
+	std::string	path;
+	uint64_t	size = 0;
+	uint64_t	block_size = 1024 * 1024;
+
+	// block is only written into the cache when it has been missed this many times,
+	// so that a single pass over the cold content does not wipe out the popular one
+	int		admit_hits = 2;
+
+	// cached block is read from the backend again after this many seconds, so that object uploaded again
+	// through another server is not served stale forever, zero means blocks live until evicted
+	long		ttl_sec = 300;
+
+	int		threads = 4;
+};
+
+// Second-tier cache of the media data on local disk.
+//
+// Range reads are split into @block_size aligned blocks of (bucket, key), if all of them are cached,
+// the range is served from the cache file, otherwise the range extended down to the block boundary
+// is read from the backend storage and admitted blocks are written into the cache. Cache file
+// is a fixed array of @size / @block_size slots accessed with O_DIRECT when the filesystem supports it,
+// slots are reused in LRU order. Whole-object reads (metadata) and writes bypass the cache.
+// Blocks of the object are dropped by @invalidate() when it has been uploaded again,
+// backend reads which have been started before that are not admitted. Invalidation only reaches
+// the cache of the server which has handled the upload, cached blocks expire after @ttl_sec.
+class disk_cache_storage : public storage {
+public:
+	disk_cache_storage(const std::shared_ptr<storage> &backend, const disk_cache_options &opt) :
+		m_backend(backend), m_opt(opt)
+	{
+		// O_DIRECT requires offsets and sizes aligned to the logical block size of the device
+		m_opt.block_size = (m_opt.block_size + alignment - 1) / alignment * alignment;
+		m_slots.resize(m_opt.size / m_opt.block_size);
+		if (m_slots.empty()) {
+			std::ostringstream ss;
+			ss << "disk cache " << m_opt.path << ": size " << m_opt.size <<
+				" is less than block size " << m_opt.block_size;
+			throw std::runtime_error(ss.str());
+		}
+
+		m_fd = open(m_opt.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0600);
+		if (m_fd < 0 && errno == EINVAL) {
+			m_fd = open(m_opt.path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		}
+		if (m_fd < 0) {
+			int err = -errno;
+			std::ostringstream ss;
+			ss << "could not open disk cache " << m_opt.path << ", error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		for (size_t i = 0; i < m_slots.size(); ++i) {
+			m_free.push_back(m_slots.size() - i - 1);
+		}
+
+		m_pool.reset(new thread_pool(m_opt.threads));
+	}
+
+	~disk_cache_storage() {
+		// queued cache reads and writes use the file
+		m_pool.reset();
+		close(m_fd);
+	}
+
+	virtual const char *name() const {
+		return m_backend->name();
+	}
+
+	virtual void read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		if (bucket.empty() || size == 0) {
+			m_backend->read(bucket, key, offset, size, trace, handler);
+			return;
+		}
+
+		std::vector<size_t> slots;
+		if (pin(bucket, key, offset, size, slots)) {
+			m_hits++;
+			m_pool->enqueue(std::bind(&disk_cache_storage::read_cached, this,
+						bucket, key, offset, size, trace, slots, handler));
+			return;
+		}
+
+		m_misses++;
+		read_backend(bucket, key, offset, size, trace, handler);
+	}
+
+	virtual void bulk_read(const std::string &bucket, const std::vector<std::string> &keys,
+			const storage_trace &trace, const bulk_read_handler_t &handler) {
+		m_backend->bulk_read(bucket, keys, trace, handler);
+	}
+
+	virtual void write(const std::string &bucket, const std::string &key, const elliptics::data_pointer &data,
+			uint64_t offset, const write_handler_t &handler) {
+		m_backend->write(bucket, key, data, offset, handler);
+	}
+
+	virtual void remove(const std::string &bucket, const std::string &key, const write_handler_t &handler) {
+		drop(bucket, key);
+		m_backend->remove(bucket, key, handler);
+	}
+
+	virtual void invalidate(const std::string &bucket, const std::string &key) {
+		drop(bucket, key);
+		m_backend->invalidate(bucket, key);
+	}
+
+	virtual void get_statistics(std::map<std::string, std::string> &stats) const {
+		stats["disk_cache_hits"] = std::to_string(m_hits);
+		stats["disk_cache_misses"] = std::to_string(m_misses);
+		stats["disk_cache_admissions"] = std::to_string(m_admissions);
+		stats["disk_cache_evictions"] = std::to_string(m_evictions);
+		stats["disk_cache_read_errors"] = std::to_string(m_read_errors);
+		stats["disk_cache_invalidations"] = std::to_string(m_invalidations);
+		stats["disk_cache_expirations"] = std::to_string(m_expirations);
+
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			stats["disk_cache_blocks"] = std::to_string(m_index.size());
+		}
+		stats["disk_cache_capacity_blocks"] = std::to_string(m_slots.size());
+
+		m_backend->get_statistics(stats);
+	}
+
+private:
+	// drops cached data of the object held by this cache only
+	void drop(const std::string &bucket, const std::string &key) {
+		const std::string object = object_key(bucket, key);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		generation_locked(object)++;
+
+		auto it = m_objects.find(object);
+		if (it != m_objects.end()) {
+			const std::vector<size_t> slots(it->second.begin(), it->second.end());
+			for (size_t idx: slots) {
+				// slot which is being read is freed when it is unpinned
+				if (m_slots[idx].pins) {
+					unindex_locked(idx);
+					m_slots[idx].stale = true;
+				} else {
+					release_locked(idx);
+				}
+				m_invalidations++;
+			}
+		}
+	}
+
+	enum {
+		alignment = 4096,
+	};
+
+	struct slot {
+		std::string			key;
+		std::string			object;
+		// number of valid bytes from the beginning of the block, the last block of the object
+		// and the block where requested range ends are only partially filled
+		uint64_t			length = 0;
+		int				pins = 0;
+		// object has been invalidated while the slot was being read
+		bool				stale = false;
+		std::chrono::steady_clock::time_point expires_at;
+		std::list<size_t>::iterator	lru;
+	};
+
+	struct ghost {
+		int				hits = 0;
+		std::list<std::string>::iterator lru;
+	};
+
+	std::shared_ptr<storage> m_backend;
+	disk_cache_options m_opt;
+	int m_fd = -1;
+
+	mutable std::mutex m_lock;
+	std::vector<slot> m_slots;
+	std::vector<size_t> m_free;
+	std::unordered_map<std::string, size_t> m_index;
+	// cached slots of every object, see @invalidate()
+	std::unordered_map<std::string, std::unordered_set<size_t>> m_objects;
+	// bumped by invalidation of any object hashed into the entry, blocks read from the backend
+	// before that are not admitted, collisions only cost a missed admission
+	std::vector<uint64_t> m_generations = std::vector<uint64_t>(4096, 0);
+	// most recently used slot is at the front
+	std::list<size_t> m_lru;
+
+	// recently missed blocks which have not been admitted yet
+	std::unordered_map<std::string, ghost> m_ghosts;
+	std::list<std::string> m_ghost_lru;
+
+	std::atomic<uint64_t> m_hits{0};
+	std::atomic<uint64_t> m_misses{0};
+	std::atomic<uint64_t> m_admissions{0};
+	std::atomic<uint64_t> m_evictions{0};
+	std::atomic<uint64_t> m_read_errors{0};
+	std::atomic<uint64_t> m_invalidations{0};
+	std::atomic<uint64_t> m_expirations{0};
+
+	std::unique_ptr<thread_pool> m_pool;
+
+	typedef std::unique_ptr<char, decltype(&free)> aligned_buffer_t;
+
+	aligned_buffer_t allocate_block() const {
+		void *ptr = NULL;
+		if (posix_memalign(&ptr, alignment, m_opt.block_size) != 0)
+			throw std::bad_alloc();
+
+		return aligned_buffer_t((char *)ptr, &free);
+	}
+
+	static std::string object_key(const std::string &bucket, const std::string &key) {
+		std::string ret;
+		ret.reserve(bucket.size() + key.size() + 1);
+		ret.append(bucket);
+		ret.push_back('\0');
+		ret.append(key);
+		return ret;
+	}
+
+	static std::string block_key(const std::string &object, uint64_t block) {
+		return object + '\0' + std::to_string(block);
+	}
+
+	// pins slots of all blocks covering [@offset, @offset + @size), so that they can not be
+	// reused while being read, returns false if at least one of them is not cached
+	bool pin(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			std::vector<size_t> &slots) {
+		const uint64_t bs = m_opt.block_size;
+		const uint64_t end = offset + size;
+		const std::string object = object_key(bucket, key);
+
+		const auto now = std::chrono::steady_clock::now();
+
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		for (uint64_t block = offset / bs; block * bs < end; ++block) {
+			auto it = m_index.find(block_key(object, block));
+			if (it != m_index.end() && m_opt.ttl_sec && m_slots[it->second].expires_at <= now) {
+				const size_t idx = it->second;
+				if (m_slots[idx].pins) {
+					unindex_locked(idx);
+					m_slots[idx].stale = true;
+				} else {
+					release_locked(idx);
+				}
+				m_expirations++;
+				it = m_index.end();
+			}
+
+			if (it == m_index.end() || m_slots[it->second].length < std::min(bs, end - block * bs)) {
+				unpin_locked(slots);
+				slots.clear();
+				return false;
+			}
+
+			slot &sl = m_slots[it->second];
+			sl.pins++;
+			m_lru.splice(m_lru.begin(), m_lru, sl.lru);
+			slots.push_back(it->second);
+		}
+
+		return true;
+	}
+
+	void unpin_locked(const std::vector<size_t> &slots) {
+		for (size_t idx: slots) {
+			slot &sl = m_slots[idx];
+			if (--sl.pins == 0 && sl.stale) {
+				sl.stale = false;
+				sl.key.clear();
+				sl.object.clear();
+				sl.length = 0;
+				m_free.push_back(idx);
+			}
+		}
+	}
+
+	void unpin(const std::vector<size_t> &slots) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		unpin_locked(slots);
+	}
+
+	void read_cached(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const std::vector<size_t> &slots, const read_handler_t &handler) {
+		const uint64_t bs = m_opt.block_size;
+
+		elliptics::data_pointer data = elliptics::data_pointer::allocate(size);
+		aligned_buffer_t buf = allocate_block();
+
+		uint64_t block = offset / bs;
+		for (size_t i = 0; i < slots.size(); ++i, ++block) {
+			ssize_t err = pread(m_fd, buf.get(), bs, slots[i] * bs);
+			if (err < 0 || (uint64_t)err < std::min(bs, offset + size - block * bs)) {
+				unpin(slots);
+				m_read_errors++;
+				read_backend(bucket, key, offset, size, trace, handler);
+				return;
+			}
+
+			const uint64_t from = std::max(offset, block * bs);
+			const uint64_t to = std::min(offset + size, (block + 1) * bs);
+			memcpy(data.data<char>() + (from - offset), buf.get() + (from - block * bs), to - from);
+		}
+
+		unpin(slots);
+		handler(data, elliptics::error_info());
+	}
+
+	void read_backend(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		const uint64_t start = offset / m_opt.block_size * m_opt.block_size;
+
+		uint64_t generation;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			generation = generation_locked(object_key(bucket, key));
+		}
+
+		m_backend->read(bucket, key, start, offset + size - start, trace,
+			std::bind(&disk_cache_storage::on_backend_read, this, bucket, key, offset, start, generation, handler,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_backend_read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t start,
+			uint64_t generation, const read_handler_t &handler,
+			const elliptics::data_pointer &data, const elliptics::error_info &error) {
+		if (error) {
+			handler(data, error);
+			return;
+		}
+
+		admit(object_key(bucket, key), start, generation, data);
+
+		const uint64_t skip = offset - start;
+		if (data.size() <= skip) {
+			handler(elliptics::data_pointer(), error);
+			return;
+		}
+
+		handler(data.slice(skip, data.size() - skip), error);
+	}
+
+	// @data starts at block boundary @start, it has been read from the backend at @generation
+	void admit(const std::string &object, uint64_t start, uint64_t generation, const elliptics::data_pointer &data) {
+		const uint64_t bs = m_opt.block_size;
+
+		for (uint64_t pos = 0; pos < data.size(); pos += bs) {
+			const uint64_t length = std::min(bs, data.size() - pos);
+			const std::string bkey = block_key(object, (start + pos) / bs);
+
+			size_t idx;
+			if (!reserve_slot(object, bkey, length, generation, idx))
+				continue;
+
+			m_pool->enqueue(std::bind(&disk_cache_storage::write_block, this,
+						object, bkey, idx, generation, data.slice(pos, length)));
+		}
+	}
+
+	// returns true if block has to be written into reserved slot @idx
+	bool reserve_slot(const std::string &object, const std::string &bkey, uint64_t length, uint64_t generation,
+			size_t &idx) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		// object has been uploaded again after this data was read
+		if (generation != generation_locked(object))
+			return false;
+
+		auto it = m_index.find(bkey);
+		if (it != m_index.end()) {
+			slot &sl = m_slots[it->second];
+			if (sl.length >= length || sl.pins)
+				return false;
+
+			// the same block has been read further this time, cached prefix is replaced
+			release_locked(it->second);
+		} else if (!admitted_locked(bkey)) {
+			return false;
+		}
+
+		if (m_free.empty() && !evict_locked())
+			return false;
+
+		idx = m_free.back();
+		m_free.pop_back();
+
+		slot &sl = m_slots[idx];
+		sl.key = bkey;
+		sl.object = object;
+		sl.length = length;
+		// slot being written is neither free nor indexed
+		sl.pins = 1;
+
+		return true;
+	}
+
+	bool admitted_locked(const std::string &bkey) {
+		auto it = m_ghosts.find(bkey);
+		if (it == m_ghosts.end()) {
+			if (m_opt.admit_hits <= 1)
+				return true;
+
+			ghost g;
+			g.hits = 1;
+			m_ghost_lru.push_front(bkey);
+			g.lru = m_ghost_lru.begin();
+			m_ghosts.insert(std::make_pair(bkey, g));
+
+			// ghost list remembers twice as many blocks as the cache can hold
+			if (m_ghosts.size() > 2 * m_slots.size()) {
+				m_ghosts.erase(m_ghost_lru.back());
+				m_ghost_lru.pop_back();
+			}
+			return false;
+		}
+
+		ghost &g = it->second;
+		if (++g.hits < m_opt.admit_hits) {
+			m_ghost_lru.splice(m_ghost_lru.begin(), m_ghost_lru, g.lru);
+			return false;
+		}
+
+		m_ghost_lru.erase(g.lru);
+		m_ghosts.erase(it);
+		return true;
+	}
+
+	// least recently used slot which is not being read is reused
+	bool evict_locked() {
+		for (auto it = m_lru.rbegin(); it != m_lru.rend(); ++it) {
+			if (m_slots[*it].pins)
+				continue;
+
+			release_locked(*it);
+			m_evictions++;
+			return true;
+		}
+
+		return false;
+	}
+
+	uint64_t &generation_locked(const std::string &object) {
+		return m_generations[std::hash<std::string>()(object) % m_generations.size()];
+	}
+
+	void unindex_locked(size_t idx) {
+		slot &sl = m_slots[idx];
+
+		m_index.erase(sl.key);
+		m_lru.erase(sl.lru);
+
+		auto it = m_objects.find(sl.object);
+		if (it != m_objects.end()) {
+			it->second.erase(idx);
+			if (it->second.empty())
+				m_objects.erase(it);
+		}
+	}
+
+	void release_locked(size_t idx) {
+		unindex_locked(idx);
+
+		slot &sl = m_slots[idx];
+		sl.key.clear();
+		sl.object.clear();
+		sl.length = 0;
+		m_free.push_back(idx);
+	}
+
+	void write_block(const std::string &object, const std::string &bkey, size_t idx, uint64_t generation,
+			const elliptics::data_pointer &data) {
+		const uint64_t bs = m_opt.block_size;
+
+		bool ok = false;
+		try {
+			aligned_buffer_t buf = allocate_block();
+			memcpy(buf.get(), data.data<char>(), data.size());
+			memset(buf.get() + data.size(), 0, bs - data.size());
+
+			ok = pwrite(m_fd, buf.get(), bs, idx * bs) == (ssize_t)bs;
+		} catch (const std::exception &) {
+		}
+
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		slot &sl = m_slots[idx];
+		sl.pins = 0;
+
+		// the same block could have been admitted by concurrent read or object could have been invalidated
+		if (!ok || generation != generation_locked(object) || m_index.find(bkey) != m_index.end()) {
+			sl.key.clear();
+			sl.object.clear();
+			sl.length = 0;
+			m_free.push_back(idx);
+			return;
+		}
+
+		sl.expires_at = std::chrono::steady_clock::now() + std::chrono::seconds(m_opt.ttl_sec);
+		m_lru.push_front(idx);
+		sl.lru = m_lru.begin();
+		m_index.insert(std::make_pair(bkey, idx));
+		m_objects[object].insert(idx);
+
+		m_admissions++;
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_DISK_CACHE_HPP
@@ -0,0 +1,554 @@
+#ifndef __NULLA_ELLIPTICS_STORAGE_HPP
+#define __NULLA_ELLIPTICS_STORAGE_HPP
+
+#include "nulla/expiration.hpp"
+#include "nulla/group_stats.hpp"
+#include "nulla/latency.hpp"
+#include "nulla/storage.hpp"
+
+#include <ebucket/bucket_processor.hpp>
+
+#include <elliptics/session.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <string.h>
+
+namespace ioremap { namespace nulla {
+
+// Hedged reads: if a read has not completed within @percentile of the recent read latencies
+// of its bucket and size class (but not less than @min_delay_ms), the same read is sent to the next group
+// of the bucket and the first successful reply wins. Not more than @max_ratio of all reads
+// are hedged, so that a slow cluster is not loaded twice as much.
+struct hedge_options {
+	bool		enabled = false;
+	double		percentile = 0.95;
+	long		min_delay_ms = 10;
+	double		max_ratio = 0.05;
+
+	// number of the latest reads of the bucket and size class the threshold is calculated from,
+	// there is no hedging until @min_samples reads have completed
+	size_t		window = 512;
+	size_t		min_samples = 32;
+};
+
+// Range reads of at least @threshold bytes are split into up to @max_parts parallel reads
+// of not less than @part_size bytes, parts are spread over the groups of the bucket.
+struct split_options {
+	uint64_t	threshold = 0;
+	uint64_t	part_size = 4 * 1024 * 1024;
+	int		max_parts = 8;
+};
+
+class elliptics_storage : public storage {
+public:
+	// objects of the empty bucket are stored in @index_groups
+	elliptics_storage(const std::shared_ptr<ebucket::bucket_processor> &bp, const std::shared_ptr<elliptics::node> &node,
+			const std::vector<int> &index_groups, long timeout, const hedge_options &hedge = hedge_options(),
+			const group_stats_options &groups = group_stats_options(),
+			const split_options &split = split_options()) :
+		m_bp(bp), m_node(node), m_index_groups(index_groups), m_timeout(timeout), m_hedge(hedge),
+		m_group_stats(groups), m_split(split)
+	{
+	}
+
+	virtual const char *name() const {
+		return "elliptics";
+	}
+
+	virtual void read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		if (m_split.threshold && m_split.max_parts > 1 &&
+				size >= m_split.threshold && size >= 2 * m_split.part_size) {
+			split_read(bucket, key, offset, size, trace, handler);
+			return;
+		}
+
+		read_range(bucket, key, offset, size, trace, 0, handler);
+	}
+
+	virtual void bulk_read(const std::string &bucket, const std::vector<std::string> &keys,
+			const storage_trace &trace, const bulk_read_handler_t &handler) {
+		std::unique_ptr<elliptics::session> session;
+		elliptics::error_info err = create_session(bucket, trace, session);
+		if (err) {
+			for (size_t i = 0; i < keys.size(); ++i) {
+				handler(i, elliptics::data_pointer(), err);
+			}
+			return;
+		}
+
+		const std::vector<int> groups = order_groups(*session);
+		const int first_group = groups.empty() ? 0 : groups.front();
+		const auto start = std::chrono::steady_clock::now();
+
+		for (size_t i = 0; i < keys.size(); ++i) {
+			session->read_data(keys[i], 0, 0).connect(
+				std::bind(&elliptics_storage::on_bulk_read, this, handler, i, first_group, start,
+					std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	virtual void write(const std::string &bucket, const std::string &key, const elliptics::data_pointer &data,
+			uint64_t offset, const write_handler_t &handler) {
+		std::unique_ptr<elliptics::session> session;
+		elliptics::error_info err = create_session(bucket, storage_trace(), session);
+		if (err) {
+			handler(err);
+			return;
+		}
+
+		session->write_data(key, data, offset).connect(
+			std::bind(&elliptics_storage::on_write, handler, std::placeholders::_1, std::placeholders::_2));
+	}
+
+	virtual void remove(const std::string &bucket, const std::string &key, const write_handler_t &handler) {
+		std::unique_ptr<elliptics::session> session;
+		elliptics::error_info err = create_session(bucket, storage_trace(), session);
+		if (err) {
+			handler(err);
+			return;
+		}
+
+		session->remove(key).connect(
+			std::bind(&elliptics_storage::on_remove, handler, std::placeholders::_1, std::placeholders::_2));
+	}
+
+	virtual void get_statistics(std::map<std::string, std::string> &stats) const {
+		if (m_group_stats.enabled())
+			m_group_stats.get_statistics(stats);
+
+		if (m_split.threshold) {
+			stats["read_splits"] = std::to_string(m_splits);
+			stats["read_split_parts"] = std::to_string(m_split_parts);
+		}
+
+		if (!m_hedge.enabled)
+			return;
+
+		stats["read_hedges"] = std::to_string(m_hedges);
+		stats["read_hedge_wins"] = std::to_string(m_hedge_wins);
+		stats["read_hedge_throttled"] = std::to_string(m_hedge_throttled);
+
+		std::lock_guard<std::mutex> guard(m_latency_lock);
+		for (const auto &p: m_latency) {
+			std::lock_guard<std::mutex> bguard(p.second->lock);
+			const std::string &name = p.first;
+			stats["read_latency_p50_us." + name] = std::to_string(p.second->window.percentile(0.5));
+			stats["read_latency_p95_us." + name] = std::to_string(p.second->window.percentile(0.95));
+			stats["read_latency_p99_us." + name] = std::to_string(p.second->window.percentile(0.99));
+		}
+	}
+
+private:
+	// read latencies of the bucket and size class and the hedging budget
+	struct bucket_latency {
+		std::mutex	lock;
+		latency_window	window;
+		// hedge delay is recalculated every @recalc_period samples
+		long		delay_ms = 0;
+		size_t		since_recalc = 0;
+		// every read adds @max_ratio to the budget, every hedged read takes 1
+		double		budget = 0;
+
+		bucket_latency(size_t size) : window(size) {
+		}
+
+		enum {
+			recalc_period = 16,
+			max_budget = 10,
+		};
+
+		void add(long usec, const hedge_options &opt) {
+			std::lock_guard<std::mutex> guard(lock);
+
+			window.add(usec);
+			budget = std::min(budget + opt.max_ratio, (double)max_budget);
+
+			if (window.count() < opt.min_samples)
+				return;
+
+			if (++since_recalc >= recalc_period || delay_ms == 0) {
+				since_recalc = 0;
+				delay_ms = std::max(opt.min_delay_ms, window.percentile(opt.percentile) / 1000);
+			}
+		}
+
+		long delay(const hedge_options &opt) {
+			std::lock_guard<std::mutex> guard(lock);
+			if (window.count() < opt.min_samples)
+				return 0;
+
+			return delay_ms;
+		}
+
+		bool acquire() {
+			std::lock_guard<std::mutex> guard(lock);
+			if (budget < 1)
+				return false;
+
+			budget -= 1;
+			return true;
+		}
+	};
+
+	struct hedge_state {
+		std::mutex	lock;
+		bool		done = false;
+		int		outstanding = 1;
+		read_handler_t	handler;
+		std::chrono::steady_clock::time_point start;
+		// hedge timer is cancelled when the original read completes first
+		expiration::timer_id_t timer = 0;
+	};
+
+	std::shared_ptr<ebucket::bucket_processor> m_bp;
+	std::shared_ptr<elliptics::node> m_node;
+	std::vector<int> m_index_groups;
+	long m_timeout;
+
+	hedge_options m_hedge;
+	mutable std::mutex m_latency_lock;
+	// latency of the large reads is dominated by transfer time, it would inflate hedge delay of the small ones,
+	// so every bucket keeps latencies of each size class (see @latency_key()) separately
+	std::unordered_map<std::string, std::shared_ptr<bucket_latency>> m_latency;
+	std::atomic<uint64_t> m_hedges{0};
+	std::atomic<uint64_t> m_hedge_wins{0};
+	std::atomic<uint64_t> m_hedge_throttled{0};
+	expiration m_timer;
+
+	group_stats m_group_stats;
+
+	split_options m_split;
+	std::atomic<uint64_t> m_splits{0};
+	std::atomic<uint64_t> m_split_parts{0};
+
+	// @spread rotates ordered groups, so that parts of the split read are served by different groups
+	void read_range(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, size_t spread, const read_handler_t &handler) {
+		std::unique_ptr<elliptics::session> session;
+		elliptics::error_info err = create_session(bucket, trace, session);
+		if (err) {
+			handler(elliptics::data_pointer(), err);
+			return;
+		}
+
+		std::vector<int> groups = order_groups(*session);
+		if (groups.size() > 1 && spread % groups.size() != 0) {
+			std::rotate(groups.begin(), groups.begin() + spread % groups.size(), groups.end());
+			session->set_groups(groups);
+		}
+
+		const int first_group = groups.empty() ? 0 : groups.front();
+		const auto start = std::chrono::steady_clock::now();
+
+		if (!m_hedge.enabled || groups.size() < 2) {
+			if (!m_group_stats.enabled()) {
+				session->read_data(key, offset, size).connect(
+					std::bind(&elliptics_storage::on_read, handler,
+						std::placeholders::_1, std::placeholders::_2));
+				return;
+			}
+
+			session->read_data(key, offset, size).connect(
+				std::bind(&elliptics_storage::on_timed_read, this, handler, first_group, start,
+					std::placeholders::_1, std::placeholders::_2));
+			return;
+		}
+
+		auto stats = latency_stats(bucket, size);
+		auto state = std::make_shared<hedge_state>();
+		state->handler = handler;
+		state->start = start;
+
+		session->read_data(key, offset, size).connect(
+			std::bind(&elliptics_storage::on_hedged_read, this, state, stats, true, first_group, start,
+				std::placeholders::_1, std::placeholders::_2));
+
+		long delay = stats->delay(m_hedge);
+		if (delay == 0)
+			return;
+
+		// hedged read goes to the same groups, but starts with the next one
+		std::shared_ptr<elliptics::session> hedge_session = std::make_shared<elliptics::session>(session->clone());
+		std::vector<int> hedge_groups = groups;
+		std::rotate(hedge_groups.begin(), hedge_groups.begin() + 1, hedge_groups.end());
+		hedge_session->set_groups(hedge_groups);
+
+		expiration::timer_id_t timer = m_timer.insert(std::chrono::milliseconds(delay),
+				std::bind(&elliptics_storage::send_hedge, this, state, stats, hedge_session, key, offset, size));
+
+		std::unique_lock<std::mutex> guard(state->lock);
+		state->timer = timer;
+		if (state->done) {
+			guard.unlock();
+			m_timer.cancel(timer);
+		}
+	}
+
+	struct split_state {
+		std::mutex		lock;
+		elliptics::data_pointer	data;
+		// object may end before the requested range does, only [0, @end) is returned
+		uint64_t		end = 0;
+		int			remaining = 0;
+		// parts which start after the end of the object fail, it is not an error of the whole read
+		elliptics::error_info	error;
+		uint64_t		error_pos = 0;
+		read_handler_t		handler;
+	};
+
+	// parts are read into their own elliptics buffers and copied into the reply buffer
+	// as they arrive, sample writers need the whole segment in one contiguous buffer
+	void split_read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		uint64_t parts = std::min<uint64_t>(m_split.max_parts, size / m_split.part_size);
+		uint64_t part_size = (size + parts - 1) / parts;
+
+		auto state = std::make_shared<split_state>();
+		state->data = elliptics::data_pointer::allocate(size);
+		state->end = size;
+		state->remaining = parts;
+		state->handler = handler;
+
+		m_splits++;
+		m_split_parts += parts;
+
+		for (uint64_t i = 0; i < parts; ++i) {
+			uint64_t pos = i * part_size;
+			read_range(bucket, key, offset + pos, std::min(part_size, size - pos), trace, i,
+				std::bind(&elliptics_storage::on_split_read, state, pos, std::min(part_size, size - pos),
+					std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	static void on_split_read(const std::shared_ptr<split_state> &state, uint64_t pos, uint64_t size,
+			const elliptics::data_pointer &data, const elliptics::error_info &error) {
+		if (!error) {
+			memcpy(state->data.data<char>() + pos, data.data<char>(), std::min<uint64_t>(data.size(), size));
+		}
+
+		read_handler_t handler;
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+
+			if (error) {
+				if (!state->error || pos < state->error_pos) {
+					state->error = error;
+					state->error_pos = pos;
+				}
+			} else if (data.size() < size) {
+				state->end = std::min(state->end, pos + data.size());
+			}
+
+			if (--state->remaining != 0)
+				return;
+
+			handler.swap(state->handler);
+		}
+
+		if (state->error && state->error_pos < state->end) {
+			handler(elliptics::data_pointer(), state->error);
+			return;
+		}
+
+		handler(state->data.slice(0, state->end), elliptics::error_info());
+	}
+
+	// read session is a copy of the bucket session, its groups are reordered by latency
+	std::vector<int> order_groups(elliptics::session &session) {
+		std::vector<int> groups = session.get_groups();
+		if (!m_group_stats.enabled())
+			return groups;
+
+		groups = m_group_stats.order(groups);
+		session.set_groups(groups);
+		return groups;
+	}
+
+	// elliptics tries groups in order, if reply came from another group, the first one has failed,
+	// missing object is not a failure of the group if all of them have failed
+	void account_read(int first_group, const std::chrono::steady_clock::time_point &start,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		if (!m_group_stats.enabled())
+			return;
+
+		if (error || result.empty()) {
+			if (error.code() != -ENOENT)
+				m_group_stats.failure(first_group);
+			return;
+		}
+
+		int group = result[0].command()->id.group_id;
+		m_group_stats.success(group, std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start).count());
+
+		if (group != first_group)
+			m_group_stats.failure(first_group);
+	}
+
+	void on_timed_read(const read_handler_t &handler, int first_group,
+			const std::chrono::steady_clock::time_point &start,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		account_read(first_group, start, result, error);
+		on_read(handler, result, error);
+	}
+
+	// whole-object reads have their own class, range reads are classified by size up to 64 KB, 256 KB and so on,
+	// every class is 4 times larger than the previous one
+	static std::string latency_key(const std::string &bucket, uint64_t size) {
+		static const char *classes[] = {"whole", "64K", "256K", "1M", "4M", "16M", "64M", "large"};
+		static const size_t num_classes = sizeof(classes) / sizeof(classes[0]);
+
+		size_t cls = 0;
+		if (size != 0) {
+			cls = 1;
+			for (uint64_t limit = 64 * 1024; size > limit && cls < num_classes - 1; limit *= 4)
+				cls++;
+		}
+
+		return (bucket.empty() ? std::string("index") : bucket) + "." + classes[cls];
+	}
+
+	std::shared_ptr<bucket_latency> latency_stats(const std::string &bucket, uint64_t size) {
+		const std::string key = latency_key(bucket, size);
+
+		std::lock_guard<std::mutex> guard(m_latency_lock);
+
+		auto &stats = m_latency[key];
+		if (!stats)
+			stats = std::make_shared<bucket_latency>(m_hedge.window);
+
+		return stats;
+	}
+
+	void send_hedge(const std::shared_ptr<hedge_state> &state, const std::shared_ptr<bucket_latency> &stats,
+			const std::shared_ptr<elliptics::session> &session,
+			const std::string &key, uint64_t offset, uint64_t size) {
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+			if (state->done)
+				return;
+
+			if (!stats->acquire()) {
+				m_hedge_throttled++;
+				return;
+			}
+
+			state->outstanding++;
+		}
+
+		m_hedges++;
+		session->read_data(key, offset, size).connect(
+			std::bind(&elliptics_storage::on_hedged_read, this, state, stats, false,
+				session->get_groups().front(), std::chrono::steady_clock::now(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	// error is returned only when there is no other read in flight, if original read has failed,
+	// timer has not yet fired and there will be no hedged read, elliptics has already tried all groups
+	void on_hedged_read(const std::shared_ptr<hedge_state> &state, const std::shared_ptr<bucket_latency> &stats,
+			bool primary, int first_group, const std::chrono::steady_clock::time_point &start,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		account_read(first_group, start, result, error);
+
+		if (primary && !error) {
+			stats->add(std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - state->start).count(), m_hedge);
+		}
+
+		read_handler_t handler;
+		expiration::timer_id_t timer = 0;
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+
+			state->outstanding--;
+			if (state->done)
+				return;
+
+			if (error && state->outstanding != 0)
+				return;
+
+			state->done = true;
+			handler.swap(state->handler);
+			timer = state->timer;
+		}
+
+		if (timer)
+			m_timer.cancel(timer);
+
+		if (!primary && !error)
+			m_hedge_wins++;
+
+		on_read(handler, result, error);
+	}
+
+	elliptics::error_info create_session(const std::string &bucket, const storage_trace &trace,
+			std::unique_ptr<elliptics::session> &session) {
+		if (bucket.empty()) {
+			session.reset(new elliptics::session(*m_node));
+			session->set_groups(m_index_groups);
+			session->set_timeout(m_timeout);
+		} else {
+			ebucket::bucket b;
+			elliptics::error_info err = m_bp->find_bucket(bucket, b);
+			if (err) {
+				return elliptics::create_error(err.code(), "could not find bucket %s in bucket processor: %s [%d]",
+						bucket.c_str(), err.message().c_str(), err.code());
+			}
+
+			// bucket session is shared by all requests, the copy has to be cloned to be modified
+			session.reset(new elliptics::session(b->session().clone()));
+		}
+
+		session->set_filter(elliptics::filters::positive);
+		session->set_trace_id(trace.id);
+		session->set_trace_bit(trace.bit);
+
+		return elliptics::error_info();
+	}
+
+	static void on_read(const read_handler_t &handler,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		if (error) {
+			handler(elliptics::data_pointer(), error);
+			return;
+		}
+
+		handler(result[0].file(), error);
+	}
+
+	void on_bulk_read(const bulk_read_handler_t &handler, size_t index, int first_group,
+			const std::chrono::steady_clock::time_point &start,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		account_read(first_group, start, result, error);
+
+		if (error) {
+			handler(index, elliptics::data_pointer(), error);
+			return;
+		}
+
+		handler(index, result[0].file(), error);
+	}
+
+	static void on_write(const write_handler_t &handler,
+			const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		(void) result;
+		handler(error);
+	}
+
+	static void on_remove(const write_handler_t &handler,
+			const elliptics::sync_remove_result &result, const elliptics::error_info &error) {
+		(void) result;
+		handler(error);
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_ELLIPTICS_STORAGE_HPP
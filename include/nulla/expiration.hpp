@@ -1,18 +1,42 @@
 #ifndef __NULLA_EXPIRATION_HPP
 #define __NULLA_EXPIRATION_HPP
 
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
-#include <map>
+#include <functional>
+#include <mutex>
 #include <thread>
 #include <vector>
 
+#include <stdint.h>
+
 namespace ioremap { namespace nulla {
 
+// Timers of playlists, upload sessions and hedged reads.
+//
+// Timers live in a hierarchical timing wheel of @levels levels of @slots slots each,
+// level 0 slot covers one tick (1 ms), every next level slot covers the whole previous level.
+// Timer is put into the slot of its expiration time in the lowest level which reaches that far,
+// when level 0 wraps, the current slot of level 1 is redistributed over level 0 and so on.
+// Insert, cancel and extend are O(1), all timers of the expired slot are fired in one batch.
+// Expiration time is rounded up to the next tick, so timers never fire early.
+// Timers are kept in a single array linked by indexes, there is no allocation per timer
+// except for the callback itself once the array has grown to the number of live timers.
 class expiration {
-	typedef std::function<void ()> expiration_callback_t;
 public:
-	expiration() : m_thread(std::bind(&expiration::run, this)) {
+	typedef std::function<void ()> expiration_callback_t;
+	// zero is never returned as a timer id
+	typedef uint64_t timer_id_t;
+
+	expiration() : m_start(std::chrono::steady_clock::now()) {
+		for (auto &level: m_heads) {
+			for (auto &head: level) {
+				head = nil;
+			}
+		}
+
+		m_thread = std::thread(std::bind(&expiration::run, this));
 	}
 
 	~expiration() {
@@ -21,60 +45,322 @@ public:
 	}
 
 	void stop() {
-		m_need_exit = true;
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_need_exit = true;
+		}
 		m_wait.notify_one();
 	}
 
-	void insert(const std::chrono::system_clock::time_point &expires_at, const expiration_callback_t &key) {
+	timer_id_t insert(const std::chrono::system_clock::time_point &expires_at, const expiration_callback_t &callback) {
+		return insert_after(expires_at - std::chrono::system_clock::now(), callback);
+	}
+
+	timer_id_t insert(std::chrono::milliseconds timeout, const expiration_callback_t &callback) {
+		return insert_after(timeout, callback);
+	}
+
+	// returns false if timer has already fired or has been cancelled
+	bool cancel(timer_id_t id) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		uint32_t idx;
+		if (!active(id, idx))
+			return false;
+
+		unlink(idx);
+		release(idx);
+		return true;
+	}
+
+	// moves expiration time of the active timer, returns false if it has already fired or has been cancelled
+	bool extend(timer_id_t id, std::chrono::milliseconds timeout) {
+		return extend_after(id, timeout);
+	}
+
+	bool extend(timer_id_t id, const std::chrono::system_clock::time_point &expires_at) {
+		return extend_after(id, expires_at - std::chrono::system_clock::now());
+	}
+
+	size_t size() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_size;
+	}
+
+private:
+	timer_id_t insert_after(std::chrono::steady_clock::duration timeout, const expiration_callback_t &callback) {
 		std::unique_lock<std::mutex> guard(m_lock);
 
-		auto it = m_timeouts.find(expires_at);
-		if (it == m_timeouts.end()) {
-			m_timeouts.insert(std::make_pair(expires_at, std::vector<expiration_callback_t>({key})));
-		} else {
-			it->second.emplace_back(key);
-		}
+		uint32_t idx = allocate();
+		timer &t = m_timers[idx];
+		t.callback = callback;
+		t.expires = tick_after(timeout);
+		link(idx);
+
+		timer_id_t id = make_id(idx, t.generation);
+		bool wake = t.expires < m_wake_tick;
 
 		guard.unlock();
-		m_wait.notify_one();
+		if (wake)
+			m_wait.notify_one();
+
+		return id;
 	}
 
-private:
-	bool m_need_exit = false;
+	bool extend_after(timer_id_t id, std::chrono::steady_clock::duration timeout) {
+		std::unique_lock<std::mutex> guard(m_lock);
+
+		uint32_t idx;
+		if (!active(id, idx))
+			return false;
+
+		unlink(idx);
+		m_timers[idx].expires = tick_after(timeout);
+		link(idx);
+
+		bool wake = m_timers[idx].expires < m_wake_tick;
+
+		guard.unlock();
+		if (wake)
+			m_wait.notify_one();
+
+		return true;
+	}
+
+	enum {
+		slot_bits = 8,
+		slots = 1 << slot_bits,
+		levels = 4,
+	};
+
+	static const uint32_t nil = ~0U;
+
+	struct timer {
+		expiration_callback_t	callback;
+		uint64_t		expires = 0;
+		uint32_t		prev = nil;
+		uint32_t		next = nil;
+		// bumped every time timer is released, so that stale ids do not match reused timers
+		uint32_t		generation = 1;
+		int8_t			level = -1;
+		uint8_t			slot = 0;
+	};
+
+	mutable std::mutex m_lock;
 	std::condition_variable m_wait;
-	std::mutex m_lock;
+	bool m_need_exit = false;
+
+	std::chrono::steady_clock::time_point m_start;
+
+	std::vector<timer> m_timers;
+	std::vector<uint32_t> m_free;
+	size_t m_size = 0;
+
+	uint32_t m_heads[levels][slots];
+	// non-empty slots of level 0, they are looked up to skip empty ticks
+	uint64_t m_occupied[slots / 64] = {};
+
+	// next tick to be processed and the tick the timer thread sleeps until
+	uint64_t m_base = 0;
+	uint64_t m_wake_tick = 0;
 
 	std::thread m_thread;
 
-	std::map<std::chrono::system_clock::time_point, std::vector<expiration_callback_t>> m_timeouts;
+	uint64_t now_tick() const {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - m_start).count();
+	}
 
-	void run() {
-		while (!m_need_exit) {
-			std::unique_lock<std::mutex> guard(m_lock);
+	// the first tick which starts no earlier than @timeout from now
+	uint64_t tick_after(std::chrono::steady_clock::duration timeout) const {
+		const std::chrono::steady_clock::duration since_start = std::chrono::steady_clock::now() - m_start;
+		if (timeout.count() <= 0)
+			return std::chrono::duration_cast<std::chrono::milliseconds>(since_start).count();
+
+		const std::chrono::steady_clock::duration tick = std::chrono::milliseconds(1);
+		return (since_start + timeout + tick - std::chrono::steady_clock::duration(1)) / tick;
+	}
+
+	static timer_id_t make_id(uint32_t idx, uint32_t generation) {
+		return ((timer_id_t)generation << 32) | idx;
+	}
+
+	bool active(timer_id_t id, uint32_t &idx) const {
+		idx = id & 0xffffffff;
+		return idx < m_timers.size() && m_timers[idx].generation == (id >> 32) && m_timers[idx].level >= 0;
+	}
+
+	uint32_t allocate() {
+		m_size++;
+
+		if (!m_free.empty()) {
+			uint32_t idx = m_free.back();
+			m_free.pop_back();
+			return idx;
+		}
+
+		m_timers.emplace_back();
+		return m_timers.size() - 1;
+	}
+
+	void release(uint32_t idx) {
+		timer &t = m_timers[idx];
+		t.callback = expiration_callback_t();
+		t.generation++;
+		if (t.generation == 0)
+			t.generation = 1;
+
+		m_free.push_back(idx);
+		m_size--;
+	}
+
+	// timers which have already expired go to the slot processed next
+	void link(uint32_t idx) {
+		timer &t = m_timers[idx];
+
+		uint64_t expires = std::max(t.expires, m_base);
+		uint64_t delta = expires - m_base;
+
+		int level = 0;
+		while (level < levels - 1 && delta >= (1ULL << (slot_bits * (level + 1))))
+			level++;
+
+		// timers beyond the range of the wheel wait in the farthest slot and are redistributed from there
+		if (delta >= (1ULL << (slot_bits * levels)))
+			expires = m_base + (1ULL << (slot_bits * levels)) - 1;
+
+		uint8_t slot = (expires >> (slot_bits * level)) & (slots - 1);
+
+		t.level = level;
+		t.slot = slot;
+		t.prev = nil;
+		t.next = m_heads[level][slot];
+		if (t.next != nil)
+			m_timers[t.next].prev = idx;
+		m_heads[level][slot] = idx;
+
+		if (level == 0)
+			m_occupied[slot / 64] |= 1ULL << (slot % 64);
+	}
+
+	void unlink(uint32_t idx) {
+		timer &t = m_timers[idx];
+
+		if (t.prev != nil) {
+			m_timers[t.prev].next = t.next;
+		} else {
+			m_heads[t.level][t.slot] = t.next;
+			if (t.level == 0 && t.next == nil)
+				m_occupied[t.slot / 64] &= ~(1ULL << (t.slot % 64));
+		}
+
+		if (t.next != nil)
+			m_timers[t.next].prev = t.prev;
+
+		t.level = -1;
+		t.prev = t.next = nil;
+	}
 
-			auto next_check = std::chrono::system_clock::now() + std::chrono::seconds(1);
-			if (m_timeouts.size())
-				next_check = m_timeouts.begin()->first;
+	// moves all timers of the given slot to the lower levels
+	void cascade(int level, uint8_t slot) {
+		uint32_t idx = m_heads[level][slot];
+		m_heads[level][slot] = nil;
 
-			m_wait.wait_until(guard, next_check);
+		while (idx != nil) {
+			uint32_t next = m_timers[idx].next;
+			link(idx);
+			idx = next;
+		}
+	}
+
+	// first non-empty level 0 slot at or after @slot, or @slots if there is none up to the end of the level
+	unsigned next_occupied(unsigned slot) const {
+		for (unsigned word = slot / 64; word < slots / 64; ++word) {
+			uint64_t bits = m_occupied[word];
+			if (word == slot / 64)
+				bits &= ~0ULL << (slot % 64);
+
+			if (bits)
+				return word * 64 + __builtin_ctzll(bits);
+		}
+
+		return slots;
+	}
+
+	// collects callbacks of all timers which have expired by @now
+	void advance(uint64_t now, std::vector<expiration_callback_t> &expired) {
+		while (m_base <= now) {
+			unsigned slot = m_base & (slots - 1);
+
+			if (slot == 0) {
+				for (int level = 1; level < levels; ++level) {
+					uint8_t s = (m_base >> (slot_bits * level)) & (slots - 1);
+					cascade(level, s);
+					if (s != 0)
+						break;
+				}
+			}
+
+			// empty ticks are skipped up to the next occupied slot or the end of the level
+			unsigned next = next_occupied(slot);
+			if (next != slot) {
+				m_base = std::min(now + 1, m_base - slot + next);
+				continue;
+			}
+
+			uint32_t idx = m_heads[0][slot];
+			m_heads[0][slot] = nil;
+			m_occupied[slot / 64] &= ~(1ULL << (slot % 64));
 
-			std::vector<expiration_callback_t> keys;
+			while (idx != nil) {
+				uint32_t next_idx = m_timers[idx].next;
 
-			// mutex is locked
-			while (m_timeouts.size() != 0) {
-				auto f = m_timeouts.begin();
-				auto timestamp = f->first;
-				if (std::chrono::system_clock::now() < timestamp)
+				expired.emplace_back(std::move(m_timers[idx].callback));
+				m_timers[idx].level = -1;
+				release(idx);
+
+				idx = next_idx;
+			}
+
+			m_base++;
+		}
+	}
+
+	// wakes up at the next occupied level 0 slot, or when level 0 wraps and has to be refilled,
+	// processing never stops at slot 0 after cascading, so it is yet to be refilled
+	uint64_t next_wake() const {
+		unsigned slot = m_base & (slots - 1);
+		if (slot == 0)
+			return m_base;
+
+		unsigned next = next_occupied(slot);
+
+		return std::min(m_base - slot + next, m_base + 1000);
+	}
+
+	void run() {
+		std::vector<expiration_callback_t> expired;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				if (m_need_exit)
 					break;
 
-				keys.insert(keys.end(), f->second.begin(), f->second.end());
-				m_timeouts.erase(f);
+				advance(now_tick(), expired);
+
+				if (expired.empty()) {
+					m_wake_tick = next_wake();
+					m_wait.wait_until(guard, m_start + std::chrono::milliseconds(m_wake_tick));
+					m_wake_tick = 0;
+					continue;
+				}
 			}
 
-			guard.unlock();
-			for (auto &k : keys) {
-				k();
+			for (auto &callback: expired) {
+				callback();
 			}
+			expired.clear();
 		}
 	}
 };
@@ -0,0 +1,184 @@
+#ifndef __NULLA_GROUP_STATS_HPP
+#define __NULLA_GROUP_STATS_HPP
+
+#include "nulla/latency.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+struct group_stats_options {
+	bool		enabled = false;
+
+	// weight of the latest sample in the moving average
+	double		alpha = 0.2;
+
+	// group is moved to the end of the list for @cooldown_sec seconds
+	// after @error_threshold reads in a row have failed on it
+	int		error_threshold = 3;
+	long		cooldown_sec = 10;
+
+	// every @explore_period-th read keeps groups in bucket order,
+	// so that latency of the slower groups is still measured
+	int		explore_period = 64;
+
+	size_t		window = 256;
+};
+
+// Read latency of every elliptics group, groups of the read session are ordered
+// by it, so that reads go to the fastest healthy replica first and elliptics
+// falls back to the slower ones only if it fails.
+//
+// Every read looks groups up and orders them, so there is no common lock on that path:
+// groups are found in an immutable snapshot which is only replaced when a new group shows up,
+// ordering uses atomic per-group counters, only latency window of the group has its own lock.
+class group_stats {
+public:
+	group_stats(const group_stats_options &opt) : m_opt(opt), m_snapshot(new group_map()) {
+		m_snapshots.emplace_back(m_snapshot.load());
+	}
+
+	bool enabled() const {
+		return m_opt.enabled;
+	}
+
+	// successful read has been served by @group in @usec microseconds
+	void success(int group, long usec) {
+		group_state &st = state(group);
+
+		{
+			std::lock_guard<std::mutex> guard(st.lock);
+			st.window.add(usec);
+			st.ewma = st.reads == 0 ? usec : m_opt.alpha * usec + (1 - m_opt.alpha) * st.ewma;
+			st.reads++;
+		}
+
+		st.errors_in_row = 0;
+	}
+
+	void failure(int group) {
+		group_state &st = state(group);
+
+		st.errors++;
+		if (++st.errors_in_row >= m_opt.error_threshold) {
+			st.errors_in_row = 0;
+			st.unhealthy_until = (std::chrono::steady_clock::now() +
+					std::chrono::seconds(m_opt.cooldown_sec)).time_since_epoch().count();
+		}
+	}
+
+	// healthy groups are sorted by average latency, groups which have not been read yet go first,
+	// unhealthy groups are moved to the end and keep their relative order
+	std::vector<int> order(const std::vector<int> &groups) {
+		if (groups.size() < 2 || ++m_reads % m_opt.explore_period == 0)
+			return groups;
+
+		const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+		std::vector<std::pair<double, int>> healthy, unhealthy;
+		for (int group: groups) {
+			group_state &st = state(group);
+			if (st.unhealthy_until > now) {
+				unhealthy.push_back(std::make_pair(0.0, group));
+			} else {
+				healthy.push_back(std::make_pair(st.reads ? st.ewma.load() : 0.0, group));
+			}
+		}
+
+		std::stable_sort(healthy.begin(), healthy.end(),
+			[] (const std::pair<double, int> &a, const std::pair<double, int> &b) {
+				return a.first < b.first;
+			});
+
+		std::vector<int> ret;
+		ret.reserve(groups.size());
+		for (const auto &p: healthy)
+			ret.push_back(p.second);
+		for (const auto &p: unhealthy)
+			ret.push_back(p.second);
+
+		return ret;
+	}
+
+	void get_statistics(std::map<std::string, std::string> &stats) const {
+		const auto now = std::chrono::steady_clock::now().time_since_epoch().count();
+
+		for (const auto &p: *m_snapshot.load()) {
+			const std::string suffix = "." + std::to_string(p.first);
+			group_state &st = *p.second;
+
+			stats["group_reads" + suffix] = std::to_string(st.reads);
+			stats["group_errors" + suffix] = std::to_string(st.errors);
+			stats["group_healthy" + suffix] = st.unhealthy_until > now ? "false" : "true";
+			stats["group_latency_ewma_us" + suffix] = std::to_string((long)st.ewma);
+
+			std::lock_guard<std::mutex> guard(st.lock);
+			stats["group_latency_p50_us" + suffix] = std::to_string(st.window.percentile(0.5));
+			stats["group_latency_p95_us" + suffix] = std::to_string(st.window.percentile(0.95));
+			stats["group_latency_p99_us" + suffix] = std::to_string(st.window.percentile(0.99));
+		}
+	}
+
+private:
+	struct group_state {
+		std::mutex		lock;
+		latency_window		window;
+		std::atomic<double>	ewma{0};
+		std::atomic<uint64_t>	reads{0};
+		std::atomic<uint64_t>	errors{0};
+		std::atomic_int		errors_in_row{0};
+		// steady clock ticks
+		std::atomic<int64_t>	unhealthy_until{0};
+
+		group_state(size_t size) : window(size) {
+		}
+	};
+
+	typedef std::map<int, group_state *> group_map;
+
+	group_stats_options m_opt;
+
+	std::atomic<uint64_t> m_reads{0};
+
+	// readers use the latest snapshot without locking, it is replaced under @m_lock
+	// when a new group is added, older snapshots are kept until destruction, since there are only
+	// as many of them as there are groups
+	std::atomic<const group_map *> m_snapshot;
+	std::mutex m_lock;
+	std::vector<std::unique_ptr<const group_map>> m_snapshots;
+	std::vector<std::unique_ptr<group_state>> m_states;
+
+	group_state &state(int group) {
+		const group_map *groups = m_snapshot.load();
+		auto it = groups->find(group);
+		if (it != groups->end())
+			return *it->second;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		groups = m_snapshot.load();
+		it = groups->find(group);
+		if (it != groups->end())
+			return *it->second;
+
+		m_states.emplace_back(new group_state(m_opt.window));
+
+		group_map *updated = new group_map(*groups);
+		updated->insert(std::make_pair(group, m_states.back().get()));
+		m_snapshots.emplace_back(updated);
+		m_snapshot = updated;
+
+		return *m_states.back();
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_GROUP_STATS_HPP
@@ -1,7 +1,11 @@
 #ifndef __NULLA_ISO_READER_HPP
 #define __NULLA_ISO_READER_HPP
 
+#include "nulla/binary_meta.hpp"
+#include "nulla/mapped_file.hpp"
 #include "nulla/sample.hpp"
+#include "nulla/sample_codec.hpp"
+#include "nulla/utils.hpp"
 
 #include <gpac/constants.h>
 #include <gpac/media_tools.h>
@@ -14,6 +18,7 @@
 #include <msgpack.hpp>
 
 #include <iostream>
+#include <mutex>
 #include <sstream>
 
 #include <stdlib.h>
@@ -23,17 +28,49 @@ namespace ioremap { namespace nulla {
 
 struct media {
 	enum {
-		serialization_version_2 = 2
+		serialization_version_2 = 2,
+		// track headers only, sample tables are stored in separate objects, see @sample_table
+		serialization_version_3 = 3,
+		// track headers with sample chunk directories, every chunk is stored in separate object
+		serialization_version_4 = 4,
+		// flat binary layout of the v4 objects, see nulla/binary_meta.hpp
+		serialization_binary_1 = 5,
 	};
 
 	std::vector<track>		tracks;
 
+	// version this media has been unpacked from,
+	// v3 and v4 media do not have samples in its tracks until sample tables are read
+	int				version = serialization_version_2;
+
 	template <typename Stream>
 	void msgpack_pack(msgpack::packer<Stream> &o) const {
 		o.pack_array(serialization_version_2);
 		o.pack((int)serialization_version_2);
 		o.pack(tracks);
 	}
+
+	template <typename Stream>
+	void msgpack_pack_header(msgpack::packer<Stream> &o) const {
+		o.pack_array(2);
+		o.pack((int)serialization_version_3);
+		o.pack_array(tracks.size());
+		for (const auto &t: tracks) {
+			t.msgpack_pack_header(o);
+		}
+	}
+
+	// @chunks[i] is the chunk directory of the @tracks[i]
+	template <typename Stream>
+	void msgpack_pack_chunked(msgpack::packer<Stream> &o, const std::vector<std::vector<sample_chunk>> &chunks) const {
+		o.pack_array(2);
+		o.pack((int)serialization_version_4);
+		o.pack_array(tracks.size());
+		for (size_t i = 0; i < tracks.size(); ++i) {
+			tracks[i].msgpack_pack_header(o, chunks[i]);
+		}
+	}
+
 	void msgpack_unpack(msgpack::object o) {
 		if (o.type != msgpack::type::ARRAY) {
 			std::ostringstream ss;
@@ -48,15 +85,18 @@ struct media {
 		uint16_t version = 0;
 		p[0].convert(&version);
 		switch (version) {
-		case ioremap::nulla::media::serialization_version_2: {
-			if (size != ioremap::nulla::media::serialization_version_2) {
+		case ioremap::nulla::media::serialization_version_2:
+		case ioremap::nulla::media::serialization_version_3:
+		case ioremap::nulla::media::serialization_version_4: {
+			if (size != 2) {
 				std::ostringstream ss;
 				ss << "page unpack: array size mismatch: read: " << size <<
-					", must be: " << ioremap::nulla::media::serialization_version_2;
+					", must be: " << 2;
 				throw std::runtime_error(ss.str());
 			}
 
 			p[1].convert(&tracks);
+			this->version = version;
 			break;
 		}
 		default: {
@@ -69,14 +109,276 @@ struct media {
 	}
 };
 
-class iso_reader {
+// sample table of a single track, v3 metadata layout stores it in @sample_table_key() object
+struct sample_table {
+	enum {
+		serialization_version_1 = 1,
+		// [version, count, raw samples encoded with @encode_samples()]
+		serialization_version_2 = 2,
+	};
+
+	template <typename Stream>
+	static void pack_compressed(msgpack::packer<Stream> &o, const sample *samples, size_t count) {
+		std::string encoded;
+		encode_samples(samples, count, encoded);
+
+		o.pack_array(3);
+		o.pack((int)serialization_version_2);
+		o.pack((u64)count);
+		o.pack_raw(encoded.size());
+		o.pack_raw_body(encoded.data(), encoded.size());
+	}
+
+	template <typename Stream>
+	static void pack(msgpack::packer<Stream> &o, const sample *samples, size_t count) {
+		o.pack_array(2);
+		o.pack((int)serialization_version_1);
+		o.pack_array(count);
+		for (size_t i = 0; i < count; ++i) {
+			o.pack(samples[i]);
+		}
+	}
+
+	static void unpack(const char *data, size_t size, std::vector<sample> &samples) {
+		msgpack::unpacked result;
+		msgpack::unpack(&result, data, size);
+
+		msgpack::object o = result.get();
+		if (o.type != msgpack::type::ARRAY || o.via.array.size < 2) {
+			std::ostringstream ss;
+			ss << "sample table unpack: type: " << o.type <<
+				", must be: " << msgpack::type::ARRAY <<
+				", size: " << o.via.array.size <<
+				", must be at least: " << 2;
+			throw std::runtime_error(ss.str());
+		}
+
+		msgpack::object *p = o.via.array.ptr;
+		int version = 0;
+		p[0].convert(&version);
+		switch (version) {
+		case serialization_version_1:
+			p[1].convert(&samples);
+			break;
+		case serialization_version_2: {
+			if (o.via.array.size != 3 || p[2].type != msgpack::type::RAW) {
+				std::ostringstream ss;
+				ss << "sample table unpack: compressed table mismatch: size: " << o.via.array.size <<
+					", must be: " << 3 <<
+					", samples type: " << p[2].type <<
+					", must be: " << msgpack::type::RAW;
+				throw std::runtime_error(ss.str());
+			}
+
+			u64 count = 0;
+			p[1].convert(&count);
+			decode_samples(p[2].via.raw.ptr, p[2].via.raw.size, count, samples);
+			break;
+		}
+		default: {
+			std::ostringstream ss;
+			ss << "sample table unpack: version mismatch: read: " << version <<
+				", there is no such packing version ";
+			throw std::runtime_error(ss.str());
+		}
+		}
+	}
+};
+
+// unpacks sample table object of any format, binary tables are not copied if possible,
+// @owner must keep @data alive
+static inline sample_span unpack_sample_table(const char *data, size_t size, const std::shared_ptr<const void> &owner) {
+	if (is_binary_sample_table(data, size))
+		return unpack_binary_sample_table(data, size, owner);
+
+	std::vector<sample> samples;
+	sample_table::unpack(data, size, samples);
+	return sample_span(std::move(samples));
+}
+
+// unpacks metadata header object of any format
+static inline void unpack_media(const char *data, size_t size, media &m) {
+	if (is_binary_media(data, size)) {
+		unpack_binary_media(data, size, m.tracks);
+		m.version = media::serialization_binary_1;
+		return;
+	}
+
+	msgpack::unpacked result;
+	msgpack::unpack(&result, data, size);
+
+	msgpack::object deserialized = result.get();
+	deserialized.convert(&m);
+}
+
+enum metadata_format {
+	metadata_format_msgpack = 0,
+	metadata_format_binary,
+	// msgpack layout with delta + varint encoded sample tables
+	metadata_format_compressed,
+};
+
+// returns false if @name is not a known metadata format
+static inline bool parse_metadata_format(const std::string &name, metadata_format &format) {
+	if (name == "msgpack") {
+		format = metadata_format_msgpack;
+	} else if (name == "compressed") {
+		format = metadata_format_compressed;
+	} else if (name == "binary") {
+		format = metadata_format_binary;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+struct metadata_object {
+	std::string			key;
+	std::string			data;
+};
+
+// keys of the sample table objects stored next to @meta_key object which holds @m headers
+static inline std::vector<std::string> sample_table_keys(const std::string &meta_key, const media &m) {
+	std::vector<std::string> keys;
+
+	for (const auto &t: m.tracks) {
+		switch (m.version) {
+		case media::serialization_version_3:
+			keys.push_back(sample_table_key(meta_key, t.number));
+			break;
+		case media::serialization_version_4:
+		case media::serialization_binary_1:
+			for (size_t idx = 0; idx < t.chunks.size(); ++idx) {
+				keys.push_back(sample_chunk_key(meta_key, t.number, idx));
+			}
+			break;
+		default:
+			break;
+		}
+	}
+
+	return keys;
+}
+
+// packs @m into v3 metadata layout: track headers are stored in @meta_key object,
+// sample table of every track is stored in its own object, so that reader only fetches
+// tables of the tracks it needs
+//
+// if @chunk_duration_sec is not zero, v4 layout is used: sample table of every track
+// is split into chunks of about @chunk_duration_sec seconds each stored in its own object,
+// header object contains chunk directory, so that reader only fetches chunks it plays
+//
+// compressed @format stores sample tables delta + varint encoded, see nulla/sample_codec.hpp,
+// binary @format always uses v4 object layout, zero @chunk_duration_sec means single chunk per track
+static inline std::vector<metadata_object> pack_metadata(const media &m, const std::string &meta_key,
+		long chunk_duration_sec, metadata_format format) {
+	std::vector<metadata_object> objects;
+
+	std::vector<std::vector<sample_chunk>> chunks;
+	if (chunk_duration_sec || format == metadata_format_binary) {
+		for (const auto &t: m.tracks) {
+			chunks.emplace_back(split_sample_chunks(t.samples, (u64)chunk_duration_sec * t.media_timescale));
+		}
+	}
+
+	if (format == metadata_format_binary) {
+		objects.push_back({meta_key, pack_binary_media(m.tracks, chunks)});
+
+		for (size_t i = 0; i < m.tracks.size(); ++i) {
+			const track &t = m.tracks[i];
+
+			for (size_t idx = 0; idx < chunks[i].size(); ++idx) {
+				const sample_chunk &ch = chunks[i][idx];
+				objects.push_back({sample_chunk_key(meta_key, t.number, idx),
+						pack_binary_sample_table(t.samples.data() + ch.sample_start, ch.sample_count)});
+			}
+		}
+
+		return objects;
+	}
+
+	std::stringstream buffer;
+	msgpack::packer<std::stringstream> header(&buffer);
+	if (chunk_duration_sec) {
+		m.msgpack_pack_chunked(header, chunks);
+	} else {
+		m.msgpack_pack_header(header);
+	}
+
+	objects.push_back({meta_key, buffer.str()});
+
+	for (size_t i = 0; i < m.tracks.size(); ++i) {
+		const track &t = m.tracks[i];
+
+		if (!chunk_duration_sec) {
+			std::stringstream tbuf;
+			msgpack::packer<std::stringstream> table(&tbuf);
+			if (format == metadata_format_compressed) {
+				sample_table::pack_compressed(table, t.samples.data(), t.samples.size());
+			} else {
+				sample_table::pack(table, t.samples.data(), t.samples.size());
+			}
+
+			objects.push_back({sample_table_key(meta_key, t.number), tbuf.str()});
+			continue;
+		}
+
+		for (size_t idx = 0; idx < chunks[i].size(); ++idx) {
+			const sample_chunk &ch = chunks[i][idx];
+
+			std::stringstream tbuf;
+			msgpack::packer<std::stringstream> table(&tbuf);
+			if (format == metadata_format_compressed) {
+				sample_table::pack_compressed(table, t.samples.data() + ch.sample_start, ch.sample_count);
+			} else {
+				sample_table::pack(table, t.samples.data() + ch.sample_start, ch.sample_count);
+			}
+
+			objects.push_back({sample_chunk_key(meta_key, t.number, idx), tbuf.str()});
+		}
+	}
+
+	return objects;
+}
+
+// GPAC initialization is reference counted without any locking,
+// readers are opened and closed concurrently by upload handlers and batch parser threads
+class gpac_init {
 public:
-	iso_reader() {}
+	gpac_init() {
+		acquire();
+	}
+	~gpac_init() {
+		release();
+	}
 
-	iso_reader(const char *filename) {
+	gpac_init(const gpac_init &) = delete;
+	gpac_init &operator=(const gpac_init &) = delete;
+
+	static void acquire() {
+		std::lock_guard<std::mutex> guard(lock());
 		gf_sys_init(GF_FALSE);
 		gf_log_set_tool_level(GF_LOG_ALL, GF_LOG_WARNING);
+	}
+
+	static void release() {
+		std::lock_guard<std::mutex> guard(lock());
+		gf_sys_close();
+	}
+
+private:
+	static std::mutex &lock() {
+		static std::mutex m;
+		return m;
+	}
+};
 
+class iso_reader {
+public:
+	iso_reader() {}
+
+	iso_reader(const char *filename) {
 		GF_Err e;
 		u64 missing_bytes = 0;
 
@@ -89,7 +391,6 @@ public:
 	}
 	virtual ~iso_reader() {
 		gf_isom_close(m_movie);
-		gf_sys_close();
 	}
 
 	int parse_meta() {
@@ -143,14 +444,26 @@ public:
 		return buffer.str();
 	}
 
+	std::vector<metadata_object> pack_objects(const std::string &meta_key, long chunk_duration_sec, metadata_format format) const {
+		return pack_metadata(m_media, meta_key, chunk_duration_sec, format);
+	}
+
 	const media &get_media() const {
 		return m_media;
 	}
 
 protected:
-	GF_ISOFile *m_movie;
+	// released after the movie has been closed
+	gpac_init m_gpac;
+
+	GF_ISOFile *m_movie = NULL;
 	media m_media;
 
+	// number of samples of every track (indexed by track number - 1) which have already been
+	// appended to its sample table, streaming reader only walks samples which have been added
+	// to GPAC sample table since the previous feed, counters are dropped when GPAC tables are reset
+	std::vector<u32> m_parsed_samples;
+
 	GF_Err parse_track_metadata(nulla::track &t) {
 		GF_Err e;
 
@@ -231,7 +544,14 @@ protected:
 			return GF_OK;
 		}
 
-		for (u32 sidx = 1; sidx < sample_count + 1; ++sidx) {
+		if (m_parsed_samples.size() < t.number)
+			m_parsed_samples.resize(t.number, 0);
+
+		u32 &parsed = m_parsed_samples[t.number - 1];
+		if (parsed > sample_count)
+			parsed = 0;
+
+		for (u32 sidx = parsed + 1; sidx < sample_count + 1; ++sidx) {
 			iso_sample = gf_isom_get_sample_info(m_movie, t.number, sidx, &di, &offset);
 			if (!iso_sample) {
 				e = gf_isom_last_error(m_movie);
@@ -264,26 +584,131 @@ protected:
 #endif
 			/*release the sample data, once you're done with it*/
 			gf_isom_sample_del(&iso_sample);
+
+			parsed = sidx;
 		}
 
 		return GF_OK;
 	}
 };
 
+// whole-file reader which hands GPAC gmem:// view of the file mapping,
+// only pages with the boxes GPAC actually reads are faulted in and nothing is copied in user space
+class iso_mmap_reader : public iso_reader
+{
+public:
+	iso_mmap_reader(const std::string &filename) : m_file(filename, MADV_RANDOM) {
+		GF_Err e;
+		u64 missing_bytes = 0;
+
+		char buf[128];
+		snprintf(buf, sizeof(buf), "gmem://%zd@%p", m_file.size(), m_file.data());
+
+		e = gf_isom_open_progressive(buf, 0, 0, &m_movie, &missing_bytes);
+		if (m_movie == NULL || (e != GF_OK && e != GF_ISOM_INCOMPLETE_FILE)) {
+			std::ostringstream ss;
+			ss << "could not open mapped file " << filename <<
+				", buffer: " << buf <<
+				", error: " << gf_error_to_string(e) << ", code: " << e <<
+				", missing_bytes: " << missing_bytes;
+			throw std::runtime_error(ss.str());
+		}
+
+		int err = parse();
+		if (err) {
+			std::ostringstream ss;
+			ss << "could not parse mapped file " << filename << ", error: " << gf_error_to_string((GF_Err)err);
+			throw std::runtime_error(ss.str());
+		}
+
+		if (m_media.tracks.empty()) {
+			std::ostringstream ss;
+			ss << "could not find track metadata in mapped file " << filename;
+			throw std::runtime_error(ss.str());
+		}
+	}
+
+	// movie has to be closed before the mapping it reads from goes away
+	~iso_mmap_reader() {
+		gf_isom_close(m_movie);
+		m_movie = NULL;
+	}
+
+private:
+	mapped_file m_file;
+};
+
+// contiguous buffer of the not yet consumed stream data, GPAC reads it via gmem:// url.
+// Consumed data is dropped by moving the start offset, unconsumed tail is only moved to the front
+// when there is no room for the new data, and memory is only reallocated when the tail itself
+// does not fit, so every byte is copied a constant number of times on average
+// and memory usage is bounded by the largest unconsumed region.
+class stream_buffer {
+public:
+	void append(const char *ptr, size_t size) {
+		if (m_end + size > m_data.size()) {
+			const size_t live = m_end - m_start;
+
+			if (live + size <= m_data.size() && m_start >= live) {
+				memmove((char *)m_data.data(), (char *)m_data.data() + m_start, live);
+			} else {
+				std::vector<char> tmp(std::max(m_data.size() * 2, live + size));
+				memcpy((char *)tmp.data(), (char *)m_data.data() + m_start, live);
+				m_data.swap(tmp);
+			}
+
+			m_start = 0;
+			m_end = live;
+		}
+
+		memcpy((char *)m_data.data() + m_end, ptr, size);
+		m_end += size;
+	}
+
+	// drops @size bytes from the start of the buffer
+	void consume(size_t size) {
+		m_start += std::min(size, m_end - m_start);
+		if (m_start == m_end) {
+			m_start = m_end = 0;
+		}
+	}
+
+	const char *data() const {
+		return m_data.data() + m_start;
+	}
+
+	size_t size() const {
+		return m_end - m_start;
+	}
+
+	size_t capacity() const {
+		return m_data.size();
+	}
+
+	// gmem:// url of the unconsumed data
+	std::string url() const {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "gmem://%zd@%p", size(), data());
+		return buf;
+	}
+
+private:
+	std::vector<char> m_data;
+	size_t m_start = 0;
+	size_t m_end = 0;
+};
+
 class iso_memory_reader : public iso_reader
 {
 public:
 	iso_memory_reader(const char *ptr, size_t size) {
-		gf_sys_init(GF_FALSE);
-		gf_log_set_tool_level(GF_LOG_ALL, GF_LOG_WARNING);
-
 		GF_Err e;
 		u64 missing_bytes = 0;
 
-		m_cached.insert(m_cached.end(), ptr, ptr + size);
+		m_cached.append(ptr, size);
 
-		char buf[128];
-		snprintf(buf, sizeof(buf), "gmem://%ld@%p", m_cached.size(), m_cached.data());
+		std::string url = m_cached.url();
+		const char *buf = url.c_str();
 
 		e = gf_isom_open_progressive(buf, 0, 0, &m_movie, &missing_bytes);
 		if (m_movie == NULL || (e != GF_OK && e != GF_ISOM_INCOMPLETE_FILE)) {
@@ -327,10 +752,10 @@ public:
 		GF_Err e;
 		u64 missing_bytes;
 
-		m_cached.insert(m_cached.end(), ptr, ptr + size);
+		m_cached.append(ptr, size);
 
-		char buf[128];
-		snprintf(buf, sizeof(buf), "gmem://%ld@%p", m_cached.size(), m_cached.data());
+		std::string url = m_cached.url();
+		const char *buf = url.c_str();
 
 		e = gf_isom_refresh_fragmented(m_movie, &missing_bytes, buf);
 		if (e != GF_OK && e != GF_ISOM_INCOMPLETE_FILE) {
@@ -363,8 +788,11 @@ public:
 		u64 new_buffer_start = 0;
 		u64 missing_bytes;
 
-		/* release internal structures associated with the samples read so far */
-		gf_isom_reset_tables(m_movie, GF_TRUE);
+		/* release internal structures associated with the samples read so far,
+		 * sample numbering starts from 1 again if tables have been reset */
+		if (gf_isom_reset_tables(m_movie, GF_TRUE) == GF_OK) {
+			m_parsed_samples.clear();
+		}
 
 		/* release the associated input data as well */
 		GF_Err e = gf_isom_reset_data_offset(m_movie, &new_buffer_start);
@@ -377,13 +805,10 @@ public:
 		fprintf(stdout, "cleanup: resize: data offset: data_size: %ld, new_buffer_start: %ld, error: %s [%d]\n",
 				m_cached.size(), new_buffer_start, gf_error_to_string(e), e);
 #endif
-		if (new_buffer_start < m_cached.size()) {
-			memmove((char *)m_cached.data(), (char *)m_cached.data() + new_buffer_start, m_cached.size() - new_buffer_start);
-			m_cached.resize(m_cached.size() - new_buffer_start);
-		}
+		m_cached.consume(new_buffer_start);
 
-		char buf[128];
-		snprintf(buf, sizeof(buf), "gmem://%ld@%p", m_cached.size(), m_cached.data());
+		std::string url = m_cached.url();
+		const char *buf = url.c_str();
 		e = gf_isom_refresh_fragmented(m_movie, &missing_bytes, buf);
 		if (e != GF_OK && e != GF_ISOM_INCOMPLETE_FILE) {
 			fprintf(stdout, "cleanup: resize: could not refresh fragmented mp4, buf: %s, missing_bytes: %ld, error: %s [%d]\n",
@@ -394,8 +819,13 @@ public:
 		return GF_OK;
 	}
 
+	// size of the memory allocated for the stream data
+	size_t buffer_capacity() const {
+		return m_cached.capacity();
+	}
+
 private:
-	std::vector<char> m_cached;
+	stream_buffer m_cached;
 };
 
 class iso_stream_fallback_reader {
@@ -409,29 +839,39 @@ public:
 				throw;
 		}
 
-		static const std::string secure_xxx = "/XXXXXXXX";
-		m_tmp_file = tmp_dir + secure_xxx;
+		create_tmp_file(tmp_dir);
+
+		ssize_t err = write(m_fd, data, size);
+		if (err != (ssize_t)size) {
+			close(m_fd);
+			m_fd = -1;
 
-		ssize_t err = mkstemp((char *)m_tmp_file.c_str());
-		if (err < 0) {
 			err = -errno;
 			std::ostringstream ss;
-			ss << "could not create temporary file: template: " << m_tmp_file <<
+			ss << "could not write into temporary file: " << m_tmp_file <<
+				", size: " << size <<
 				", error: " << strerror(-err) <<
 				" [" << err << "]";
 			throw std::runtime_error(ss.str());
 		}
 
-		m_fd = err;
+		m_need_reset = true;
+	}
 
-		err = write(m_fd, data, size);
-		if (err != (ssize_t)size) {
+	// file-backed reader of @size bytes object, whose parts are written with @write_at(),
+	// parts which have not been written are file holes, GPAC skips media data boxes without reading them
+	iso_stream_fallback_reader(const std::string &tmp_dir, uint64_t size) {
+		create_tmp_file(tmp_dir);
+
+		int err = ftruncate(m_fd, size);
+		if (err < 0) {
+			err = -errno;
 			close(m_fd);
 			m_fd = -1;
+			remove(m_tmp_file.c_str());
 
-			err = -errno;
 			std::ostringstream ss;
-			ss << "could not write into temporary file: " << m_tmp_file <<
+			ss << "could not resize temporary file: " << m_tmp_file <<
 				", size: " << size <<
 				", error: " << strerror(-err) <<
 				" [" << err << "]";
@@ -486,6 +926,25 @@ public:
 		m_need_reset = true;
 	}
 
+	void write_at(uint64_t offset, const char *data, size_t size) {
+		if (m_fd < 0)
+			throw std::runtime_error("streaming reader can only be fed sequentially");
+
+		ssize_t err = pwrite(m_fd, data, size, offset);
+		if (err != (ssize_t)size) {
+			err = -errno;
+			std::ostringstream ss;
+			ss << "could not write into temporary file: " << m_tmp_file <<
+				", offset: " << offset <<
+				", size: " << size <<
+				", error: " << strerror(-err) <<
+				" [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		m_need_reset = true;
+	}
+
 	std::string pack() {
 		if (m_memory_reader) {
 			return m_memory_reader->pack();
@@ -495,6 +954,15 @@ public:
 		return m_file_reader->pack();
 	}
 
+	std::vector<metadata_object> pack_objects(const std::string &meta_key, long chunk_duration_sec, metadata_format format) {
+		if (m_memory_reader) {
+			return m_memory_reader->pack_objects(meta_key, chunk_duration_sec, format);
+		}
+
+		setup_file_reader();
+		return m_file_reader->pack_objects(meta_key, chunk_duration_sec, format);
+	}
+
 	const media &get_media() {
 		if (m_memory_reader) {
 			return m_memory_reader->get_media();
@@ -512,11 +980,36 @@ private:
 	std::string m_tmp_file;
 	bool m_do_not_remove = false;
 
+	void create_tmp_file(const std::string &tmp_dir) {
+		static const std::string secure_xxx = "/XXXXXXXX";
+		m_tmp_file = tmp_dir + secure_xxx;
+
+		int err = mkstemp((char *)m_tmp_file.c_str());
+		if (err < 0) {
+			err = -errno;
+			std::ostringstream ss;
+			ss << "could not create temporary file: template: " << m_tmp_file <<
+				", error: " << strerror(-err) <<
+				" [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		m_fd = err;
+	}
+
 	void setup_file_reader() {
 		if (m_need_reset) {
 			fsync(m_fd);
 
 			m_file_reader.reset(new iso_reader(m_tmp_file.c_str()));
+			int err = m_file_reader->parse();
+			if (err) {
+				std::ostringstream ss;
+				ss << "could not parse temporary file: " << m_tmp_file <<
+					", error: " << gf_error_to_string((GF_Err)err);
+				throw std::runtime_error(ss.str());
+			}
+
 			m_need_reset = false;
 		}
 	}
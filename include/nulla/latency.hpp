@@ -0,0 +1,49 @@
+#ifndef __NULLA_LATENCY_HPP
+#define __NULLA_LATENCY_HPP
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// Sliding window of the last @size latency samples in microseconds.
+// Percentiles are computed over the whole window, it is cheap enough for windows
+// of several hundreds samples when it is done once per many samples.
+class latency_window {
+public:
+	latency_window(size_t size) : m_samples(size, 0) {
+	}
+
+	void add(long usec) {
+		m_samples[m_pos] = usec;
+		m_pos = (m_pos + 1) % m_samples.size();
+		if (m_count < m_samples.size())
+			m_count++;
+	}
+
+	size_t count() const {
+		return m_count;
+	}
+
+	// @q is in [0, 1], returns 0 if there are no samples yet
+	long percentile(double q) const {
+		if (m_count == 0)
+			return 0;
+
+		std::vector<long> tmp(m_samples.begin(), m_samples.begin() + m_count);
+
+		size_t pos = std::min(m_count - 1, (size_t)(q * m_count));
+		std::nth_element(tmp.begin(), tmp.begin() + pos, tmp.end());
+		return tmp[pos];
+	}
+
+private:
+	std::vector<long> m_samples;
+	size_t m_pos = 0;
+	size_t m_count = 0;
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_LATENCY_HPP
@@ -0,0 +1,209 @@
+#ifndef __NULLA_LOCAL_STORAGE_HPP
+#define __NULLA_LOCAL_STORAGE_HPP
+
+#include "nulla/storage.hpp"
+#include "nulla/thread_pool.hpp"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ioremap { namespace nulla {
+
+// Storage which keeps every object in its own file @root/bucket/key, bucket and key are escaped,
+// so that any byte string (metadata keys contain zero byte) maps to a single file name.
+// Files are accessed with pread()/pwrite() by a pool of @threads threads, it allows to run
+// the server on a single box without elliptics cluster, for example for benchmarks.
+class local_storage : public storage {
+public:
+	local_storage(const std::string &root, int threads) : m_root(root), m_pool(threads) {
+	}
+
+	virtual const char *name() const {
+		return "local";
+	}
+
+	virtual void read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) {
+		(void) trace;
+
+		const std::string path = object_path(bucket, key);
+		m_pool.enqueue([=] () {
+				elliptics::data_pointer data;
+				elliptics::error_info err = read_file(path, offset, size, data);
+				handler(data, err);
+			});
+	}
+
+	virtual void bulk_read(const std::string &bucket, const std::vector<std::string> &keys,
+			const storage_trace &trace, const bulk_read_handler_t &handler) {
+		(void) trace;
+
+		// every key is read by its own task, so that reads run in parallel as they do in elliptics
+		for (size_t i = 0; i < keys.size(); ++i) {
+			const std::string path = object_path(bucket, keys[i]);
+			m_pool.enqueue([=] () {
+					elliptics::data_pointer data;
+					elliptics::error_info err = read_file(path, 0, 0, data);
+					handler(i, data, err);
+				});
+		}
+	}
+
+	virtual void write(const std::string &bucket, const std::string &key, const elliptics::data_pointer &data,
+			uint64_t offset, const write_handler_t &handler) {
+		const std::string dir = bucket_path(bucket);
+		const std::string path = object_path(bucket, key);
+		m_pool.enqueue([=] () {
+				handler(write_file(dir, path, data, offset));
+			});
+	}
+
+	virtual void remove(const std::string &bucket, const std::string &key, const write_handler_t &handler) {
+		const std::string path = object_path(bucket, key);
+		m_pool.enqueue([=] () {
+				if (unlink(path.c_str()) < 0) {
+					int err = -errno;
+					handler(elliptics::create_error(err, "could not remove %s: %s",
+								path.c_str(), strerror(-err)));
+					return;
+				}
+
+				handler(elliptics::error_info());
+			});
+	}
+
+	// every byte except [A-Za-z0-9_.-] is encoded as %XX, leading dot is encoded too,
+	// so that neither "." nor ".." can be produced
+	static std::string escape(const std::string &name) {
+		static const char hex[] = "0123456789ABCDEF";
+
+		std::string ret;
+		ret.reserve(name.size());
+
+		for (size_t i = 0; i < name.size(); ++i) {
+			unsigned char ch = name[i];
+			if (isalnum(ch) || ch == '_' || ch == '-' || (ch == '.' && i != 0)) {
+				ret.push_back(ch);
+				continue;
+			}
+
+			ret.push_back('%');
+			ret.push_back(hex[ch >> 4]);
+			ret.push_back(hex[ch & 0xf]);
+		}
+
+		return ret;
+	}
+
+private:
+	std::string m_root;
+	thread_pool m_pool;
+
+	// escaped names never look like this, objects of the empty bucket live here
+	std::string bucket_path(const std::string &bucket) const {
+		return m_root + "/" + (bucket.empty() ? std::string("%index") : escape(bucket));
+	}
+
+	std::string object_path(const std::string &bucket, const std::string &key) const {
+		return bucket_path(bucket) + "/" + escape(key);
+	}
+
+	static elliptics::error_info read_file(const std::string &path, uint64_t offset, uint64_t size,
+			elliptics::data_pointer &data) {
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			int err = -errno;
+			return elliptics::create_error(err, "could not open %s: %s", path.c_str(), strerror(-err));
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int err = -errno;
+			close(fd);
+			return elliptics::create_error(err, "could not stat %s: %s", path.c_str(), strerror(-err));
+		}
+
+		if (offset > (uint64_t)st.st_size) {
+			close(fd);
+			return elliptics::create_error(-E2BIG, "%s: offset %lu is beyond the end of the object, size: %lu",
+					path.c_str(), offset, (uint64_t)st.st_size);
+		}
+
+		if (size == 0 || offset + size > (uint64_t)st.st_size)
+			size = st.st_size - offset;
+
+		data = elliptics::data_pointer::allocate(size);
+
+		uint64_t done = 0;
+		while (done < size) {
+			ssize_t err = pread(fd, data.data<char>() + done, size - done, offset + done);
+			if (err < 0) {
+				if (errno == EINTR)
+					continue;
+
+				int e = -errno;
+				close(fd);
+				return elliptics::create_error(e, "could not read %s, offset: %lu, size: %lu: %s",
+						path.c_str(), offset + done, size - done, strerror(-e));
+			}
+			if (err == 0)
+				break;
+
+			done += err;
+		}
+
+		close(fd);
+
+		if (done != size) {
+			data = data.slice(0, done);
+		}
+
+		return elliptics::error_info();
+	}
+
+	static elliptics::error_info write_file(const std::string &dir, const std::string &path,
+			const elliptics::data_pointer &data, uint64_t offset) {
+		if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+			int err = -errno;
+			return elliptics::create_error(err, "could not create directory %s: %s", dir.c_str(), strerror(-err));
+		}
+
+		int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+		if (offset == 0)
+			flags |= O_TRUNC;
+
+		int fd = open(path.c_str(), flags, 0644);
+		if (fd < 0) {
+			int err = -errno;
+			return elliptics::create_error(err, "could not open %s: %s", path.c_str(), strerror(-err));
+		}
+
+		const char *ptr = data.data<char>();
+		uint64_t done = 0;
+		while (done < data.size()) {
+			ssize_t err = pwrite(fd, ptr + done, data.size() - done, offset + done);
+			if (err < 0) {
+				if (errno == EINTR)
+					continue;
+
+				int e = -errno;
+				close(fd);
+				return elliptics::create_error(e, "could not write %s, offset: %lu, size: %lu: %s",
+						path.c_str(), offset + done, data.size() - done, strerror(-e));
+			}
+
+			done += err;
+		}
+
+		close(fd);
+		return elliptics::error_info();
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_LOCAL_STORAGE_HPP
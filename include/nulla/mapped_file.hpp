@@ -0,0 +1,86 @@
+#ifndef __NULLA_MAPPED_FILE_HPP
+#define __NULLA_MAPPED_FILE_HPP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+namespace ioremap { namespace nulla {
+
+// read-only private mapping of the whole file, @advice is passed to madvise()
+class mapped_file {
+public:
+	mapped_file(const std::string &file, int advice = MADV_SEQUENTIAL) {
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd < 0) {
+			int err = -errno;
+			std::ostringstream ss;
+			ss << "could not open file " << file << ", error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		struct stat st;
+		if (fstat(fd, &st) < 0) {
+			int err = -errno;
+			close(fd);
+
+			std::ostringstream ss;
+			ss << "could not stat file " << file << ", error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		if (st.st_size == 0) {
+			close(fd);
+
+			std::ostringstream ss;
+			ss << "could not map empty file " << file;
+			throw std::runtime_error(ss.str());
+		}
+
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (data == MAP_FAILED) {
+			int err = -errno;
+			std::ostringstream ss;
+			ss << "could not mmap file " << file << ", size: " << st.st_size <<
+				", error: " << strerror(-err) << " [" << err << "]";
+			throw std::runtime_error(ss.str());
+		}
+
+		madvise(data, st.st_size, advice);
+
+		m_data = (const char *)data;
+		m_size = st.st_size;
+	}
+
+	~mapped_file() {
+		munmap((void *)m_data, m_size);
+	}
+
+	mapped_file(const mapped_file &) = delete;
+	mapped_file &operator=(const mapped_file &) = delete;
+
+	const char *data() const {
+		return m_data;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+
+private:
+	const char *m_data;
+	size_t m_size;
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_MAPPED_FILE_HPP
@@ -6,12 +6,216 @@
 #include <elliptics/session.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <vector>
 
 namespace ioremap { namespace nulla {
 
+// sample table of the requested track split into time chunks,
+// chunks are read from the storage lazily when playback reaches them
+class chunked_sample_table {
+public:
+	typedef std::shared_ptr<const sample_span> chunk_t;
+
+	// whole sample table has been read (v2 or v3 metadata), it is split in memory anyway,
+	// so that every play request only copies samples it actually plays,
+	// chunks are views into the single table
+	void assign(std::vector<sample> &&samples, u64 chunk_dts) {
+		m_dir = split_sample_chunks(samples, chunk_dts);
+
+		sample_span table(std::move(samples));
+
+		std::vector<chunk_t> chunks;
+		for (const auto &ch: m_dir) {
+			chunks.emplace_back(std::make_shared<const sample_span>(table.slice(ch.sample_start, ch.sample_count)));
+		}
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_chunks.swap(chunks);
+	}
+
+	// only chunk directory is known (v4 metadata), chunks will be loaded via @set_chunk()
+	void assign_directory(const std::vector<sample_chunk> &dir) {
+		m_dir = dir;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_chunks.assign(m_dir.size(), chunk_t());
+	}
+
+	void set_chunk(size_t idx, sample_span &&samples) {
+		if (idx >= m_dir.size() || samples.size() != m_dir[idx].sample_count) {
+			elliptics::throw_error(-EINVAL, "sample chunk %zd mismatch: chunks: %zd, samples: %zd, must be: %d",
+					idx, m_dir.size(), samples.size(), idx < m_dir.size() ? m_dir[idx].sample_count : 0);
+		}
+
+		chunk_t ch = std::make_shared<const sample_span>(std::move(samples));
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (!m_chunks[idx])
+			m_chunks[idx] = ch;
+	}
+
+	chunk_t chunk(size_t idx) const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_chunks[idx];
+	}
+
+	const std::vector<sample_chunk> &directory() const {
+		return m_dir;
+	}
+
+	// memory held by the directory and the chunks loaded so far
+	size_t memory_footprint() const {
+		size_t ret = sizeof(*this) + m_dir.capacity() * sizeof(sample_chunk);
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		ret += m_chunks.capacity() * sizeof(chunk_t);
+		for (const auto &ch: m_chunks) {
+			if (ch)
+				ret += sizeof(sample_span) + ch->size() * sizeof(sample);
+		}
+
+		return ret;
+	}
+
+	size_t total_samples() const {
+		if (m_dir.empty())
+			return 0;
+
+		return m_dir.back().sample_start + m_dir.back().sample_count;
+	}
+
+	// index of the chunk which contains @dts
+	size_t chunk_index(u64 dts) const {
+		sample_chunk tmp;
+		tmp.dts_start = dts;
+
+		auto it = std::upper_bound(m_dir.begin(), m_dir.end(), tmp);
+		if (it == m_dir.begin())
+			return 0;
+
+		return std::distance(m_dir.begin(), it) - 1;
+	}
+
+	// index of the chunk which contains sample at position @pos
+	size_t chunk_index_by_position(size_t pos) const {
+		auto it = std::upper_bound(m_dir.begin(), m_dir.end(), pos,
+				[] (size_t pos, const sample_chunk &ch) { return pos < ch.sample_start; });
+		if (it == m_dir.begin())
+			return 0;
+
+		return std::distance(m_dir.begin(), it) - 1;
+	}
+
+	// returns sample position the same way @sample_position_from_dts() does,
+	// only chunk which contains @dts has to be loaded, since every chunk but the first one starts with RAP
+	// returns -EAGAIN if that chunk has not been loaded yet
+	ssize_t position_from_dts(u64 dts, bool want_rap) const {
+		if (m_dir.empty())
+			return -ENOENT;
+
+		const size_t idx = chunk_index(dts);
+		const sample_chunk &dir = m_dir[idx];
+
+		chunk_t ch = chunk(idx);
+		if (!ch)
+			return -EAGAIN;
+
+		const ssize_t total = total_samples();
+
+		sample tmp;
+		tmp.dts = dts;
+
+		auto it = std::upper_bound(ch->begin(), ch->end(), tmp);
+		if (it == ch->end() && idx == m_dir.size() - 1)
+			return -E2BIG;
+
+		ssize_t diff = std::distance(ch->begin(), it);
+		if (diff <= 0)
+			return -EINVAL;
+
+		ssize_t pos = dir.sample_start + diff - 1;
+
+		if (want_rap) {
+			do {
+				size_t local = pos - dir.sample_start;
+
+				// the first sample of the next chunk is always RAP
+				if (local >= ch->size() || (*ch)[local].is_rap)
+					return pos;
+			} while (++pos < total - 1);
+
+			return -ENOENT;
+		}
+
+		while (++pos < total - 1) {
+			size_t local = pos - dir.sample_start;
+
+			if (local >= ch->size() || (*ch)[local].is_rap) {
+				--pos;
+				break;
+			}
+		}
+
+		return pos;
+	}
+
+	// reads dts of the sample at position @pos,
+	// returns -EAGAIN if chunk which contains it has not been loaded and it is not the first sample in chunk
+	int sample_dts(size_t pos, u64 &dts) const {
+		if (pos >= total_samples())
+			return -E2BIG;
+
+		const size_t idx = chunk_index_by_position(pos);
+		const sample_chunk &dir = m_dir[idx];
+		if (pos == dir.sample_start) {
+			dts = dir.dts_start;
+			return 0;
+		}
+
+		chunk_t ch = chunk(idx);
+		if (!ch)
+			return -EAGAIN;
+
+		dts = (*ch)[pos - dir.sample_start].dts;
+		return 0;
+	}
+
+	// appends samples [@start, @end] to @dst, all chunks which contain them must be loaded
+	int copy(size_t start, size_t end, std::vector<sample> &dst) const {
+		if (end < start || end >= total_samples())
+			return -E2BIG;
+
+		dst.reserve(dst.size() + end - start + 1);
+
+		for (size_t idx = chunk_index_by_position(start); start <= end; ++idx) {
+			const sample_chunk &dir = m_dir[idx];
+
+			chunk_t ch = chunk(idx);
+			if (!ch)
+				return -EAGAIN;
+
+			size_t last = std::min<size_t>(end, dir.sample_start + dir.sample_count - 1);
+			dst.insert(dst.end(), ch->begin() + (start - dir.sample_start), ch->begin() + (last - dir.sample_start + 1));
+
+			start = last + 1;
+		}
+
+		return 0;
+	}
+
+private:
+	// directory is only changed before playlist is created, it is never updated when playlist is being played
+	std::vector<sample_chunk>	m_dir;
+
+	mutable std::mutex		m_lock;
+	std::vector<chunk_t>		m_chunks;
+};
+
 struct track_request {
 	std::string		bucket;
 	std::string		key;
@@ -50,6 +254,13 @@ struct track_request {
 
 	elliptics::data_pointer	sample_data;
 
+	// sample table of the requested track, it is shared among all copies of this track request
+	std::shared_ptr<chunked_sample_table> samples = std::make_shared<chunked_sample_table>();
+
+	// positions of the first and the last samples of the requested track to be played
+	size_t			sample_start = 0;
+	size_t			sample_end = 0;
+
 	const nulla::track &track() const {
 		if (requested_track_index == -1) {
 			elliptics::throw_error(-EINVAL, "track_request doesn't have valid @requested_track_index");
@@ -59,6 +270,29 @@ struct track_request {
 	}
 };
 
+static inline size_t memory_footprint(const track &t) {
+	return sizeof(t) + t.mime_type.capacity() + t.codec.capacity() +
+		t.esd.slconf.capacity() +
+		t.esd.dconf.decoderSpecificInfo.data.capacity() + t.esd.dconf.rvc_config.data.capacity() +
+		t.samples.capacity() * sizeof(sample) +
+		t.chunks.capacity() * sizeof(sample_chunk);
+}
+
+// sample tables are shared among copies of the track request, every table is counted once
+static inline size_t memory_footprint(const track_request &tr, std::set<const void *> &tables) {
+	size_t ret = sizeof(tr) + tr.bucket.capacity() + tr.key.capacity() + tr.meta_key.capacity() +
+		tr.sample_data.size();
+
+	for (const auto &t: tr.media.tracks) {
+		ret += memory_footprint(t);
+	}
+
+	if (tr.samples && tables.insert(tr.samples.get()).second)
+		ret += tr.samples->memory_footprint();
+
+	return ret;
+}
+
 struct representation {
 	std::string			id;
 
@@ -126,6 +360,19 @@ struct raw_playlist {
 	// duration is the longest duration among all representations
 	long					duration_msec = 0;
 
+	// time of the last stream request in milliseconds since epoch, playlist which has not been
+	// requested for the idle timeout is removed before it expires, see @expires_at
+	std::atomic_long			last_access_msec{0};
+
+	void touch() {
+		last_access_msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	std::chrono::system_clock::time_point last_access() const {
+		return std::chrono::system_clock::time_point(std::chrono::milliseconds(last_access_msec.load()));
+	}
+
 	// playlist ID which is returned to client
 	std::string				id;
 
@@ -133,6 +380,26 @@ struct raw_playlist {
 	std::string				base_url;
 
 	std::map<std::string, representation>	repr;
+
+	// memory accounted for this playlist when it was admitted, see @memory_footprint()
+	size_t					memory = 0;
+
+	// approximate memory held by the playlist: sample tables, media headers and decoder descriptors
+	size_t memory_footprint() const {
+		size_t ret = sizeof(*this) + type.capacity() + id.capacity() + base_url.capacity();
+
+		std::set<const void *> tables;
+		for (const auto &p: repr) {
+			ret += sizeof(p) + p.first.capacity() + p.second.id.capacity() +
+				p.second.tracks.capacity() * sizeof(track_request);
+
+			for (const auto &tr: p.second.tracks) {
+				ret += nulla::memory_footprint(tr, tables) - sizeof(tr);
+			}
+		}
+
+		return ret;
+	}
 };
 
 typedef std::shared_ptr<raw_playlist> playlist_t;
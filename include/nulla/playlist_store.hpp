@@ -0,0 +1,432 @@
+#ifndef __NULLA_PLAYLIST_STORE_HPP
+#define __NULLA_PLAYLIST_STORE_HPP
+
+#include "nulla/iso_reader.hpp"
+#include "nulla/playlist.hpp"
+#include "nulla/sha256.hpp"
+#include "nulla/storage.hpp"
+#include "nulla/utils.hpp"
+
+#include <elliptics/session.hpp>
+
+#include <msgpack.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// Playlists persisted in storage, so that any server can serve playlist created by another one.
+//
+// Only the compact definition is stored in @playlist_key(id) object in metadata groups: track requests
+// with clip boundaries resolved when manifest was created. Server which does not have the playlist
+// reads its definition and metadata headers of all tracks, sample table chunks are loaded
+// on demand the same way as for the playlists created locally.
+
+static inline std::string playlist_key(const std::string &id) {
+	return "nulla.playlist." + id;
+}
+
+struct stored_track_request {
+	std::string	bucket;
+	std::string	key;
+	std::string	meta_key;
+
+	u32		number = 0;
+
+	int64_t		start_msec = 0;
+	int64_t		duration_msec = 0;
+	int64_t		dts_start = 0;
+	int64_t		dts_first_sample_offset = 0;
+	int64_t		start_number = 0;
+
+	uint64_t	sample_start = 0;
+	uint64_t	sample_end = 0;
+
+	MSGPACK_DEFINE(bucket, key, meta_key, number, start_msec, duration_msec, dts_start,
+			dts_first_sample_offset, start_number, sample_start, sample_end);
+};
+
+struct stored_representation {
+	std::string				id;
+	int64_t					duration_msec = 0;
+	std::vector<stored_track_request>	tracks;
+
+	MSGPACK_DEFINE(id, duration_msec, tracks);
+};
+
+struct stored_playlist {
+	enum {
+		serialization_version_1 = 1,
+	};
+
+	int					version = serialization_version_1;
+
+	std::string				type;
+	int					chunk_duration_sec = 0;
+	// milliseconds since epoch
+	int64_t					expires_at = 0;
+	int64_t					duration_msec = 0;
+
+	std::vector<stored_representation>	repr;
+
+	MSGPACK_DEFINE(version, type, chunk_duration_sec, expires_at, duration_msec, repr);
+};
+
+static inline std::string pack_playlist(const raw_playlist &playlist) {
+	stored_playlist sp;
+	sp.type = playlist.type;
+	sp.chunk_duration_sec = playlist.chunk_duration_sec;
+	sp.expires_at = std::chrono::duration_cast<std::chrono::milliseconds>(
+			playlist.expires_at.time_since_epoch()).count();
+	sp.duration_msec = playlist.duration_msec;
+
+	for (const auto &p: playlist.repr) {
+		stored_representation srepr;
+		srepr.id = p.second.id;
+		srepr.duration_msec = p.second.duration_msec;
+
+		for (const auto &tr: p.second.tracks) {
+			stored_track_request str;
+			str.bucket = tr.bucket;
+			str.key = tr.key;
+			str.meta_key = tr.meta_key;
+			str.number = tr.requested_track_number;
+			str.start_msec = tr.start_msec;
+			str.duration_msec = tr.duration_msec;
+			str.dts_start = tr.dts_start;
+			str.dts_first_sample_offset = tr.dts_first_sample_offset;
+			str.start_number = tr.start_number;
+			str.sample_start = tr.sample_start;
+			str.sample_end = tr.sample_end;
+
+			srepr.tracks.emplace_back(std::move(str));
+		}
+
+		sp.repr.emplace_back(std::move(srepr));
+	}
+
+	std::stringstream buffer;
+	msgpack::pack(buffer, sp);
+	return buffer.str();
+}
+
+// throws on invalid data, track requests do not have media and sample tables yet
+static inline void unpack_playlist(const char *data, size_t size, raw_playlist &playlist) {
+	msgpack::unpacked result;
+	msgpack::unpack(&result, data, size);
+
+	stored_playlist sp;
+	result.get().convert(&sp);
+
+	if (sp.version != stored_playlist::serialization_version_1) {
+		std::ostringstream ss;
+		ss << "playlist unpack: version mismatch: read: " << sp.version <<
+			", there is no such packing version";
+		throw std::runtime_error(ss.str());
+	}
+
+	playlist.type = sp.type;
+	playlist.chunk_duration_sec = sp.chunk_duration_sec;
+	playlist.expires_at = std::chrono::system_clock::time_point(std::chrono::milliseconds(sp.expires_at));
+	playlist.duration_msec = sp.duration_msec;
+
+	for (const auto &srepr: sp.repr) {
+		representation repr;
+		repr.id = srepr.id;
+		repr.duration_msec = srepr.duration_msec;
+
+		for (const auto &str: srepr.tracks) {
+			track_request tr;
+			tr.bucket = str.bucket;
+			tr.key = str.key;
+			tr.meta_key = str.meta_key;
+			tr.requested_track_number = str.number;
+			tr.start_msec = str.start_msec;
+			tr.duration_msec = str.duration_msec;
+			tr.dts_start = str.dts_start;
+			tr.dts_first_sample_offset = str.dts_first_sample_offset;
+			tr.start_number = str.start_number;
+			tr.sample_start = str.sample_start;
+			tr.sample_end = str.sample_end;
+
+			repr.tracks.emplace_back(std::move(tr));
+		}
+
+		playlist.repr.insert(std::make_pair(repr.id, std::move(repr)));
+	}
+}
+
+// Self-contained playlist ids carry the packed definition authenticated with HMAC-SHA256:
+// base64url(definition) "." base64url(truncated mac). Any server which knows the key reconstructs
+// the playlist from its id and track metadata, there is no shared playlist store.
+enum {
+	playlist_id_mac_size = 16,
+};
+
+static inline std::string base64url_encode(const void *data, size_t size) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	const unsigned char *p = (const unsigned char *)data;
+
+	std::string ret;
+	ret.reserve((size * 4 + 2) / 3);
+
+	for (size_t i = 0; i < size; i += 3) {
+		uint32_t v = p[i] << 16;
+		if (i + 1 < size)
+			v |= p[i + 1] << 8;
+		if (i + 2 < size)
+			v |= p[i + 2];
+
+		ret.push_back(alphabet[(v >> 18) & 0x3f]);
+		ret.push_back(alphabet[(v >> 12) & 0x3f]);
+		if (i + 1 < size)
+			ret.push_back(alphabet[(v >> 6) & 0x3f]);
+		if (i + 2 < size)
+			ret.push_back(alphabet[v & 0x3f]);
+	}
+
+	return ret;
+}
+
+// returns false if @str is not unpadded base64url, unused bits of the last character must be zero,
+// so that every byte string has exactly one encoding
+static inline bool base64url_decode(const char *str, size_t size, std::string &out) {
+	if (size % 4 == 1)
+		return false;
+
+	out.clear();
+	out.reserve(size * 3 / 4);
+
+	uint32_t v = 0;
+	int bits = 0;
+	for (size_t i = 0; i < size; ++i) {
+		char c = str[i];
+		int d;
+		if (c >= 'A' && c <= 'Z')
+			d = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			d = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			d = c - '0' + 52;
+		else if (c == '-')
+			d = 62;
+		else if (c == '_')
+			d = 63;
+		else
+			return false;
+
+		v = (v << 6) | d;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out.push_back((v >> bits) & 0xff);
+		}
+	}
+
+	return (v & ((1U << bits) - 1)) == 0;
+}
+
+static inline std::string sign_playlist_id(const std::string &definition, const std::string &key) {
+	unsigned char mac[sha256::digest_size];
+	hmac_sha256(key, definition.data(), definition.size(), mac);
+
+	return base64url_encode(definition.data(), definition.size()) + "." +
+		base64url_encode(mac, playlist_id_mac_size);
+}
+
+// returns false if @id is malformed or its mac does not match, @definition is only valid if true is returned
+static inline bool verify_playlist_id(const std::string &id, const std::string &key, std::string &definition) {
+	size_t pos = id.find('.');
+	if (pos == std::string::npos)
+		return false;
+
+	std::string mac;
+	if (!base64url_decode(id.data() + pos + 1, id.size() - pos - 1, mac) || mac.size() != playlist_id_mac_size)
+		return false;
+
+	if (!base64url_decode(id.data(), pos, definition))
+		return false;
+
+	unsigned char expected[sha256::digest_size];
+	hmac_sha256(key, definition.data(), definition.size(), expected);
+
+	// constant time comparison, so that mac can not be guessed byte by byte
+	unsigned char diff = 0;
+	for (size_t i = 0; i < playlist_id_mac_size; ++i) {
+		diff |= expected[i] ^ (unsigned char)mac[i];
+	}
+
+	return diff == 0;
+}
+
+// Reads playlist definition @playlist_key(id) or takes it from the self-contained id,
+// then reads metadata of all its tracks.
+// Completion handler is invoked once, either with the playlist or with the first error.
+class playlist_loader : public std::enable_shared_from_this<playlist_loader> {
+public:
+	typedef std::function<void (const playlist_t &, const elliptics::error_info &)> completion_t;
+
+	playlist_loader(const std::shared_ptr<storage> &st, const std::string &id, const storage_trace &trace,
+			const completion_t &complete)
+	: m_storage(st), m_trace(trace), m_complete(complete), m_playlist(std::make_shared<raw_playlist>()) {
+		m_playlist->id = id;
+	}
+
+	void start() {
+		m_storage->read_whole(std::string(), playlist_key(m_playlist->id), m_trace,
+			std::bind(&playlist_loader::on_read_playlist, shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	// definition has already been extracted from the self-contained id, only metadata is read
+	void start(const std::string &definition) {
+		load(definition.data(), definition.size());
+	}
+
+private:
+	std::shared_ptr<storage> m_storage;
+	storage_trace m_trace;
+	completion_t m_complete;
+
+	playlist_t m_playlist;
+
+	std::atomic_int m_pending{0};
+	std::atomic_bool m_failed{false};
+
+	void on_read_playlist(const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error) {
+			complete(elliptics::create_error(error.code(), "could not read playlist: %s",
+						error.message().c_str()));
+			return;
+		}
+
+		load(dp.data<char>(), dp.size());
+	}
+
+	void load(const char *data, size_t size) {
+		try {
+			unpack_playlist(data, size, *m_playlist);
+		} catch (const std::exception &e) {
+			complete(elliptics::create_error(-EINVAL, "could not unpack playlist: %s", e.what()));
+			return;
+		}
+
+		std::vector<track_request *> tracks;
+		for (auto &p: m_playlist->repr) {
+			for (auto &tr: p.second.tracks) {
+				tracks.push_back(&tr);
+			}
+		}
+
+		if (tracks.empty()) {
+			complete(elliptics::create_error(-EINVAL, "playlist does not have tracks"));
+			return;
+		}
+
+		// every callback updates its own track request, neither repr map nor track vectors are changed
+		m_pending = tracks.size();
+		for (auto tr: tracks) {
+			m_storage->read_whole(tr->bucket, tr->meta_key, m_trace,
+				std::bind(&playlist_loader::on_read_meta, shared_from_this(), tr,
+					std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	void on_read_meta(track_request *tr, const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error) {
+			complete(elliptics::create_error(error.code(), "bucket: %s, meta_key: %s: could not read metadata: %s",
+						tr->bucket.c_str(), tr->meta_key.c_str(), error.message().c_str()));
+			return;
+		}
+
+		try {
+			unpack_media(dp.data<char>(), dp.size(), tr->media);
+		} catch (const std::exception &e) {
+			complete(elliptics::create_error(-EINVAL, "bucket: %s, meta_key: %s: could not unpack metadata: %s",
+						tr->bucket.c_str(), tr->meta_key.c_str(), e.what()));
+			return;
+		}
+
+		for (size_t i = 0; i < tr->media.tracks.size(); ++i) {
+			if (tr->media.tracks[i].number == tr->requested_track_number) {
+				tr->requested_track_index = i;
+				break;
+			}
+		}
+
+		if (tr->requested_track_index == -1) {
+			complete(elliptics::create_error(-ENOENT, "bucket: %s, meta_key: %s: there is no track number %d",
+						tr->bucket.c_str(), tr->meta_key.c_str(), tr->requested_track_number));
+			return;
+		}
+
+		track &t = tr->media.tracks[tr->requested_track_index];
+
+		switch (tr->media.version) {
+		case media::serialization_version_3:
+			m_storage->read_whole(tr->bucket, sample_table_key(tr->meta_key, tr->requested_track_number), m_trace,
+				std::bind(&playlist_loader::on_read_sample_table, shared_from_this(), tr,
+					std::placeholders::_1, std::placeholders::_2));
+			return;
+		case media::serialization_version_4:
+		case media::serialization_binary_1:
+			tr->samples->assign_directory(t.chunks);
+			break;
+		default:
+			tr->samples->assign(std::move(t.samples), (u64)sample_chunk_duration_sec * t.media_timescale);
+
+			for (auto &other: tr->media.tracks) {
+				std::vector<sample>().swap(other.samples);
+			}
+			break;
+		}
+
+		track_loaded();
+	}
+
+	void on_read_sample_table(track_request *tr, const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error) {
+			complete(elliptics::create_error(error.code(), "bucket: %s, meta_key: %s: could not read sample table: %s",
+						tr->bucket.c_str(), tr->meta_key.c_str(), error.message().c_str()));
+			return;
+		}
+
+		std::vector<sample> samples;
+		try {
+			sample_table::unpack(dp.data<char>(), dp.size(), samples);
+		} catch (const std::exception &e) {
+			complete(elliptics::create_error(-EINVAL, "bucket: %s, meta_key: %s: could not unpack sample table: %s",
+						tr->bucket.c_str(), tr->meta_key.c_str(), e.what()));
+			return;
+		}
+
+		tr->samples->assign(std::move(samples), (u64)sample_chunk_duration_sec * tr->track().media_timescale);
+		track_loaded();
+	}
+
+	void track_loaded() {
+		if (--m_pending == 0)
+			complete(elliptics::error_info());
+	}
+
+	void complete(const elliptics::error_info &error) {
+		if (error) {
+			if (!m_failed.exchange(true))
+				m_complete(playlist_t(), error);
+			return;
+		}
+
+		if (!m_failed)
+			m_complete(m_playlist, error);
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_PLAYLIST_STORE_HPP
@@ -0,0 +1,121 @@
+#ifndef __NULLA_REGISTRY_HPP
+#define __NULLA_REGISTRY_HPP
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace ioremap { namespace nulla {
+
+// Hash map split into @Shards independently locked shards by the hash of the key,
+// requests for different keys almost never wait for each other. Lock acquisitions
+// which had to wait are counted, so that contention can be seen in statistics.
+// Counters live in the shards and are only updated under the shard lock, so that shards
+// do not share a cache line.
+template <typename T, size_t Shards = 64>
+class registry {
+	static_assert((Shards & (Shards - 1)) == 0, "number of shards must be a power of 2");
+public:
+	// returns false if there is already an element with the same key
+	bool insert(const std::string &key, const T &value) {
+		shard &sh = get_shard(key);
+		std::unique_lock<std::mutex> guard(sh.lock, std::defer_lock);
+		lock(sh, guard);
+
+		return sh.map.insert(std::make_pair(key, value)).second;
+	}
+
+	// returns default constructed value if there is no such key
+	T find(const std::string &key) {
+		shard &sh = get_shard(key);
+		std::unique_lock<std::mutex> guard(sh.lock, std::defer_lock);
+		lock(sh, guard);
+
+		sh.lookups++;
+
+		auto it = sh.map.find(key);
+		if (it == sh.map.end())
+			return T();
+
+		return it->second;
+	}
+
+	bool erase(const std::string &key) {
+		shard &sh = get_shard(key);
+		std::unique_lock<std::mutex> guard(sh.lock, std::defer_lock);
+		lock(sh, guard);
+
+		return sh.map.erase(key) != 0;
+	}
+
+	// calls @func(key, value) for every element shard by shard, @func must not access the registry
+	template <typename Func>
+	void for_each(Func func) const {
+		for (const auto &sh: m_shards) {
+			std::lock_guard<std::mutex> guard(sh.lock);
+			for (const auto &p: sh.map) {
+				func(p.first, p.second);
+			}
+		}
+	}
+
+	size_t size() const {
+		size_t ret = 0;
+		for (const auto &sh: m_shards) {
+			std::lock_guard<std::mutex> guard(sh.lock);
+			ret += sh.map.size();
+		}
+
+		return ret;
+	}
+
+	void get_statistics(const std::string &prefix, std::map<std::string, std::string> &stats) const {
+		uint64_t lookups = 0, locks = 0, contended = 0;
+		for (const auto &sh: m_shards) {
+			lookups += sh.lookups;
+			locks += sh.locks;
+			contended += sh.contended;
+		}
+
+		stats[prefix + "_size"] = std::to_string(size());
+		stats[prefix + "_lookups"] = std::to_string(lookups);
+		stats[prefix + "_locks"] = std::to_string(locks);
+		stats[prefix + "_contended_locks"] = std::to_string(contended);
+	}
+
+private:
+	struct shard {
+		mutable std::mutex lock;
+		std::unordered_map<std::string, T> map;
+
+		// written under @lock, atomic only to be read by statistics without it
+		std::atomic<uint64_t> lookups{0};
+		std::atomic<uint64_t> locks{0};
+		std::atomic<uint64_t> contended{0};
+
+		// lock and counters of the neighbouring shards never share a cache line
+		char padding[64];
+	};
+
+	shard m_shards[Shards];
+
+	shard &get_shard(const std::string &key) {
+		return m_shards[std::hash<std::string>()(key) & (Shards - 1)];
+	}
+
+	void lock(shard &sh, std::unique_lock<std::mutex> &guard) {
+		if (!guard.try_lock()) {
+			guard.lock();
+			sh.contended++;
+		}
+
+		sh.locks++;
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_REGISTRY_HPP
@@ -7,6 +7,7 @@
 #include <gpac/sync_layer.h>
 
 #include <algorithm>
+#include <memory>
 #include <sstream>
 #include <vector>
 
@@ -71,6 +72,90 @@ ssize_t sample_position_from_dts(const std::vector<sample> &collection, u64 dts,
 	return diff;
 }
 
+// read-only view of contiguous samples, it keeps memory it points to alive,
+// which is either a vector of unpacked samples or a buffer with binary sample table
+class sample_span {
+public:
+	typedef const sample *const_iterator;
+
+	sample_span() {}
+	sample_span(std::vector<sample> &&samples) {
+		auto v = std::make_shared<std::vector<sample>>(std::move(samples));
+		m_data = v->data();
+		m_size = v->size();
+		m_owner = v;
+	}
+	sample_span(const std::shared_ptr<const void> &owner, const sample *data, size_t size) :
+		m_owner(owner), m_data(data), m_size(size) {}
+
+	const_iterator begin() const {
+		return m_data;
+	}
+	const_iterator end() const {
+		return m_data + m_size;
+	}
+
+	size_t size() const {
+		return m_size;
+	}
+	bool empty() const {
+		return m_size == 0;
+	}
+
+	const sample &operator[](size_t pos) const {
+		return m_data[pos];
+	}
+
+	// returns view of @count samples starting at @start which shares memory with this one
+	sample_span slice(size_t start, size_t count) const {
+		return sample_span(m_owner, m_data + start, count);
+	}
+
+private:
+	std::shared_ptr<const void>	m_owner;
+	const sample			*m_data = NULL;
+	size_t				m_size = 0;
+};
+
+// directory entry of the sample table which is stored in multiple time chunks,
+// every chunk but the first one starts with random access point
+struct sample_chunk {
+	u64		dts_start = 0;
+	u32		sample_start = 0;
+	u32		sample_count = 0;
+
+	bool operator<(const sample_chunk &other) const {
+		return dts_start < other.dts_start;
+	}
+
+	MSGPACK_DEFINE(dts_start, sample_start, sample_count);
+};
+
+// default duration of the sample table chunk
+static const long sample_chunk_duration_sec = 600;
+
+// splits @samples into chunks which are at least @chunk_dts long,
+// new chunk is only started at random access point,
+// thus samples lookup never has to scan into the next chunk to find RAP
+static inline std::vector<sample_chunk> split_sample_chunks(const std::vector<sample> &samples, u64 chunk_dts) {
+	std::vector<sample_chunk> chunks;
+
+	for (size_t i = 0; i < samples.size(); ++i) {
+		const sample &sam = samples[i];
+
+		if (chunks.empty() || (chunk_dts && sam.is_rap && sam.dts - chunks.back().dts_start >= chunk_dts)) {
+			sample_chunk ch;
+			ch.dts_start = sam.dts;
+			ch.sample_start = i;
+			chunks.push_back(ch);
+		}
+
+		chunks.back().sample_count++;
+	}
+
+	return chunks;
+}
+
 struct descriptor {
 	u8			tag = 0;
 	std::vector<char>	data;
@@ -194,6 +279,10 @@ struct esd {
 struct track {
 	enum {
 		serialize_version_1 = 1,
+		// track header without sample table
+		serialize_version_2 = 2,
+		// track header with sample table chunk directory
+		serialize_version_3 = 3,
 	};
 
 	u32		media_type = 0;
@@ -345,6 +434,9 @@ struct track {
 
 	std::vector<sample>	samples;
 
+	// directory of the sample table chunks, only present in v4 metadata layout
+	std::vector<sample_chunk> chunks;
+
 	ssize_t sample_position_from_dts(u64 dts, bool want_rap) const {
 		return nulla::sample_position_from_dts(samples, dts, want_rap);
 	}
@@ -372,6 +464,7 @@ struct track {
 		   << ", audio: " << audio.str()
 		   << ", video: " << video.str()
 		   << ", samples: " << samples.size()
+		   << ", chunks: " << chunks.size()
 		   ;
 
 		return ss.str();
@@ -381,25 +474,28 @@ struct track {
 	void msgpack_pack(msgpack::packer<Stream> &o) const {
 		o.pack_array(18);
 		o.pack((int)track::serialize_version_1);
-		o.pack(media_type);
-		o.pack(media_subtype);
-		o.pack(media_subtype_mpeg4);
-		o.pack(media_timescale);
-		o.pack(media_duration);
-		o.pack(mime_type);
-		o.pack(codec);
-		o.pack(id);
-		o.pack(number);
-		o.pack(timescale);
-		o.pack(duration);
-		o.pack(bandwidth);
-		o.pack(data_size);
-		o.pack(audio);
-		o.pack(video);
-		o.pack(esd);
+		pack_header_fields(o);
 		o.pack(samples);
 	}
 
+	// packs track without its sample table, v3 metadata layout stores samples in separate object
+	template <typename Stream>
+	void msgpack_pack_header(msgpack::packer<Stream> &o) const {
+		o.pack_array(17);
+		o.pack((int)track::serialize_version_2);
+		pack_header_fields(o);
+	}
+
+	// packs track header and directory of the sample table chunks,
+	// chunks themselves are stored in separate objects
+	template <typename Stream>
+	void msgpack_pack_header(msgpack::packer<Stream> &o, const std::vector<sample_chunk> &chunks) const {
+		o.pack_array(18);
+		o.pack((int)track::serialize_version_3);
+		pack_header_fields(o);
+		o.pack(chunks);
+	}
+
 	void msgpack_unpack(msgpack::object o) {
 		if (o.type != msgpack::type::ARRAY) {
 			std::ostringstream ss;
@@ -415,24 +511,16 @@ struct track {
 
 		switch (version) {
 		case track::serialize_version_1:
-			p[1].convert(&media_type);
-			p[2].convert(&media_subtype);
-			p[3].convert(&media_subtype_mpeg4);
-			p[4].convert(&media_timescale);
-			p[5].convert(&media_duration);
-			p[6].convert(&mime_type);
-			p[7].convert(&codec);
-			p[8].convert(&id);
-			p[9].convert(&number);
-			p[10].convert(&timescale);
-			p[11].convert(&duration);
-			p[12].convert(&bandwidth);
-			p[13].convert(&data_size);
-			p[14].convert(&audio);
-			p[15].convert(&video);
-			p[16].convert(&esd);
+			unpack_header_fields(p);
 			p[17].convert(&samples);
 			break;
+		case track::serialize_version_2:
+			unpack_header_fields(p);
+			break;
+		case track::serialize_version_3:
+			unpack_header_fields(p);
+			p[17].convert(&chunks);
+			break;
 		default: {
 			std::ostringstream ss;
 			ss << "could not unpack track, invalid version " << version;
@@ -440,6 +528,46 @@ struct track {
 		}
 		}
 	}
+
+private:
+	template <typename Stream>
+	void pack_header_fields(msgpack::packer<Stream> &o) const {
+		o.pack(media_type);
+		o.pack(media_subtype);
+		o.pack(media_subtype_mpeg4);
+		o.pack(media_timescale);
+		o.pack(media_duration);
+		o.pack(mime_type);
+		o.pack(codec);
+		o.pack(id);
+		o.pack(number);
+		o.pack(timescale);
+		o.pack(duration);
+		o.pack(bandwidth);
+		o.pack(data_size);
+		o.pack(audio);
+		o.pack(video);
+		o.pack(esd);
+	}
+
+	void unpack_header_fields(msgpack::object *p) {
+		p[1].convert(&media_type);
+		p[2].convert(&media_subtype);
+		p[3].convert(&media_subtype_mpeg4);
+		p[4].convert(&media_timescale);
+		p[5].convert(&media_duration);
+		p[6].convert(&mime_type);
+		p[7].convert(&codec);
+		p[8].convert(&id);
+		p[9].convert(&number);
+		p[10].convert(&timescale);
+		p[11].convert(&duration);
+		p[12].convert(&bandwidth);
+		p[13].convert(&data_size);
+		p[14].convert(&audio);
+		p[15].convert(&video);
+		p[16].convert(&esd);
+	}
 };
 
 
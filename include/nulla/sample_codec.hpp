@@ -0,0 +1,127 @@
+#ifndef __NULLA_SAMPLE_CODEC_HPP
+#define __NULLA_SAMPLE_CODEC_HPP
+
+#include "nulla/sample.hpp"
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// Delta + varint sample table encoding.
+//
+// Sample tables are very regular: dts grows by the same duration, samples mostly follow each other
+// in the file, di is almost always 1. Every sample is encoded as a sequence of LEB128 varints:
+//	zigzag(dts delta - previous dts delta)
+//	zigzag(offset - (previous offset + previous length))
+//	length
+//	cts_offset
+//	di << 1 | is_rap
+// which takes 5-8 bytes per sample instead of 25-30 bytes of msgpack integers.
+
+static inline void varint_encode(std::string &out, u64 value) {
+	while (value >= 0x80) {
+		out.push_back((char)(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back((char)value);
+}
+
+static inline u64 zigzag_encode(s64 value) {
+	return ((u64)value << 1) ^ (u64)(value >> 63);
+}
+
+static inline s64 zigzag_decode(u64 value) {
+	return (s64)(value >> 1) ^ -(s64)(value & 1);
+}
+
+static inline void encode_samples(const sample *samples, size_t count, std::string &out) {
+	out.reserve(out.size() + count * 8);
+
+	u64 prev_dts = 0, prev_end = 0;
+	s64 prev_delta = 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const sample &sam = samples[i];
+
+		s64 delta = sam.dts - prev_dts;
+		varint_encode(out, zigzag_encode(delta - prev_delta));
+		varint_encode(out, zigzag_encode(sam.offset - prev_end));
+		varint_encode(out, sam.length);
+		varint_encode(out, sam.cts_offset);
+		varint_encode(out, ((u64)sam.di << 1) | (sam.is_rap ? 1 : 0));
+
+		prev_dts = sam.dts;
+		prev_delta = delta;
+		prev_end = sam.offset + sam.length;
+	}
+}
+
+class varint_decoder {
+public:
+	varint_decoder(const char *data, size_t size) :
+		m_pos((const unsigned char *)data), m_end((const unsigned char *)data + size) {}
+
+	u64 next() {
+		u64 value = 0;
+		int shift = 0;
+
+		while (m_pos < m_end && shift < 64) {
+			unsigned char byte = *m_pos++;
+
+			value |= (u64)(byte & 0x7f) << shift;
+			if (!(byte & 0x80))
+				return value;
+
+			shift += 7;
+		}
+
+		throw std::runtime_error("sample table decode: truncated or invalid varint");
+	}
+
+private:
+	const unsigned char *m_pos;
+	const unsigned char *m_end;
+};
+
+// appends @count samples encoded with @encode_samples() into @samples
+static inline void decode_samples(const char *data, size_t size, size_t count, std::vector<sample> &samples) {
+	// every sample takes at least 5 bytes, do not trust @count to allocate memory
+	if (count > size / 5) {
+		std::ostringstream ss;
+		ss << "sample table decode: " << count << " samples can not be stored in " << size << " bytes";
+		throw std::runtime_error(ss.str());
+	}
+
+	varint_decoder dec(data, size);
+
+	size_t start = samples.size();
+	samples.resize(start + count);
+
+	u64 prev_dts = 0, prev_end = 0;
+	s64 prev_delta = 0;
+
+	for (size_t i = start; i < samples.size(); ++i) {
+		sample &sam = samples[i];
+
+		s64 delta = prev_delta + zigzag_decode(dec.next());
+		sam.dts = prev_dts + delta;
+		sam.offset = prev_end + zigzag_decode(dec.next());
+		sam.length = dec.next();
+		sam.cts_offset = dec.next();
+
+		u64 flags = dec.next();
+		sam.di = flags >> 1;
+		sam.is_rap = flags & 1;
+
+		prev_dts = sam.dts;
+		prev_delta = delta;
+		prev_end = sam.offset + sam.length;
+	}
+}
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_SAMPLE_CODEC_HPP
@@ -0,0 +1,198 @@
+#ifndef __NULLA_SHA256_HPP
+#define __NULLA_SHA256_HPP
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+namespace ioremap { namespace nulla {
+
+// Incremental SHA-256 (FIPS 180-4), uploaded data is hashed chunk by chunk
+// as it arrives, the whole object is never kept in memory.
+class sha256 {
+public:
+	enum {
+		digest_size = 32,
+	};
+
+	sha256() {
+		reset();
+	}
+
+	void reset() {
+		static const uint32_t init[8] = {
+			0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+		};
+
+		memcpy(m_state, init, sizeof(m_state));
+		m_total = 0;
+		m_buffered = 0;
+	}
+
+	void update(const void *data, size_t size) {
+		const unsigned char *p = (const unsigned char *)data;
+
+		m_total += size;
+
+		if (m_buffered) {
+			size_t sz = std::min(size, sizeof(m_buffer) - m_buffered);
+			memcpy(m_buffer + m_buffered, p, sz);
+			m_buffered += sz;
+			p += sz;
+			size -= sz;
+
+			if (m_buffered < sizeof(m_buffer))
+				return;
+
+			transform(m_buffer);
+			m_buffered = 0;
+		}
+
+		for (; size >= sizeof(m_buffer); p += sizeof(m_buffer), size -= sizeof(m_buffer)) {
+			transform(p);
+		}
+
+		memcpy(m_buffer, p, size);
+		m_buffered = size;
+	}
+
+	// finishes hashing, object has to be reset before it can be reused
+	void final(unsigned char digest[digest_size]) {
+		const uint64_t bits = m_total * 8;
+
+		static const unsigned char pad[64] = { 0x80 };
+		size_t pad_size = (m_buffered < 56) ? (56 - m_buffered) : (120 - m_buffered);
+		update(pad, pad_size);
+
+		unsigned char len[8];
+		for (int i = 0; i < 8; ++i) {
+			len[i] = bits >> (56 - 8 * i);
+		}
+		update(len, sizeof(len));
+
+		for (int i = 0; i < 8; ++i) {
+			digest[4 * i + 0] = m_state[i] >> 24;
+			digest[4 * i + 1] = m_state[i] >> 16;
+			digest[4 * i + 2] = m_state[i] >> 8;
+			digest[4 * i + 3] = m_state[i];
+		}
+	}
+
+	std::string final_hex() {
+		unsigned char digest[digest_size];
+		final(digest);
+
+		static const char hex[] = "0123456789abcdef";
+
+		std::string ret;
+		ret.reserve(digest_size * 2);
+		for (int i = 0; i < digest_size; ++i) {
+			ret.push_back(hex[digest[i] >> 4]);
+			ret.push_back(hex[digest[i] & 0xf]);
+		}
+
+		return ret;
+	}
+
+private:
+	uint32_t m_state[8];
+	uint64_t m_total;
+	unsigned char m_buffer[64];
+	size_t m_buffered;
+
+	static uint32_t rotr(uint32_t x, int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void transform(const unsigned char *block) {
+		static const uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+
+		uint32_t w[64];
+		for (int i = 0; i < 16; ++i) {
+			w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) |
+				((uint32_t)block[4 * i + 2] << 8) | (uint32_t)block[4 * i + 3];
+		}
+
+		for (int i = 16; i < 64; ++i) {
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+		uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+
+		for (int i = 0; i < 64; ++i) {
+			uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t t1 = h + s1 + ch + k[i] + w[i];
+			uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+			uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t t2 = s0 + maj;
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+		m_state[5] += f;
+		m_state[6] += g;
+		m_state[7] += h;
+	}
+};
+
+// HMAC-SHA256 (RFC 2104) of @data with @key
+static inline void hmac_sha256(const std::string &key, const void *data, size_t size,
+		unsigned char digest[sha256::digest_size]) {
+	unsigned char block[64] = {};
+	if (key.size() > sizeof(block)) {
+		sha256 kh;
+		kh.update(key.data(), key.size());
+		kh.final(block);
+	} else {
+		memcpy(block, key.data(), key.size());
+	}
+
+	unsigned char ipad[sizeof(block)], opad[sizeof(block)];
+	for (size_t i = 0; i < sizeof(block); ++i) {
+		ipad[i] = block[i] ^ 0x36;
+		opad[i] = block[i] ^ 0x5c;
+	}
+
+	unsigned char inner[sha256::digest_size];
+	sha256 h;
+	h.update(ipad, sizeof(ipad));
+	h.update(data, size);
+	h.final(inner);
+
+	h.reset();
+	h.update(opad, sizeof(opad));
+	h.update(inner, sizeof(inner));
+	h.final(digest);
+}
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_SHA256_HPP
@@ -0,0 +1,68 @@
+#ifndef __NULLA_STORAGE_HPP
+#define __NULLA_STORAGE_HPP
+
+#include <elliptics/session.hpp>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+struct storage_trace {
+	uint64_t	id = 0;
+	int		bit = 0;
+};
+
+// Asynchronous object storage used by the manifest and stream handlers.
+//
+// Objects are addressed by bucket and key, objects of the empty bucket are not bound to any bucket,
+// they are content index entries and aliases (see nulla/dedup.hpp). Completion handlers
+// can be invoked from storage threads, the same way elliptics invokes them from its io threads.
+class storage {
+public:
+	typedef std::function<void (const elliptics::data_pointer &, const elliptics::error_info &)> read_handler_t;
+	// invoked once for every key, @index is position of the key in the requested array
+	typedef std::function<void (size_t index, const elliptics::data_pointer &, const elliptics::error_info &)>
+		bulk_read_handler_t;
+	typedef std::function<void (const elliptics::error_info &)> write_handler_t;
+
+	virtual ~storage() {}
+
+	virtual const char *name() const = 0;
+
+	// reads @size bytes starting at @offset, zero @size means up to the end of the object
+	virtual void read(const std::string &bucket, const std::string &key, uint64_t offset, uint64_t size,
+			const storage_trace &trace, const read_handler_t &handler) = 0;
+
+	void read_whole(const std::string &bucket, const std::string &key,
+			const storage_trace &trace, const read_handler_t &handler) {
+		read(bucket, key, 0, 0, trace, handler);
+	}
+
+	virtual void bulk_read(const std::string &bucket, const std::vector<std::string> &keys,
+			const storage_trace &trace, const bulk_read_handler_t &handler) = 0;
+
+	// write at zero offset replaces the whole object
+	virtual void write(const std::string &bucket, const std::string &key, const elliptics::data_pointer &data,
+			uint64_t offset, const write_handler_t &handler) = 0;
+
+	// removes the object, cached data of the object is dropped too
+	virtual void remove(const std::string &bucket, const std::string &key, const write_handler_t &handler) = 0;
+
+	// drops cached data of the object, it is called when object has been uploaded again
+	virtual void invalidate(const std::string &bucket, const std::string &key) {
+		(void) bucket;
+		(void) key;
+	}
+
+	// storage counters exported through server statistics
+	virtual void get_statistics(std::map<std::string, std::string> &stats) const {
+		(void) stats;
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_STORAGE_HPP
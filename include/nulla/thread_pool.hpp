@@ -0,0 +1,71 @@
+#ifndef __NULLA_THREAD_POOL_HPP
+#define __NULLA_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// executes blocking file io off the server threads, queued tasks are completed before destruction
+class thread_pool {
+public:
+	thread_pool(int threads) {
+		for (int i = 0; i < std::max(threads, 1); ++i) {
+			m_threads.emplace_back(std::bind(&thread_pool::run, this));
+		}
+	}
+
+	~thread_pool() {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_need_exit = true;
+		}
+		m_wait.notify_all();
+
+		for (auto &th: m_threads) {
+			th.join();
+		}
+	}
+
+	void enqueue(const std::function<void ()> &task) {
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_tasks.push_back(task);
+		}
+		m_wait.notify_one();
+	}
+
+private:
+	bool m_need_exit = false;
+	std::mutex m_lock;
+	std::condition_variable m_wait;
+	std::deque<std::function<void ()>> m_tasks;
+	std::vector<std::thread> m_threads;
+
+	void run() {
+		while (true) {
+			std::function<void ()> task;
+
+			{
+				std::unique_lock<std::mutex> guard(m_lock);
+				m_wait.wait(guard, [&] { return m_need_exit || !m_tasks.empty(); });
+				if (m_tasks.empty())
+					return;
+
+				task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_THREAD_POOL_HPP
@@ -1,8 +1,14 @@
 #pragma once
 
 #include "nulla/asio.hpp"
+#include "nulla/dedup.hpp"
+#include "nulla/iso_reader.hpp"
 #include "nulla/jsonvalue.hpp"
 #include "nulla/log.hpp"
+#include "nulla/sha256.hpp"
+#include "nulla/upload_session.hpp"
+#include "nulla/utils.hpp"
+#include "nulla/write_pipeline.hpp"
 
 #include <swarm/url.hpp>
 
@@ -13,6 +19,12 @@
 
 #include <ebucket/bucket.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+#include <mutex>
+
 namespace ioremap { namespace nulla {
 
 static inline elliptics::data_pointer create_data(const boost::asio::const_buffer &buffer)
@@ -23,6 +35,13 @@ static inline elliptics::data_pointer create_data(const boost::asio::const_buffe
 	);
 }
 
+// metadata which is extracted from the uploaded file while it is being written
+struct upload_metadata_options {
+	bool			enabled = false;
+	long			chunk_duration_sec = sample_chunk_duration_sec;
+	metadata_format		format = metadata_format_msgpack;
+};
+
 struct upload_completion {
 	template <typename Allocator>
 	static void fill_upload_reply(const elliptics::write_result_entry &entry,
@@ -83,15 +102,30 @@ struct upload_completion {
 template <typename Server, typename Stream>
 class on_upload_base : public thevoid::buffered_request_stream<Server>, public std::enable_shared_from_this<Stream> {
 public:
+	~on_upload_base() {
+		if (m_upload_session)
+			m_upload_session->release();
+	}
+
 	virtual void on_request(const thevoid::http_request &req) {
 		m_timer.restart();
 
 		this->set_chunk_size(10 * 1024 * 1024);
 
+		std::string session_id;
+		bool dedup = this->server()->upload_dedup();
 		try {
 			const auto &query = this->request().url().query();
 			m_orig_offset = m_offset = query.item_value("offset", 0llu);
-			m_key = key(req);
+			m_key_str = key(req);
+			m_key = m_key_str;
+
+			if (auto id = query.item_value("session"))
+				session_id = *id;
+
+			dedup = query.item_value("dedup", dedup);
+			if (auto sha = query.item_value("sha256"))
+				m_sha_hint = *sha;
 		} catch (const std::exception &e) {
 			NLOG_ERROR("buffered-write: url: %s: invalid offset parameter: %s",
 					req.url().to_human_readable().c_str(), e.what());
@@ -104,21 +138,47 @@ public:
 		else
 			m_size = 0;
 
-		elliptics::error_info err = this->server()->bucket_processor()->get_bucket(m_size, m_bucket);
-		if (err) {
-			NLOG_ERROR("buffered-write: on_request: url: %s: could not find bucket for size: %ld: %s [%d]",
-					req.url().to_human_readable().c_str(), m_size, err.message().c_str(), err.code());
-			this->send_reply(swarm::http_response::service_unavailable);
-			return;
-		}
+		if (!session_id.empty()) {
+			if (!setup_upload_session(req, session_id))
+				return;
+		} else {
+			elliptics::error_info err = this->server()->bucket_processor()->get_bucket(m_size, m_bucket);
+			if (err) {
+				NLOG_ERROR("buffered-write: on_request: url: %s: could not find bucket for size: %ld: %s [%d]",
+						req.url().to_human_readable().c_str(), m_size, err.message().c_str(), err.code());
+				this->send_reply(swarm::http_response::service_unavailable);
+				return;
+			}
 
+			m_session.reset(new elliptics::session(m_bucket->session()));
+			m_object_size = m_orig_offset + m_size;
+		}
 
 		NLOG_INFO("buffered-write: on_request: url: %s, bucket: %s, key: %s, offset: %llu, size: %llu",
 				this->request().url().to_human_readable().c_str(),
 				m_bucket->name().c_str(), m_key.to_string().c_str(),
 				(unsigned long long)m_offset, (unsigned long long)m_size);
 
-		m_session.reset(new elliptics::session(m_bucket->session()));
+		// metadata is extracted from the request body if the whole file is uploaded in this request,
+		// request which completes resumable upload session reads its boxes back from the stored object instead
+		m_meta_enabled = this->server()->upload_metadata().enabled && m_orig_offset == 0 &&
+			m_size == m_object_size;
+		m_meta_from_object = this->server()->upload_metadata().enabled && !m_meta_enabled &&
+			m_upload_session && m_orig_offset + m_size == m_object_size;
+
+		m_pipeline.set_budget(this->server()->upload_inflight_bytes());
+
+		// checksum can only be calculated if the whole object is uploaded in this request
+		m_dedup = dedup && !m_upload_session && m_orig_offset == 0 && m_size == m_object_size;
+
+		// if client has provided the checksum and this content already exists,
+		// request body is only hashed to verify it and is not written
+		if (m_dedup && !m_sha_hint.empty()) {
+			std::transform(m_sha_hint.begin(), m_sha_hint.end(), m_sha_hint.begin(), ::tolower);
+			lookup_content(m_sha_hint);
+			return;
+		}
+
 		this->try_next_chunk();
 	}
 
@@ -128,18 +188,58 @@ public:
 		NLOG_INFO("buffered-write: on_chunk: url: %s, size: %zu, m_offset: %lu, flags: %u",
 				this->request().url().to_human_readable().c_str(), data.size(), m_offset, flags);
 
-		elliptics::async_write_result result = write(data, flags);
+		if (m_dedup)
+			m_sha.update(data.data(), data.size());
+
+		if (m_dedup_skip_write) {
+			m_offset += data.size();
+
+			if (flags & thevoid::buffered_request_stream<Server>::last_chunk) {
+				finish_skipped_upload();
+			} else {
+				this->try_next_chunk();
+			}
+			return;
+		}
+
+		feed_metadata(data);
+
+		const unsigned int oflags = object_flags(flags);
+
+		if (pipelined(oflags)) {
+			write_pipelined(data, flags, oflags);
+			return;
+		}
+
+		elliptics::async_write_result result = write(data, oflags);
+		const uint64_t offset = m_offset;
 		m_offset += data.size();
 
 		if (flags & thevoid::buffered_request_stream<Server>::last_chunk) {
-			result.connect(std::bind(&on_upload_base::on_write_finished, this->shared_from_this(),
-				std::placeholders::_1, std::placeholders::_2));
+			result.connect(std::bind(&on_upload_base::on_write_last, this->shared_from_this(),
+				offset, data.size(), std::placeholders::_1, std::placeholders::_2));
 		} else {
 			result.connect(std::bind(&on_upload_base::on_write_partial, this->shared_from_this(),
-				std::placeholders::_1, std::placeholders::_2));
+				offset, data.size(), std::placeholders::_1, std::placeholders::_2));
 		}
 	}
 
+	// request stream flags describe chunk position within request body, when request uploads
+	// only a part of the resumable upload session, object is prepared by the request
+	// which starts at zero offset and committed by the one which writes its tail
+	unsigned int object_flags(unsigned int flags) const {
+		if (!m_upload_session)
+			return flags;
+
+		unsigned int oflags = 0;
+		if ((flags & thevoid::buffered_request_stream<Server>::first_chunk) && !m_upload_session->prepared())
+			oflags |= thevoid::buffered_request_stream<Server>::first_chunk;
+		if ((flags & thevoid::buffered_request_stream<Server>::last_chunk) && m_orig_offset + m_size == m_object_size)
+			oflags |= thevoid::buffered_request_stream<Server>::last_chunk;
+
+		return oflags;
+	}
+
 	elliptics::async_write_result write(const elliptics::data_pointer &data, unsigned int flags) {
 		if (flags == thevoid::buffered_request_stream<Server>::single_chunk) {
 			NLOG_INFO("buffered-write: write-data-single-chunk: url: %s, offset: %lu, size: %zu",
@@ -149,7 +249,7 @@ public:
 			if (flags & thevoid::buffered_request_stream<Server>::first_chunk) {
 				NLOG_INFO("buffered-write: prepare: url: %s, offset: %lu, size: %lu",
 						this->request().url().to_human_readable().c_str(), m_offset, m_size);
-				return m_session->write_prepare(m_key, data, m_offset, m_offset + m_size);
+				return m_session->write_prepare(m_key, data, m_offset, m_object_size);
 			} else if (flags & thevoid::buffered_request_stream<Server>::last_chunk) {
 				NLOG_INFO("buffered-write: commit: url: %s, offset: %lu, size: %lu",
 						this->request().url().to_human_readable().c_str(), m_offset, m_offset + data.size());
@@ -173,6 +273,7 @@ public:
 	}
 
 private:
+	std::string m_key_str;
 	elliptics::key m_key;
 	ebucket::bucket m_bucket;
 	std::unique_ptr<elliptics::session> m_session;
@@ -180,8 +281,43 @@ private:
 	uint64_t m_offset, m_orig_offset;
 	uint64_t m_size;
 
+	// size of the whole object, it is larger than @m_orig_offset + @m_size
+	// if request only uploads a part of the resumable upload session
+	uint64_t m_object_size = 0;
+	upload_session_t m_upload_session;
+
 	ribosome::timer m_timer;
 
+	// size of the reads of the top-level box headers of the stored object, see @read_box_header()
+	enum {
+		box_header_size = 16,
+	};
+
+	bool m_meta_enabled = false;
+	bool m_meta_from_object = false;
+	std::unique_ptr<iso_stream_fallback_reader> m_meta_reader;
+	std::string m_meta_error;
+	size_t m_meta_objects = 0;
+	size_t m_meta_size = 0;
+	std::atomic_int m_meta_pending;
+	std::atomic_bool m_meta_failed;
+
+	elliptics::sync_write_result m_write_result;
+
+	// pipelined upload state, see @pipelined()
+	write_pipeline m_pipeline;
+	unsigned int m_last_chunk_flags = 0;
+	elliptics::data_pointer m_last_chunk;
+
+	// content deduplication state, see nulla/dedup.hpp
+	bool m_dedup = false;
+	sha256 m_sha;
+	std::string m_sha_hex;
+	std::string m_sha_hint;
+	bool m_dedup_skip_write = false;
+	bool m_duplicate = false;
+	content_ref m_dedup_target;
+
 	std::string key(const swarm::http_request &req) {
 		const auto &path = req.url().path_components();
 
@@ -189,7 +325,77 @@ private:
 		return req.url().path().substr(prefix_size);
 	}
 
-	void on_write_partial(const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+	// continuation of the resumable upload, data is written right after the already committed part
+	bool setup_upload_session(const thevoid::http_request &req, const std::string &id) {
+		upload_session_t session = this->server()->get_upload_session(id);
+		if (!session) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: there is no upload session %s",
+					req.url().to_human_readable().c_str(), id.c_str());
+			this->send_reply(swarm::http_response::not_found);
+			return false;
+		}
+
+		if (session->key() != m_key_str) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: upload session %s belongs to key %s",
+					req.url().to_human_readable().c_str(), id.c_str(), session->key().c_str());
+			this->send_reply(swarm::http_response::bad_request);
+			return false;
+		}
+
+		if (!session->acquire()) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: upload session %s is being uploaded by another request",
+					req.url().to_human_readable().c_str(), id.c_str());
+			this->send_reply(swarm::http_response::conflict);
+			return false;
+		}
+
+		// session is released by destructor from now on
+		m_upload_session = session;
+
+		const uint64_t committed = session->committed();
+		if (req.url().query().has_item("offset") && m_orig_offset != committed) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: upload session %s: offset %lu does not match "
+					"committed offset %lu",
+					req.url().to_human_readable().c_str(), id.c_str(), m_orig_offset, committed);
+			this->send_reply(swarm::http_response::conflict);
+			return false;
+		}
+
+		if (m_size == 0 || committed + m_size > session->size()) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: upload session %s: content length %lu "
+					"does not fit object, committed: %lu, size: %lu",
+					req.url().to_human_readable().c_str(), id.c_str(), m_size, committed, session->size());
+			this->send_reply(swarm::http_response::bad_request);
+			return false;
+		}
+
+		elliptics::error_info err = this->server()->bucket_processor()->find_bucket(session->bucket(), m_bucket);
+		if (err) {
+			NLOG_ERROR("buffered-write: on_request: url: %s: upload session %s: could not find bucket %s: %s [%d]",
+					req.url().to_human_readable().c_str(), id.c_str(), session->bucket().c_str(),
+					err.message().c_str(), err.code());
+			this->send_reply(swarm::http_response::service_unavailable);
+			return false;
+		}
+
+		m_orig_offset = m_offset = committed;
+		m_object_size = session->size();
+
+		// object may have been removed from some groups by previous requests
+		m_session.reset(new elliptics::session(m_bucket->session()));
+		m_session->set_groups(session->groups());
+
+		return true;
+	}
+
+	// [@offset, @offset + @size) range has been successfully written
+	void written(uint64_t offset, size_t size) {
+		if (m_upload_session)
+			m_upload_session->written(offset, size);
+	}
+
+	void on_write_partial(uint64_t offset, size_t size,
+			const elliptics::sync_write_result &result, const elliptics::error_info &error) {
 		if (error) {
 			NLOG_ERROR("buffered-write: on_write_partial: url: %s, partial write error: %s, "
 					"written: %zu/%zu, time: %ld msecs",
@@ -199,7 +405,121 @@ private:
 			return;
 		}
 
-		// continue only with the groups where update succeeded
+		written(offset, size);
+		update_groups(result, "on_write_partial");
+
+		this->try_next_chunk();
+	}
+
+	// plain writes between prepare and commit do not wait for each other as long as
+	// pipeline budget allows, prepare is always waited for, since plain writes need
+	// prepared object, and commit is only sent when all plain writes have been completed
+	bool pipelined(unsigned int flags) const {
+		return m_pipeline.budget() && m_size > 0 && !(flags & thevoid::buffered_request_stream<Server>::first_chunk);
+	}
+
+	void write_pipelined(const elliptics::data_pointer &chunk, unsigned int flags, unsigned int oflags) {
+		// request stream reuses its buffer for the next chunk while this one is still being written
+		elliptics::data_pointer data = elliptics::data_pointer::copy(chunk);
+
+		std::unique_lock<std::mutex> guard(m_pipeline.lock());
+
+		if (flags & thevoid::buffered_request_stream<Server>::last_chunk) {
+			m_last_chunk = data;
+			m_last_chunk_flags = oflags;
+			if (m_pipeline.finish_locked() == write_pipeline::commit) {
+				guard.unlock();
+				commit_last_chunk();
+			}
+			return;
+		}
+
+		uint64_t offset;
+		bool next;
+		if (!m_pipeline.start_locked(m_offset, data.size(), offset, next))
+			return;
+
+		const size_t inflight = m_pipeline.inflight_bytes_locked();
+
+		// groups of @m_session are updated by completion handlers
+		elliptics::session session = m_session->clone();
+		guard.unlock();
+
+		NLOG_INFO("buffered-write: pipelined-plain: url: %s, offset: %lu, size: %zu, inflight: %zu",
+				this->request().url().to_human_readable().c_str(), offset, data.size(), inflight);
+
+		session.write_plain(m_key, data, offset).connect(
+			std::bind(&on_upload_base::on_write_pipelined, this->shared_from_this(), offset, data.size(),
+				std::placeholders::_1, std::placeholders::_2));
+
+		if (next)
+			this->try_next_chunk();
+	}
+
+	void on_write_pipelined(uint64_t offset, size_t size,
+			const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		write_pipeline::action action;
+		size_t inflight;
+
+		{
+			std::lock_guard<std::mutex> guard(m_pipeline.lock());
+
+			action = m_pipeline.complete_locked(size, !error);
+			if (action == write_pipeline::ignored)
+				return;
+
+			// completions of concurrent writes update the same session and groups
+			if (action != write_pipeline::failed) {
+				written(offset, size);
+				update_groups(result, "on_write_pipelined");
+			}
+
+			inflight = m_pipeline.inflight_bytes_locked();
+		}
+
+		switch (action) {
+		case write_pipeline::failed:
+			NLOG_ERROR("buffered-write: on_write_pipelined: url: %s, partial write error: %s, "
+					"offset: %lu, size: %zu, inflight: %zu, time: %ld msecs",
+					this->request().url().to_human_readable().c_str(), error.message().c_str(),
+					offset, size, inflight, m_timer.elapsed());
+			this->on_write_finished(result, error);
+			break;
+		case write_pipeline::commit:
+			commit_last_chunk();
+			break;
+		case write_pipeline::next_chunk:
+			this->try_next_chunk();
+			break;
+		case write_pipeline::none:
+		case write_pipeline::ignored:
+			break;
+		}
+	}
+
+	// all plain writes have been completed, nobody else touches the session,
+	// the last chunk of the request is only written as plain if it does not end the object
+	void commit_last_chunk() {
+		const elliptics::data_pointer data = m_last_chunk;
+		const uint64_t offset = m_offset;
+
+		elliptics::async_write_result result = write(data, m_last_chunk_flags);
+		m_offset += data.size();
+
+		result.connect(std::bind(&on_upload_base::on_write_last, this->shared_from_this(),
+			offset, data.size(), std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_write_last(uint64_t offset, size_t size,
+			const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		if (!error)
+			written(offset, size);
+
+		on_write_finished(result, error);
+	}
+
+	// continue only with the groups where update succeeded
+	void update_groups(const elliptics::sync_write_result &result, const char *stage) {
 		std::vector<int> groups, rem_groups;
 
 		std::ostringstream sgroups, egroups;
@@ -224,22 +544,58 @@ private:
 			}
 		}
 
-		NLOG_INFO("buffered-write: on_write_partial: url: %s: "
+		NLOG_INFO("buffered-write: %s: url: %s: "
 				"success-groups: %s, error-groups: %s, offset: %lu, written: %zu/%zu, time: %ld msecs",
-				this->request().url().to_human_readable().c_str(), sgroups.str().c_str(), egroups.str().c_str(),
+				stage, this->request().url().to_human_readable().c_str(), sgroups.str().c_str(), egroups.str().c_str(),
 				m_offset, m_offset - m_orig_offset, m_size, m_timer.elapsed());
 
+		if (rem_groups.empty())
+			return;
+
 		elliptics::session tmp = m_session->clone();
 		tmp.set_groups(rem_groups);
 		tmp.remove(m_key);
 
-		m_session->set_groups(groups);
+		// concurrent pipelined writes may have already excluded some other groups
+		std::vector<int> current = m_session->get_groups();
+		current.erase(std::remove_if(current.begin(), current.end(), [&] (int group) {
+				return std::find(rem_groups.begin(), rem_groups.end(), group) != rem_groups.end();
+			}), current.end());
 
-		this->try_next_chunk();
+		m_session->set_groups(current);
+		if (m_upload_session)
+			m_upload_session->set_groups(current);
+	}
+
+	// every uploaded chunk is also fed to the streaming parser, so that metadata objects
+	// are written right after the data and file does not have to be read the second time
+	void feed_metadata(const elliptics::data_pointer &data) {
+		if (!m_meta_enabled)
+			return;
+
+		try {
+			if (!m_meta_reader) {
+				m_meta_reader.reset(new iso_stream_fallback_reader(this->server()->tmp_dir(),
+							data.data<char>(), data.size()));
+			} else {
+				m_meta_reader->feed(data.data<char>(), data.size());
+			}
+		} catch (const std::exception &e) {
+			NLOG_ERROR("buffered-write: feed-metadata: url: %s, offset: %lu, size: %zu: "
+					"could not parse metadata, it will not be written: %s",
+					this->request().url().to_human_readable().c_str(), m_offset, data.size(), e.what());
+
+			m_meta_error.assign(e.what());
+			m_meta_reader.reset();
+			m_meta_enabled = false;
+		}
 	}
 
 	void on_write_finished(const elliptics::sync_write_result &result,
 			const elliptics::error_info &error) {
+		// even failed write could have overwritten part of the object
+		invalidate_cache();
+
 		if (error) {
 			NLOG_ERROR("buffered-write: on_write_finished: url: %s, full write error: %s, "
 					"written: %zu/%zu, time: %ld msecs",
@@ -249,6 +605,578 @@ private:
 			return;
 		}
 
+		m_write_result = result;
+
+		if (m_dedup) {
+			m_sha_hex = m_sha.final_hex();
+			lookup_content(m_sha_hex);
+			return;
+		}
+
+		if (m_meta_from_object) {
+			try {
+				m_meta_reader.reset(new iso_stream_fallback_reader(this->server()->tmp_dir(), m_object_size));
+				m_meta_enabled = true;
+			} catch (const std::exception &e) {
+				NLOG_ERROR("buffered-write: on_write_finished: url: %s, key: %s, "
+						"could not create metadata reader, metadata will not be written: %s",
+						this->request().url().to_human_readable().c_str(), m_key_str.c_str(), e.what());
+				m_meta_error.assign(e.what());
+			}
+
+			read_box_header(0);
+			return;
+		}
+
+		write_metadata();
+	}
+
+	// committed object of the resumable upload session is not read back as a whole to extract its metadata,
+	// top-level boxes other than media data are read and written at their offsets into sparse temporary file
+	void read_box_header(uint64_t offset) {
+		if (!m_meta_enabled || offset >= m_object_size) {
+			write_metadata();
+			return;
+		}
+
+		const uint64_t size = std::min<uint64_t>(box_header_size, m_object_size - offset);
+
+		m_session->read_data(m_key, offset, size).connect(
+			std::bind(&on_upload_base::on_box_header_read, this->shared_from_this(), offset,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_box_header_read(uint64_t offset, const elliptics::sync_read_result &result,
+			const elliptics::error_info &error) {
+		if (error) {
+			object_read_failed(offset, error.message(), error.code());
+			return;
+		}
+
+		const elliptics::data_pointer &data = result[0].file();
+		const unsigned char *p = data.data<unsigned char>();
+
+		uint64_t size = 0;
+		size_t header = 8;
+		if (data.size() >= header) {
+			size = ((uint64_t)p[0] << 24) | ((uint64_t)p[1] << 16) | ((uint64_t)p[2] << 8) | (uint64_t)p[3];
+
+			if (size == 0) {
+				// box extends to the end of the file
+				size = m_object_size - offset;
+			} else if (size == 1) {
+				header = 16;
+				size = 0;
+				if (data.size() >= header) {
+					for (size_t i = 8; i < header; ++i)
+						size = (size << 8) | p[i];
+				}
+			}
+		}
+
+		if (size < header || size > m_object_size - offset) {
+			object_read_failed(offset, "invalid top-level box header", -EINVAL);
+			return;
+		}
+
+		const std::string type(data.data<char>() + 4, 4);
+		if (type == "mdat" || type == "free" || type == "skip") {
+			read_box_header(offset + size);
+			return;
+		}
+
+		m_session->read_data(m_key, offset, size).connect(
+			std::bind(&on_upload_base::on_box_read, this->shared_from_this(), offset, size,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_box_read(uint64_t offset, uint64_t size, const elliptics::sync_read_result &result,
+			const elliptics::error_info &error) {
+		if (error) {
+			object_read_failed(offset, error.message(), error.code());
+			return;
+		}
+
+		const elliptics::data_pointer &data = result[0].file();
+		if (data.size() != size) {
+			object_read_failed(offset, "short read of top-level box", -EIO);
+			return;
+		}
+
+		try {
+			m_meta_reader->write_at(offset, data.data<char>(), data.size());
+		} catch (const std::exception &e) {
+			object_read_failed(offset, e.what(), -EIO);
+			return;
+		}
+
+		read_box_header(offset + size);
+	}
+
+	void object_read_failed(uint64_t offset, const std::string &message, int code) {
+		NLOG_ERROR("buffered-write: object-read: url: %s, key: %s, offset: %lu, "
+				"could not read object back, metadata will not be written: %s [%d]",
+				this->request().url().to_human_readable().c_str(), m_key_str.c_str(), offset,
+				message.c_str(), code);
+
+		m_meta_error.assign(message);
+		m_meta_reader.reset();
+		m_meta_enabled = false;
+		finish_upload();
+	}
+
+	void write_metadata() {
+		if (!m_meta_enabled || !m_meta_reader) {
+			finish_upload();
+			return;
+		}
+
+		std::vector<metadata_object> objects;
+		try {
+			const upload_metadata_options &opt = this->server()->upload_metadata();
+
+			objects = m_meta_reader->pack_objects(metadata_key(m_key_str), opt.chunk_duration_sec, opt.format);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("buffered-write: on_write_finished: url: %s, could not pack metadata: %s",
+					this->request().url().to_human_readable().c_str(), e.what());
+
+			m_meta_error.assign(e.what());
+			m_meta_reader.reset();
+			finish_upload();
+			return;
+		}
+		m_meta_reader.reset();
+
+		if (objects.empty()) {
+			finish_upload();
+			return;
+		}
+
+		m_meta_objects = objects.size();
+		m_meta_pending = objects.size();
+		m_meta_failed = false;
+
+		for (const auto &obj: objects) {
+			m_meta_size += obj.data.size();
+		}
+
+		for (const auto &obj: objects) {
+			m_session->write_data(obj.key, obj.data, 0).connect(
+				std::bind(&on_upload_base::on_meta_write_finished, this->shared_from_this(),
+					std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	void on_meta_write_finished(const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		if (error) {
+			NLOG_ERROR("buffered-write: on_meta_write_finished: url: %s, key: %s, metadata write error: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_key_str.c_str(),
+					error.message().c_str(), error.code());
+
+			if (!m_meta_failed.exchange(true)) {
+				this->send_reply(swarm::http_response::service_unavailable);
+			}
+			return;
+		}
+
+		if (--m_meta_pending == 0 && !m_meta_failed) {
+			NLOG_INFO("buffered-write: on_meta_write_finished: url: %s, key: %s, objects: %zu, size: %zu, "
+					"time: %ld msecs",
+					this->request().url().to_human_readable().c_str(), m_key_str.c_str(),
+					m_meta_objects, m_meta_size, m_timer.elapsed());
+			finish_upload();
+		}
+	}
+
+	// looks up content index entry for @sha, it is called either before request body is read
+	// if client has provided checksum, or after the data has been written
+	void lookup_content(const std::string &sha) {
+		elliptics::session session = this->server()->index_session();
+		session.set_filter(elliptics::filters::positive);
+
+		session.read_data(content_key(sha), 0, 0).connect(
+			std::bind(&on_upload_base::on_read_content, this->shared_from_this(), sha,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_read_content(const std::string &sha, const elliptics::sync_read_result &result,
+			const elliptics::error_info &error) {
+		if (error) {
+			if (error.code() != -ENOENT) {
+				NLOG_ERROR("buffered-write: on_read_content: url: %s, could not read content index: %s [%d]",
+						this->request().url().to_human_readable().c_str(),
+						error.message().c_str(), error.code());
+			}
+
+			on_content_checked(false);
+			return;
+		}
+
+		content_ref ref;
+		try {
+			const elliptics::data_pointer &dp = result[0].file();
+			unpack_content_ref(dp.data<char>(), dp.size(), ref);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("buffered-write: on_read_content: url: %s, invalid content index entry: %s",
+					this->request().url().to_human_readable().c_str(), e.what());
+			on_content_checked(false);
+			return;
+		}
+		ref.sha256 = sha;
+
+		// the same content uploaded under the same key again
+		if (ref.bucket == m_bucket->name() && ref.key == m_key_str) {
+			on_content_checked(false);
+			return;
+		}
+
+		// object could have been uploaded again with other content since the index entry was written,
+		// entry is replaced when this upload completes
+		elliptics::session session = this->server()->index_session();
+		session.set_filter(elliptics::filters::positive);
+		session.read_data(object_content_key(ref.bucket, ref.key), 0, 0).connect(
+			std::bind(&on_upload_base::on_read_content_owner, this->shared_from_this(), ref,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_read_content_owner(const content_ref &ref,
+			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		std::string owned;
+		if (!error)
+			owned = result[0].file().to_string();
+
+		if (owned != ref.sha256) {
+			NLOG_INFO("buffered-write: on_read_content_owner: url: %s, sha256: %s, content: bucket: %s, key: %s, "
+					"object does not hold this content anymore, content will not be reused: %s [%d]",
+					this->request().url().to_human_readable().c_str(), ref.sha256.c_str(),
+					ref.bucket.c_str(), ref.key.c_str(), error.message().c_str(), error.code());
+			on_content_checked(false);
+			return;
+		}
+
+		ebucket::bucket b;
+		elliptics::error_info err = this->server()->bucket_processor()->find_bucket(ref.bucket, b);
+		if (err) {
+			NLOG_ERROR("buffered-write: on_read_content_owner: url: %s, content bucket %s is not available: %s [%d]",
+					this->request().url().to_human_readable().c_str(), ref.bucket.c_str(),
+					err.message().c_str(), err.code());
+			on_content_checked(false);
+			return;
+		}
+
+		// content can only be reused if its metadata exists
+		elliptics::session session = b->session();
+		session.set_filter(elliptics::filters::positive);
+		session.lookup(metadata_key(ref.key)).connect(
+			std::bind(&on_upload_base::on_lookup_content_meta, this->shared_from_this(), ref,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_lookup_content_meta(const content_ref &ref,
+			const elliptics::sync_lookup_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		if (error) {
+			NLOG_INFO("buffered-write: on_lookup_content_meta: url: %s, content: bucket: %s, key: %s, "
+					"metadata lookup failed, content will not be reused: %s [%d]",
+					this->request().url().to_human_readable().c_str(), ref.bucket.c_str(), ref.key.c_str(),
+					error.message().c_str(), error.code());
+			on_content_checked(false);
+			return;
+		}
+
+		m_dedup_target = ref;
+		on_content_checked(true);
+	}
+
+	void on_content_checked(bool exists) {
+		// checksum lookup before request body has been read
+		if (m_sha_hex.empty()) {
+			if (exists) {
+				m_dedup_skip_write = true;
+				m_meta_enabled = false;
+			}
+
+			this->try_next_chunk();
+			return;
+		}
+
+		if (!exists) {
+			write_metadata();
+			return;
+		}
+
+		NLOG_INFO("buffered-write: on_content_checked: url: %s, sha256: %s, "
+				"content already exists: bucket: %s, key: %s",
+				this->request().url().to_human_readable().c_str(), m_sha_hex.c_str(),
+				m_dedup_target.bucket.c_str(), m_dedup_target.key.c_str());
+
+		m_meta_reader.reset();
+		m_duplicate = true;
+		write_alias();
+	}
+
+	// request body has been hashed but not written
+	void finish_skipped_upload() {
+		m_sha_hex = m_sha.final_hex();
+
+		if (m_sha_hex != m_sha_hint) {
+			NLOG_ERROR("buffered-write: url: %s, sha256 of the uploaded data %s does not match "
+					"provided checksum %s, nothing has been written",
+					this->request().url().to_human_readable().c_str(), m_sha_hex.c_str(), m_sha_hint.c_str());
+			this->send_reply(swarm::http_response::bad_request);
+			return;
+		}
+
+		m_duplicate = true;
+		write_alias();
+	}
+
+	void write_alias() {
+		elliptics::session session = this->server()->index_session();
+		session.write_data(alias_key(m_bucket->name(), m_key_str), pack_content_ref(m_dedup_target), 0).connect(
+			std::bind(&on_upload_base::on_alias_written, this->shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_alias_written(const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		if (error) {
+			NLOG_ERROR("buffered-write: on_alias_written: url: %s, key: %s, could not write alias: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_key_str.c_str(),
+					error.message().c_str(), error.code());
+			this->send_reply(swarm::http_response::service_unavailable);
+			return;
+		}
+
+		// object previously uploaded under this key is replaced by the alias, its metadata header
+		// tells which sample table objects it has
+		m_session->read_data(metadata_key(m_key_str), 0, 0).connect(
+			std::bind(&on_upload_base::on_stale_meta_read, this->shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_stale_meta_read(const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		if (error && error.code() != -ENOENT) {
+			NLOG_ERROR("buffered-write: on_stale_meta_read: url: %s, key: %s, "
+					"could not read metadata of the previous object: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_key_str.c_str(),
+					error.message().c_str(), error.code());
+			this->send_reply(swarm::http_response::service_unavailable);
+			return;
+		}
+
+		// data written before duplicate was detected or the previous object, alias is used instead
+		std::vector<std::string> keys;
+		keys.push_back(m_key_str);
+
+		if (!error) {
+			try {
+				const elliptics::data_pointer &dp = result[0].file();
+
+				media m;
+				unpack_media(dp.data<char>(), dp.size(), m);
+
+				std::vector<std::string> tables = sample_table_keys(metadata_key(m_key_str), m);
+				keys.insert(keys.end(), tables.begin(), tables.end());
+			} catch (const std::exception &e) {
+				NLOG_ERROR("buffered-write: on_stale_meta_read: url: %s, key: %s, "
+						"could not unpack metadata of the previous object, "
+						"its sample tables will not be removed: %s",
+						this->request().url().to_human_readable().c_str(), m_key_str.c_str(), e.what());
+			}
+		}
+
+		// metadata header goes last, so that failed upload can be retried and find the tables again
+		remove_objects(*m_session, keys, std::bind(&on_upload_base::on_stale_objects_removed,
+					this->shared_from_this(), std::placeholders::_1));
+	}
+
+	void on_stale_objects_removed(bool ok) {
+		if (!ok) {
+			this->send_reply(swarm::http_response::service_unavailable);
+			return;
+		}
+
+		// manifest only follows alias if there is no metadata
+		std::vector<std::string> keys;
+		keys.push_back(metadata_key(m_key_str));
+
+		remove_objects(*m_session, keys, std::bind(&on_upload_base::on_stale_meta_removed,
+					this->shared_from_this(), std::placeholders::_1));
+	}
+
+	void on_stale_meta_removed(bool ok) {
+		if (!ok) {
+			this->send_reply(swarm::http_response::service_unavailable);
+			return;
+		}
+
+		release_content();
+	}
+
+	// object and its metadata have been written, from now on it can be found by its content
+	void finish_upload() {
+		if (!m_dedup) {
+			// object written by partial or session upload does not hold the content it was indexed by
+			if (this->server()->upload_dedup())
+				release_content();
+			else
+				send_upload_reply();
+			return;
+		}
+
+		// key could have been an alias of another object before, manifest would still follow it
+		// if metadata of this object has not been extracted
+		this->server()->index_session().remove(alias_key(m_bucket->name(), m_key_str));
+
+		elliptics::session session = this->server()->index_session();
+		session.write_data(object_content_key(m_bucket->name(), m_key_str), m_sha_hex, 0).connect(
+			std::bind(&on_upload_base::on_content_owner_written, this->shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_content_owner_written(const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		// index entry would not be trusted without the owner record, so it is not written,
+		// upload itself has succeeded, the content just will not be deduplicated
+		if (error) {
+			NLOG_ERROR("buffered-write: on_content_owner_written: url: %s, sha256: %s, "
+					"could not write content owner: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_sha_hex.c_str(),
+					error.message().c_str(), error.code());
+
+			this->server()->account_dedup(m_size, false);
+			send_upload_reply();
+			return;
+		}
+
+		content_ref ref;
+		ref.bucket = m_bucket->name();
+		ref.key = m_key_str;
+		ref.size = m_size;
+		ref.sha256 = m_sha_hex;
+
+		elliptics::session session = this->server()->index_session();
+		session.write_data(content_key(m_sha_hex), pack_content_ref(ref), 0).connect(
+			std::bind(&on_upload_base::on_content_written, this->shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_content_written(const elliptics::sync_write_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		// upload itself has succeeded, the content just will not be deduplicated
+		if (error) {
+			NLOG_ERROR("buffered-write: on_content_written: url: %s, sha256: %s, "
+					"could not write content index: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_sha_hex.c_str(),
+					error.message().c_str(), error.code());
+		}
+
+		this->server()->account_dedup(m_size, false);
+		send_upload_reply();
+	}
+
+	// key does not hold the content it could have been indexed by anymore,
+	// owner record and index entry of that content are removed
+	void release_content() {
+		elliptics::session session = this->server()->index_session();
+		session.set_filter(elliptics::filters::positive);
+		session.read_data(object_content_key(m_bucket->name(), m_key_str), 0, 0).connect(
+			std::bind(&on_upload_base::on_released_content_read, this->shared_from_this(),
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_released_content_read(const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+		if (error) {
+			if (error.code() != -ENOENT) {
+				NLOG_ERROR("buffered-write: on_released_content_read: url: %s, key: %s, "
+						"could not read content owner: %s [%d]",
+						this->request().url().to_human_readable().c_str(), m_key_str.c_str(),
+						error.message().c_str(), error.code());
+				this->send_reply(swarm::http_response::service_unavailable);
+				return;
+			}
+
+			on_content_released(true);
+			return;
+		}
+
+		// index entry could have been taken over by another object with the same content since then,
+		// it is only lost for deduplication until that content is uploaded again
+		std::vector<std::string> keys;
+		keys.push_back(content_key(result[0].file().to_string()));
+		keys.push_back(object_content_key(m_bucket->name(), m_key_str));
+
+		elliptics::session session = this->server()->index_session();
+		remove_objects(session, keys, std::bind(&on_upload_base::on_content_released,
+					this->shared_from_this(), std::placeholders::_1));
+	}
+
+	void on_content_released(bool ok) {
+		if (!ok) {
+			this->send_reply(swarm::http_response::service_unavailable);
+			return;
+		}
+
+		if (m_duplicate)
+			this->server()->account_dedup(m_size, true);
+
+		send_upload_reply();
+	}
+
+	// removes @keys in parallel, missing objects are not errors, @done(false) is called if any removal has failed
+	struct removal {
+		std::atomic_int			pending;
+		std::atomic_bool		failed;
+		std::function<void (bool)>	done;
+	};
+
+	void remove_objects(elliptics::session &session, const std::vector<std::string> &keys,
+			const std::function<void (bool)> &done) {
+		auto state = std::make_shared<removal>();
+		state->pending = keys.size();
+		state->failed = false;
+		state->done = done;
+
+		for (const auto &key: keys) {
+			session.remove(key).connect(
+				std::bind(&on_upload_base::on_object_removed, this->shared_from_this(), state, key,
+					std::placeholders::_1, std::placeholders::_2));
+		}
+	}
+
+	void on_object_removed(const std::shared_ptr<removal> &state, const std::string &key,
+			const elliptics::sync_remove_result &result, const elliptics::error_info &error) {
+		(void) result;
+
+		if (error && error.code() != -ENOENT) {
+			NLOG_ERROR("buffered-write: on_object_removed: url: %s, key: %s, could not remove object %s: %s [%d]",
+					this->request().url().to_human_readable().c_str(), m_key_str.c_str(), key.c_str(),
+					error.message().c_str(), error.code());
+			state->failed = true;
+		}
+
+		if (--state->pending == 0)
+			state->done(!state->failed);
+	}
+
+	// drops blocks of the previous object with the same key cached by the storage
+	void invalidate_cache() {
+		this->server()->storage()->invalidate(m_bucket->name(), m_key_str);
+	}
+
+	void send_upload_reply() {
+		// dedup path could have removed the object after it has been read into the cache again
+		invalidate_cache();
+
+		const elliptics::sync_write_result &result = m_write_result;
+
 		nulla::JsonValue value;
 		upload_completion::fill_upload_reply(result, value, value.GetAllocator());
 
@@ -288,6 +1216,39 @@ private:
 		value.AddMember("offset", m_orig_offset, value.GetAllocator());
 		value.AddMember("rate", (double)m_size * 1000.0 / (double)m_timer.elapsed(), value.GetAllocator());
 
+		if (m_meta_objects) {
+			rapidjson::Value meta_val(rapidjson::kObjectType);
+			meta_val.AddMember("objects", m_meta_objects, value.GetAllocator());
+			meta_val.AddMember("size", m_meta_size, value.GetAllocator());
+			value.AddMember("metadata", meta_val, value.GetAllocator());
+		} else if (!m_meta_error.empty()) {
+			rapidjson::Value meta_error_val(m_meta_error.c_str(), m_meta_error.size(), value.GetAllocator());
+			value.AddMember("metadata-error", meta_error_val, value.GetAllocator());
+		}
+
+		if (m_dedup && !m_sha_hex.empty()) {
+			rapidjson::Value dedup_val(rapidjson::kObjectType);
+			rapidjson::Value sha_val(m_sha_hex.c_str(), m_sha_hex.size(), value.GetAllocator());
+			dedup_val.AddMember("sha256", sha_val, value.GetAllocator());
+			dedup_val.AddMember("duplicate", m_duplicate, value.GetAllocator());
+			if (m_duplicate) {
+				rapidjson::Value tbucket_val(m_dedup_target.bucket.c_str(), m_dedup_target.bucket.size(),
+						value.GetAllocator());
+				dedup_val.AddMember("bucket", tbucket_val, value.GetAllocator());
+				rapidjson::Value tkey_val(m_dedup_target.key.c_str(), m_dedup_target.key.size(),
+						value.GetAllocator());
+				dedup_val.AddMember("key", tkey_val, value.GetAllocator());
+			}
+			dedup_val.AddMember("ratio", this->server()->dedup_ratio(), value.GetAllocator());
+			value.AddMember("dedup", dedup_val, value.GetAllocator());
+		}
+
+		if (m_upload_session) {
+			rapidjson::Value session_val(rapidjson::kObjectType);
+			m_upload_session->fill(session_val, value.GetAllocator());
+			value.AddMember("upload-session", session_val, value.GetAllocator());
+		}
+
 		std::string data = value.ToString();
 
 		thevoid::http_response reply;
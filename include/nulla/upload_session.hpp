@@ -0,0 +1,265 @@
+#ifndef __NULLA_UPLOAD_SESSION_HPP
+#define __NULLA_UPLOAD_SESSION_HPP
+
+#include "nulla/jsonvalue.hpp"
+#include "nulla/log.hpp"
+
+#include <ebucket/bucket.hpp>
+
+#include <elliptics/session.hpp>
+
+#include <thevoid/stream.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace ioremap { namespace nulla {
+
+// Resumable upload protocol.
+//
+// POST /upload-session/key?size=N creates upload session for the object of N bytes and returns its id.
+// POST /upload/key?session=id uploads the next part of the object, request body is written at the
+// offset which has already been committed for this session, it may contain the whole rest of the object
+// or only a part of it. GET /upload-session/id returns committed offset, if upload request has been
+// interrupted, client asks for it and continues from there without sending the whole object again.
+class upload_session {
+public:
+	upload_session(const std::string &key, const std::string &bucket, uint64_t size,
+			const std::vector<int> &groups, long timeout_sec) :
+		m_key(key), m_bucket(bucket), m_size(size), m_groups(groups), m_timeout(timeout_sec)
+	{
+		touch();
+	}
+
+	const std::string &id() const {
+		return m_id;
+	}
+
+	void set_id(const std::string &id) {
+		m_id = id;
+	}
+
+	const std::string &key() const {
+		return m_key;
+	}
+
+	const std::string &bucket() const {
+		return m_bucket;
+	}
+
+	uint64_t size() const {
+		return m_size;
+	}
+
+	// only one request is allowed to upload data within given session
+	bool acquire() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_busy)
+			return false;
+
+		m_busy = true;
+		touch();
+		return true;
+	}
+
+	void release() {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_busy = false;
+		touch();
+	}
+
+	bool busy() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_busy;
+	}
+
+	// size of the contiguous object prefix which has been successfully written
+	uint64_t committed() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_committed;
+	}
+
+	// object has been prepared, i.e. its first chunk has been written
+	bool prepared() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_committed != 0;
+	}
+
+	bool complete() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_committed == m_size;
+	}
+
+	std::vector<int> groups() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_groups;
+	}
+
+	void set_groups(const std::vector<int> &groups) {
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_groups = groups;
+	}
+
+	// range [@offset, @offset + @size) has been written, pipelined writes may complete out of order,
+	// ranges beyond committed offset are kept until the gap before them is filled
+	void written(uint64_t offset, uint64_t size) {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		if (offset + size <= m_committed)
+			return;
+
+		m_written[offset] = offset + size;
+
+		auto it = m_written.begin();
+		while (it != m_written.end() && it->first <= m_committed) {
+			m_committed = std::max(m_committed, it->second);
+			it = m_written.erase(it);
+		}
+	}
+
+	std::chrono::system_clock::time_point expires_at() const {
+		std::lock_guard<std::mutex> guard(m_lock);
+		return m_expires_at;
+	}
+
+	template <typename Allocator>
+	void fill(rapidjson::Value &obj, Allocator &allocator) const {
+		std::lock_guard<std::mutex> guard(m_lock);
+
+		rapidjson::Value id_val(m_id.c_str(), m_id.size(), allocator);
+		obj.AddMember("id", id_val, allocator);
+		rapidjson::Value key_val(m_key.c_str(), m_key.size(), allocator);
+		obj.AddMember("key", key_val, allocator);
+		rapidjson::Value bucket_val(m_bucket.c_str(), m_bucket.size(), allocator);
+		obj.AddMember("bucket", bucket_val, allocator);
+
+		obj.AddMember("size", m_size, allocator);
+		obj.AddMember("committed", m_committed, allocator);
+		obj.AddMember("complete", m_committed == m_size, allocator);
+		obj.AddMember("busy", m_busy, allocator);
+	}
+
+private:
+	std::string m_id;
+	std::string m_key;
+	std::string m_bucket;
+	uint64_t m_size;
+
+	mutable std::mutex m_lock;
+	std::vector<int> m_groups;
+	uint64_t m_committed = 0;
+	std::map<uint64_t, uint64_t> m_written;
+	bool m_busy = false;
+
+	long m_timeout;
+	std::chrono::system_clock::time_point m_expires_at;
+
+	// must be called with @m_lock held or from constructor
+	void touch() {
+		m_expires_at = std::chrono::system_clock::now() + std::chrono::seconds(m_timeout);
+	}
+};
+
+typedef std::shared_ptr<upload_session> upload_session_t;
+
+template <typename Server, typename Stream>
+class on_upload_session_base : public thevoid::simple_request_stream<Server>, public std::enable_shared_from_this<Stream> {
+public:
+	virtual void on_request(const thevoid::http_request &req, const boost::asio::const_buffer &buffer) {
+		(void) buffer;
+
+		// url format: http://host[:port]/upload-session/key for POST
+		// and http://host[:port]/upload-session/id for GET
+		const auto &path = req.url().path_components();
+		if (path.size() < 2) {
+			NLOG_ERROR("upload-session: url: %s: invalid path, there must be at least 2 path components: "
+					"/upload-session/key or /upload-session/id",
+					req.url().to_human_readable().c_str());
+			this->send_reply(thevoid::http_response::bad_request);
+			return;
+		}
+
+		size_t prefix_size = 1 + path[0].size() + 1;
+		std::string name = req.url().path().substr(prefix_size);
+
+		if (req.method() == "GET") {
+			upload_session_t session = this->server()->get_upload_session(name);
+			if (!session) {
+				NLOG_ERROR("upload-session: url: %s: there is no upload session %s",
+						req.url().to_human_readable().c_str(), name.c_str());
+				this->send_reply(thevoid::http_response::not_found);
+				return;
+			}
+
+			send_session(session);
+			return;
+		}
+
+		uint64_t size;
+		try {
+			size = req.url().query().item_value("size", 0llu);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("upload-session: url: %s: invalid size parameter: %s",
+					req.url().to_human_readable().c_str(), e.what());
+			this->send_reply(thevoid::http_response::bad_request);
+			return;
+		}
+
+		if (size == 0) {
+			NLOG_ERROR("upload-session: url: %s: size parameter must be specified and be positive",
+					req.url().to_human_readable().c_str());
+			this->send_reply(thevoid::http_response::bad_request);
+			return;
+		}
+
+		ebucket::bucket bucket;
+		elliptics::error_info err = this->server()->bucket_processor()->get_bucket(size, bucket);
+		if (err) {
+			NLOG_ERROR("upload-session: url: %s: could not find bucket for size: %lu: %s [%d]",
+					req.url().to_human_readable().c_str(), size, err.message().c_str(), err.code());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		upload_session_t session = std::make_shared<upload_session>(name, bucket->name(), size,
+				bucket->session().get_groups(), this->server()->upload_session_timeout());
+		this->server()->store_upload_session(session);
+
+		NLOG_INFO("upload-session: url: %s: created upload session: id: %s, key: %s, bucket: %s, size: %lu",
+				req.url().to_human_readable().c_str(), session->id().c_str(), name.c_str(),
+				bucket->name().c_str(), size);
+
+		send_session(session);
+	}
+
+private:
+	void send_session(const upload_session_t &session) {
+		JsonValue value;
+		session->fill(value, value.GetAllocator());
+
+		std::string data = value.ToString();
+
+		thevoid::http_response reply;
+		reply.set_code(thevoid::http_response::ok);
+		reply.headers().set("Access-Control-Allow-Origin", "*");
+		reply.headers().set_content_type("text/json; charset=utf-8");
+		reply.headers().set_content_length(data.size());
+
+		this->send_reply(std::move(reply), std::move(data));
+	}
+};
+
+template <typename Server>
+class on_upload_session : public on_upload_session_base<Server, on_upload_session<Server>>
+{
+public:
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_UPLOAD_SESSION_HPP
@@ -14,4 +14,16 @@ static std::string metadata_key(const std::string &base) {
 	return std::string(tmp, sz);
 }
 
+// key of the object which holds sample table of the track @track_number,
+// it is used by v3 metadata layout, where @meta_key object only contains track headers
+static std::string sample_table_key(const std::string &meta_key, unsigned int track_number) {
+	return meta_key + ".samples." + std::to_string(track_number);
+}
+
+// key of the object which holds chunk @chunk_index of the track @track_number sample table,
+// it is used by v4 metadata layout, where sample table is split into time chunks
+static std::string sample_chunk_key(const std::string &meta_key, unsigned int track_number, size_t chunk_index) {
+	return sample_table_key(meta_key, track_number) + "." + std::to_string(chunk_index);
+}
+
 }} // namespace ioremap::nulla
@@ -0,0 +1,113 @@
+#ifndef __NULLA_WRITE_PIPELINE_HPP
+#define __NULLA_WRITE_PIPELINE_HPP
+
+#include <mutex>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ioremap { namespace nulla {
+
+// Pipelined chunk writes of one upload.
+//
+// The first chunk (prepare) is written and waited for as usual, the following chunks are written
+// as plain writes which do not wait for each other while less than @budget bytes are being written,
+// the last chunk (commit) is only sent when all of them have completed. Request reading the next chunk
+// and write completion handlers run in different threads, they take @lock() and call *_locked()
+// methods, which tell them what to do next.
+class write_pipeline {
+public:
+	enum action {
+		none = 0,
+		// next chunk can be read
+		next_chunk,
+		// all plain writes have completed, the last chunk can be written
+		commit,
+		// this write has failed, nothing else is written
+		failed,
+		// another write has already failed, completion is ignored
+		ignored,
+	};
+
+	void set_budget(size_t budget) {
+		m_budget = budget;
+	}
+
+	size_t budget() const {
+		return m_budget;
+	}
+
+	std::mutex &lock() {
+		return m_lock;
+	}
+
+	// plain write of @size bytes is started at @end, which is advanced past it,
+	// returns false if some write has already failed and nothing should be written
+	bool start_locked(uint64_t &end, size_t size, uint64_t &offset, bool &next) {
+		if (m_failed)
+			return false;
+
+		offset = end;
+		end += size;
+		m_inflight_bytes += size;
+		m_inflight_writes++;
+
+		next = m_inflight_bytes < m_budget;
+		if (!next)
+			m_want_next_chunk = true;
+
+		return true;
+	}
+
+	// the last chunk has been read, returns @commit if it can be written right away,
+	// otherwise completion of the last plain write returns @commit
+	action finish_locked() {
+		if (m_failed)
+			return none;
+
+		m_last_chunk_pending = true;
+		return m_inflight_writes == 0 ? commit : none;
+	}
+
+	// plain write of @size bytes has completed, only the first failure returns @failed
+	action complete_locked(size_t size, bool ok) {
+		if (m_failed)
+			return ignored;
+
+		if (!ok) {
+			m_failed = true;
+			return failed;
+		}
+
+		m_inflight_bytes -= size;
+		m_inflight_writes--;
+
+		if (m_last_chunk_pending && m_inflight_writes == 0)
+			return commit;
+
+		if (m_want_next_chunk && m_inflight_bytes < m_budget) {
+			m_want_next_chunk = false;
+			return next_chunk;
+		}
+
+		return none;
+	}
+
+	size_t inflight_bytes_locked() const {
+		return m_inflight_bytes;
+	}
+
+private:
+	size_t m_budget = 0;
+
+	std::mutex m_lock;
+	size_t m_inflight_bytes = 0;
+	size_t m_inflight_writes = 0;
+	bool m_want_next_chunk = false;
+	bool m_failed = false;
+	bool m_last_chunk_pending = false;
+};
+
+}} // namespace ioremap::nulla
+
+#endif // __NULLA_WRITE_PIPELINE_HPP
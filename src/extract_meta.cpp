@@ -1,78 +1,414 @@
+#include "nulla/elliptics_storage.hpp"
 #include "nulla/iso_reader.hpp"
+#include "nulla/local_storage.hpp"
 #include "nulla/utils.hpp"
 
 #include <ebucket/bucket_processor.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
+#include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
 
+#include <sys/stat.h>
+
 using namespace ioremap;
 
-static void stream_reader(const std::string &file, std::string &meta, nulla::media &media) {
-	std::cout << "Trying stream reader..." << std::endl;
+struct extract_options {
+	long				chunk_duration_sec = nulla::sample_chunk_duration_sec;
+	nulla::metadata_format		format = nulla::metadata_format_msgpack;
+
+	// batch mode only prints errors
+	bool				verbose = true;
+
+	// parse the mapped file in place instead of feeding it to the streaming parser
+	bool				mmap_reader = false;
+
+	// write the media file itself along with its metadata
+	bool				store_data = false;
+};
+
+static void stream_reader(const std::string &file, const std::string &meta_key, const extract_options &opt,
+		std::vector<nulla::metadata_object> &meta, nulla::media &media) {
+	if (opt.verbose)
+		std::cout << "Trying stream reader..." << std::endl;
 
 	try {
 		std::unique_ptr<nulla::iso_memory_reader> reader;
+		auto start = std::chrono::steady_clock::now();
 
-		std::ifstream in(file.c_str());
-		if (!in) {
-			std::ostringstream ss;
-			ss << "could not open file " << file << ", error: " << strerror(errno);
-			throw std::runtime_error(ss.str());
-		}
+		// file is fed to the parser right from the page cache in blocks,
+		// so that stream buffer stays small for files with moov atom at the end
+		nulla::mapped_file mf(file);
 
-		in.seekg(0, in.end);
-		size_t length = in.tellg();
+		static const size_t block_size = 1024 * 1024;
 		size_t pos = 0;
-		in.seekg(0, in.beg);
 
-		std::vector<char> tmp(1024 * 64);
-
-		while (pos < length) {
-			in.read((char *)tmp.data(), tmp.size());
-			if (in.gcount() != 0) {
-				if (!reader) {
-					reader.reset(new nulla::iso_memory_reader(tmp.data(), in.gcount()));
-				} else {
-					reader->feed(tmp.data(), in.gcount());
-				}
+		while (pos < mf.size()) {
+			size_t size = std::min(block_size, mf.size() - pos);
 
-				pos += in.gcount();
+			if (!reader) {
+				reader.reset(new nulla::iso_memory_reader(mf.data() + pos, size));
+			} else {
+				reader->feed(mf.data() + pos, size);
 			}
-			if (in.eof())
-				break;
 
-			if (!in.good()) {
-				std::ostringstream ss;
-				ss << "could not read data from file " << file << ", error: " << strerror(errno);
-				throw std::runtime_error(ss.str());
-			}
+			pos += size;
+		}
+
+		if (opt.verbose) {
+			long msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
+					std::chrono::steady_clock::now() - start).count();
+			std::cout << "Stream reader has parsed " << pos << " bytes in " << msecs << " msecs, " <<
+				(msecs ? pos / 1000.0 / msecs : 0) << " MB/s, stream buffer: " <<
+				reader->buffer_capacity() << " bytes" << std::endl;
 		}
 
-		meta = reader->pack();
+		meta = reader->pack_objects(meta_key, opt.chunk_duration_sec, opt.format);
 		media = reader->get_media();
 	} catch (const std::exception &e) {
-		std::cerr << "Stream reader has failed: " << e.what() << std::endl;
+		if (opt.verbose)
+			std::cerr << "Stream reader has failed: " << e.what() << std::endl;
 	}
 }
 
-static void file_reader(const std::string &file, std::string &meta, nulla::media &media) {
-	std::cout << "Trying whole-file reader..." << std::endl;
+static void file_reader(const std::string &file, const std::string &meta_key, const extract_options &opt,
+		std::vector<nulla::metadata_object> &meta, nulla::media &media) {
+	if (opt.verbose)
+		std::cout << "Trying whole-file reader..." << std::endl;
 
 	try {
 		nulla::iso_reader reader(file.c_str());
 		reader.parse();
 
-		meta = reader.pack();
+		meta = reader.pack_objects(meta_key, opt.chunk_duration_sec, opt.format);
+		media = reader.get_media();
+	} catch (const std::exception &e) {
+		std::cerr << "Whole-file reader has failed: " << file << ": " << e.what() << std::endl;
+	}
+}
+
+static void mmap_reader(const std::string &file, const std::string &meta_key, const extract_options &opt,
+		std::vector<nulla::metadata_object> &meta, nulla::media &media) {
+	if (opt.verbose)
+		std::cout << "Trying mmap reader..." << std::endl;
+
+	try {
+		nulla::iso_mmap_reader reader(file);
+
+		meta = reader.pack_objects(meta_key, opt.chunk_duration_sec, opt.format);
 		media = reader.get_media();
 	} catch (const std::exception &e) {
-		std::cerr << "Whole-file reader has failed: " << e.what() << std::endl;
+		if (opt.verbose)
+			std::cerr << "Mmap reader has failed: " << e.what() << std::endl;
+	}
+}
+
+// returns false if neither mmap/stream nor whole-file reader could parse @file
+static bool extract_file(const std::string &file, const std::string &meta_key, const extract_options &opt,
+		std::vector<nulla::metadata_object> &meta, nulla::media &media) {
+	if (opt.mmap_reader) {
+		mmap_reader(file, meta_key, opt, meta, media);
+	} else {
+		stream_reader(file, meta_key, opt, meta, media);
+	}
+
+	if (meta.empty()) {
+		file_reader(file, meta_key, opt, meta, media);
+	}
+
+	return !meta.empty();
+}
+
+// issues asynchronous metadata writes, blocks when @max_inflight writes have not been completed yet
+class inflight_writer {
+public:
+	inflight_writer(size_t max_inflight) : m_max_inflight(std::max<size_t>(max_inflight, 1)) {}
+
+	void write(nulla::storage &storage, const std::string &bucket, const std::string &file,
+			const nulla::metadata_object &obj) {
+		write(storage, bucket, file, obj.key, elliptics::data_pointer::copy(obj.data.data(), obj.data.size()));
+	}
+
+	// @owner keeps memory referenced by @data alive until the write has been completed
+	void write(nulla::storage &storage, const std::string &bucket, const std::string &file,
+			const std::string &key, const elliptics::data_pointer &data,
+			const std::shared_ptr<void> &owner = std::shared_ptr<void>()) {
+		{
+			std::unique_lock<std::mutex> guard(m_lock);
+			m_cond.wait(guard, [&] { return m_inflight < m_max_inflight; });
+			++m_inflight;
+		}
+
+		storage.write(bucket, key, data, 0,
+			std::bind(&inflight_writer::on_write_finished, this, file, data.size(), owner,
+				std::placeholders::_1));
+	}
+
+	// waits until all issued writes have been completed
+	void wait() {
+		std::unique_lock<std::mutex> guard(m_lock);
+		m_cond.wait(guard, [&] { return m_inflight == 0; });
+	}
+
+	size_t written_bytes() const {
+		return m_written_bytes;
+	}
+
+	size_t failed() const {
+		return m_failed;
+	}
+
+private:
+	size_t m_max_inflight;
+	size_t m_inflight = 0;
+	std::mutex m_lock;
+	std::condition_variable m_cond;
+
+	std::atomic_ulong m_written_bytes{0};
+	std::atomic_ulong m_failed{0};
+
+	void on_write_finished(const std::string &file, size_t size, const std::shared_ptr<void> &owner,
+			const elliptics::error_info &error) {
+		(void) owner;
+
+		if (error) {
+			std::cerr << "Could not write data of " << file << ", size: " << size <<
+				", error: " << error.message() << std::endl;
+			m_failed++;
+		} else {
+			m_written_bytes += size;
+		}
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		--m_inflight;
+		m_cond.notify_all();
+	}
+};
+
+struct batch_entry {
+	std::string	file;
+	std::string	key;
+};
+
+// every line is either a path or a path and storage key separated by tab
+static void read_batch_list(const std::string &list, std::vector<batch_entry> &entries) {
+	std::ifstream in(list.c_str());
+	if (!in) {
+		std::ostringstream ss;
+		ss << "could not open list " << list << ", error: " << strerror(errno);
+		throw std::runtime_error(ss.str());
+	}
+
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty())
+			continue;
+
+		batch_entry ent;
+		size_t tab = line.find('\t');
+		if (tab != std::string::npos) {
+			ent.file = line.substr(0, tab);
+			ent.key = line.substr(tab + 1);
+		} else {
+			ent.file = line;
+			ent.key = line;
+		}
+
+		entries.emplace_back(ent);
 	}
 }
 
+// storage key of every regular file found in @dir is its path relative to @dir
+static void read_batch_dir(const std::string &dir, std::vector<batch_entry> &entries) {
+	namespace fs = boost::filesystem;
+
+	const fs::path root(dir);
+	for (fs::recursive_directory_iterator it(root), end; it != end; ++it) {
+		if (!fs::is_regular_file(it->status()))
+			continue;
+
+		const std::string path = it->path().string();
+
+		batch_entry ent;
+		ent.file = path;
+		ent.key = path.substr(std::min(path.size(), root.string().size()));
+		ent.key.erase(0, ent.key.find_first_not_of('/'));
+		entries.emplace_back(ent);
+	}
+}
+
+// writes the media file itself, mapping is unmapped when the write has been completed
+static void store_file(nulla::storage &storage, const std::string &bucket, const std::string &file,
+		const std::string &key, inflight_writer &writer) {
+	auto mf = std::make_shared<nulla::mapped_file>(file);
+	writer.write(storage, bucket, file, key,
+			elliptics::data_pointer::from_raw(const_cast<char *>(mf->data()), mf->size()), mf);
+}
+
+// parses @entries with @threads parser threads, metadata objects are uploaded through @writer
+// into @bucket if @storage is set, returns number of files which could not be parsed or uploaded
+static size_t run_batch(const std::vector<batch_entry> &entries, const extract_options &opt, int threads,
+		nulla::storage *storage, const std::string &bucket, inflight_writer &writer) {
+	std::atomic_ulong next(0), parsed(0), failed(0), input_bytes(0), meta_bytes(0);
+
+	auto start = std::chrono::steady_clock::now();
+
+	auto worker = [&] () {
+		for (size_t idx = next++; idx < entries.size(); idx = next++) {
+			const batch_entry &ent = entries[idx];
+
+			std::vector<nulla::metadata_object> meta;
+			nulla::media media;
+
+			if (!extract_file(ent.file, nulla::metadata_key(ent.key), opt, meta, media)) {
+				std::cerr << "Could not parse " << ent.file << std::endl;
+				failed++;
+				continue;
+			}
+
+			struct stat st;
+			if (stat(ent.file.c_str(), &st) == 0)
+				input_bytes += st.st_size;
+
+			for (const auto &obj: meta) {
+				meta_bytes += obj.data.size();
+				if (storage)
+					writer.write(*storage, bucket, ent.file, obj);
+			}
+
+			if (storage && opt.store_data) {
+				try {
+					store_file(*storage, bucket, ent.file, ent.key, writer);
+				} catch (const std::exception &e) {
+					std::cerr << "Could not store " << ent.file << ": " << e.what() << std::endl;
+					failed++;
+					continue;
+				}
+			}
+
+			parsed++;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (int i = 0; i < std::max(threads, 1); ++i) {
+		pool.emplace_back(worker);
+	}
+	for (auto &th: pool) {
+		th.join();
+	}
+
+	writer.wait();
+
+	double secs = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start).count() / 1000.0;
+	if (secs == 0)
+		secs = 0.001;
+
+	std::cout << "Batch: files: " << entries.size() <<
+		", parsed: " << parsed <<
+		", failed: " << failed <<
+		", input: " << input_bytes << " bytes" <<
+		", metadata: " << meta_bytes << " bytes" <<
+		", uploaded: " << writer.written_bytes() << " bytes" <<
+		", upload errors: " << writer.failed() <<
+		", time: " << secs << " seconds" <<
+		", " << parsed / secs << " files/s" <<
+		", " << input_bytes / secs / 1000000.0 << " MB/s" <<
+		std::endl;
+
+	return failed + writer.failed();
+}
+
+template <typename Func>
+static double best_usecs(int iterations, Func func) {
+	double best = 0;
+	for (int i = 0; i < iterations; ++i) {
+		auto start = std::chrono::steady_clock::now();
+		func();
+		double usecs = std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - start).count();
+
+		if (i == 0 || usecs < best)
+			best = usecs;
+	}
+
+	return best;
+}
+
+// compares sample table size and unpack time of msgpack, compressed and binary formats on synthetic table
+static void bench_sample_table(size_t count) {
+	std::vector<nulla::sample> samples(count);
+
+	u64 offset = 0;
+	for (size_t i = 0; i < count; ++i) {
+		nulla::sample &sam = samples[i];
+		sam.length = 1000 + (i * 7919) % 30000;
+		sam.di = 1;
+		sam.offset = offset;
+		sam.dts = i * 1001;
+		sam.cts_offset = (i % 3) * 1001;
+		sam.is_rap = (i % 48) == 0;
+
+		offset += sam.length;
+	}
+
+	std::stringstream buffer;
+	msgpack::packer<std::stringstream> packer(&buffer);
+	nulla::sample_table::pack(packer, samples.data(), samples.size());
+	std::string mp = buffer.str();
+
+	std::stringstream cbuffer;
+	msgpack::packer<std::stringstream> cpacker(&cbuffer);
+	nulla::sample_table::pack_compressed(cpacker, samples.data(), samples.size());
+	std::string compressed = cbuffer.str();
+
+	std::string bin = nulla::pack_binary_sample_table(samples.data(), samples.size());
+
+	const int iterations = 5;
+	u64 check = 0;
+
+	double mp_usecs = best_usecs(iterations, [&] () {
+			std::vector<nulla::sample> tmp;
+			nulla::sample_table::unpack(mp.data(), mp.size(), tmp);
+			check += tmp.back().dts;
+		});
+
+	double compressed_usecs = best_usecs(iterations, [&] () {
+			std::vector<nulla::sample> tmp;
+			nulla::sample_table::unpack(compressed.data(), compressed.size(), tmp);
+			check += tmp.back().dts;
+		});
+
+	double bin_usecs = best_usecs(iterations, [&] () {
+			nulla::sample_span span = nulla::unpack_binary_sample_table(bin.data(), bin.size(),
+				std::shared_ptr<const void>());
+			check += span[span.size() - 1].dts;
+		});
+
+	// decode speed is measured in megabytes of unpacked samples per second
+	auto mbps = [&] (double usecs) -> double {
+		return usecs ? count * sizeof(nulla::sample) / usecs : 0;
+	};
+
+	std::cout << "Sample table of " << count << " samples, best of " << iterations << " runs:\n" <<
+		"  msgpack: size: " << mp.size() << " bytes, unpack: " << mp_usecs << " usecs, " <<
+			mbps(mp_usecs) << " MB/s\n" <<
+		"  compressed: size: " << compressed.size() << " bytes, ratio to msgpack: " <<
+			(double)mp.size() / compressed.size() << ", unpack: " << compressed_usecs << " usecs, " <<
+			mbps(compressed_usecs) << " MB/s\n" <<
+		"  binary: size: " << bin.size() << " bytes, unpack: " << bin_usecs << " usecs\n" <<
+		"  checksum: " << check << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
 	namespace bpo = boost::program_options;
@@ -85,7 +421,10 @@ int main(int argc, char *argv[])
 		("help", "this help message")
 		;
 
-	std::string bname, key, file;
+	std::string bname, key, file, format_str, list, dir, reader, storage_root;
+	long chunk_duration_sec;
+	size_t bench_samples, max_inflight;
+	int threads;
 	std::string log_file, log_level, groups;
 	bpo::options_description ell("Elliptics options");
 	ell.add_options()
@@ -95,11 +434,40 @@ int main(int argc, char *argv[])
 		("metagroups", bpo::value<std::string>(&groups), "groups where bucket metadata is stored: 1:2:3")
 		("bucket", bpo::value<std::string>(&bname), "use this bucket to store metadata")
 		("key", bpo::value<std::string>(&key), "name of the file uploaded into storage")
-		("file", bpo::value<std::string>(&file)->required(), "parse this MP4 file")
+		("file", bpo::value<std::string>(&file), "parse this MP4 file")
+		("chunk-duration", bpo::value<long>(&chunk_duration_sec)->default_value(nulla::sample_chunk_duration_sec),
+			"split sample tables into chunks of this many seconds, 0 stores every table in a single object")
+		("format", bpo::value<std::string>(&format_str)->default_value("msgpack"),
+			"metadata format: msgpack, compressed - msgpack with delta + varint encoded sample tables, "
+			"binary - flat layout which is used by the server without parsing")
+		("reader", bpo::value<std::string>(&reader),
+			"primary reader: stream - feed file to the streaming parser (default for single file), "
+			"mmap - parse mapped file in place (default for batch), whole-file reader is used if it fails")
+		("bench-samples", bpo::value<size_t>(&bench_samples)->default_value(0),
+			"benchmark msgpack, compressed and binary sample table unpacking using this many synthetic samples and exit")
+		;
+
+	bpo::options_description local("Local storage options");
+	local.add_options()
+		("storage-root", bpo::value<std::string>(&storage_root),
+			"write objects into local storage directory instead of elliptics, bucket must be specified")
+		("store-data", "write media files along with their metadata, server with local storage reads both")
+		;
+
+	bpo::options_description batch("Batch options");
+	batch.add_options()
+		("list", bpo::value<std::string>(&list),
+			"parse files listed in this file, one per line, optionally followed by tab and storage key")
+		("dir", bpo::value<std::string>(&dir),
+			"parse all files in this directory recursively, storage key is a path relative to this directory")
+		("threads", bpo::value<int>(&threads)->default_value(std::thread::hardware_concurrency()),
+			"number of parser threads")
+		("max-inflight", bpo::value<size_t>(&max_inflight)->default_value(128),
+			"maximum number of metadata writes in flight")
 		;
 
 	bpo::options_description cmdline_options;
-	cmdline_options.add(generic).add(ell);
+	cmdline_options.add(generic).add(ell).add(local).add(batch);
 
 	bpo::variables_map vm;
 
@@ -117,61 +485,143 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	std::string meta;
-	nulla::media media;
+	if (bench_samples) {
+		bench_sample_table(bench_samples);
+		return 0;
+	}
 
-	stream_reader(file, meta, media);
-	if (meta.empty()) {
-		file_reader(file, meta, media);
+	const bool batch_mode = !list.empty() || !dir.empty();
+	if (file.empty() && !batch_mode) {
+		std::cerr << "Invalid options: file, list or dir to parse must be specified\n" << cmdline_options << std::endl;
+		return -1;
 	}
 
-	if (meta.empty()) {
-		std::cerr << "Could not parse " << file << ", exiting..." << std::endl;
+	extract_options opt;
+	opt.chunk_duration_sec = chunk_duration_sec;
+	opt.store_data = vm.count("store-data") != 0;
+	if (!nulla::parse_metadata_format(format_str, opt.format)) {
+		std::cerr << "Invalid options: unsupported metadata format " << format_str << "\n" << cmdline_options << std::endl;
 		return -1;
 	}
 
-	std::cout << "Reader has loaded " << meta.size() << " bytes of metadata from " << file << std::endl;
-	for (auto it = media.tracks.begin(), it_end = media.tracks.end(); it != it_end; ++it) {
-		std::cout << "track: " << it->str() << std::endl;
+	if (reader.empty()) {
+		opt.mmap_reader = batch_mode;
+	} else if (reader == "mmap" || reader == "stream") {
+		opt.mmap_reader = reader == "mmap";
+	} else {
+		std::cerr << "Invalid options: unsupported reader " << reader << "\n" << cmdline_options << std::endl;
+		return -1;
 	}
 
-	if (remotes.empty() || groups.empty() || bname.empty() || key.empty()) {
+	std::vector<batch_entry> entries;
+	std::vector<nulla::metadata_object> meta;
+	size_t meta_size = 0;
+
+	if (batch_mode) {
+		opt.verbose = false;
+
+		try {
+			if (!list.empty())
+				read_batch_list(list, entries);
+			if (!dir.empty())
+				read_batch_dir(dir, entries);
+		} catch (const std::exception &e) {
+			std::cerr << "Could not read batch input: " << e.what() << std::endl;
+			return -1;
+		}
+
+		// parser threads open and close GPAC readers concurrently,
+		// this reference keeps GPAC initialized for the whole batch
+		nulla::gpac_init::acquire();
+	} else {
+		std::string meta_key = nulla::metadata_key(key.empty() ? file : key);
+		nulla::media media;
+
+		if (!extract_file(file, meta_key, opt, meta, media)) {
+			std::cerr << "Could not parse " << file << ", exiting..." << std::endl;
+			return -1;
+		}
+
+		for (const auto &obj: meta) {
+			meta_size += obj.data.size();
+		}
+
+		std::cout << "Reader has loaded " << meta_size << " bytes of metadata in " << meta.size() <<
+			" objects from " << file << std::endl;
+		for (auto it = media.tracks.begin(), it_end = media.tracks.end(); it != it_end; ++it) {
+			std::cout << "track: " << it->str() << std::endl;
+		}
+	}
+
+	const bool use_local = !storage_root.empty() && !bname.empty();
+	const bool use_elliptics = !remotes.empty() && !groups.empty() && !bname.empty();
+
+	if ((!use_local && !use_elliptics) || (key.empty() && !batch_mode)) {
+		if (batch_mode) {
+			inflight_writer writer(max_inflight);
+			return run_batch(entries, opt, threads, NULL, bname, writer) ? -1 : 0;
+		}
+
 		return 0;
 	}
 
-	elliptics::file_logger log(log_file.c_str(), elliptics::file_logger::parse_level(log_level));
-	std::shared_ptr<elliptics::node> node(new elliptics::node(elliptics::logger(log, blackhole::log::attributes_t())));
+	// logger must outlive elliptics node owned by the storage
+	std::unique_ptr<elliptics::file_logger> log;
+	std::unique_ptr<nulla::storage> storage;
 
-	std::vector<elliptics::address> rem(remotes.begin(), remotes.end());
-	node->add_remote(rem);
+	if (use_local) {
+		storage.reset(new nulla::local_storage(storage_root, threads));
+	} else {
+		log.reset(new elliptics::file_logger(log_file.c_str(), elliptics::file_logger::parse_level(log_level)));
+		std::shared_ptr<elliptics::node> node(new elliptics::node(elliptics::logger(*log, blackhole::log::attributes_t())));
 
-	ebucket::bucket_processor bp(node);
-	if (!bp.init(elliptics::parse_groups(groups.c_str()), std::vector<std::string>({bname}))) {
-		std::cerr << "Could not initialize bucket transport, exiting";
-		return -1;
+		std::vector<elliptics::address> rem(remotes.begin(), remotes.end());
+		node->add_remote(rem);
+
+		auto bp = std::make_shared<ebucket::bucket_processor>(node);
+		if (!bp->init(elliptics::parse_groups(groups.c_str()), std::vector<std::string>({bname}))) {
+			std::cerr << "Could not initialize bucket transport, exiting";
+			return -1;
+		}
+
+		ebucket::bucket b;
+
+		elliptics::error_info err = bp->find_bucket(bname, b);
+		if (err) {
+			std::cerr << "Could not find bucket " << bname << " : " << err.message() << std::endl;
+			return err.code();
+		}
+
+		storage.reset(new nulla::elliptics_storage(bp, node, elliptics::parse_groups(groups.c_str()), 60));
 	}
 
-	ebucket::bucket b;
+	inflight_writer writer(max_inflight);
 
-	elliptics::error_info err = bp.find_bucket(bname, b);
-	if (err) {
-		std::cerr << "Could not find bucket " << bname << " : " << err.message() << std::endl;
-		return err.code();
+	if (batch_mode) {
+		return run_batch(entries, opt, threads, storage.get(), bname, writer) ? -1 : 0;
 	}
 
-	elliptics::session s = b->session();
+	for (const auto &obj: meta) {
+		writer.write(*storage, bname, file, obj);
+	}
 
-	auto ret = s.write_data(nulla::metadata_key(key), meta, 0);
-	ret.wait();
-	if (!ret.is_valid() || ret.error()) {
-		std::cerr << "Could not write data into bucket " << b->name() <<
-			", size: " << meta.size() <<
-			", valid: " << ret.is_valid() <<
-			", error: " << ret.error().message() <<
-			std::endl;
-		return err.code();
+	if (opt.store_data) {
+		try {
+			store_file(*storage, bname, file, key, writer);
+		} catch (const std::exception &e) {
+			std::cerr << "Could not store " << file << ": " << e.what() << std::endl;
+			writer.wait();
+			return -1;
+		}
+	}
+
+	writer.wait();
+	if (writer.failed()) {
+		std::cerr << "Could not write data into " << storage->name() << " storage, bucket: " << bname << std::endl;
+		return -1;
 	}
 
-	std::cout << meta.size() << " bytes of metadata from " << file << " has been uploaded into bucket " << b->name() << std::endl;
+	std::cout << meta_size << " bytes of metadata from " << file << " has been uploaded into " << storage->name() <<
+		" storage, bucket " << bname << std::endl;
 	return 0;
 }
@@ -15,16 +15,26 @@
  */
 
 #include "nulla/asio.hpp"
+#include "nulla/block_cache.hpp"
 #include "nulla/dash_playlist.hpp"
+#include "nulla/dedup.hpp"
+#include "nulla/disk_cache.hpp"
+#include "nulla/elliptics_storage.hpp"
 #include "nulla/expiration.hpp"
 #include "nulla/jsonvalue.hpp"
 #include "nulla/hls_playlist.hpp"
 #include "nulla/iso_reader.hpp"
 #include "nulla/iso_writer.hpp"
+#include "nulla/local_storage.hpp"
 #include "nulla/log.hpp"
 #include "nulla/mpeg2ts_writer.hpp"
 #include "nulla/playlist.hpp"
+#include "nulla/playlist_store.hpp"
+#include "nulla/registry.hpp"
+#include "nulla/sha256.hpp"
+#include "nulla/storage.hpp"
 #include "nulla/upload.hpp"
+#include "nulla/upload_session.hpp"
 #include "nulla/utils.hpp"
 
 #include <ebucket/bucket_processor.hpp>
@@ -41,7 +51,9 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include <algorithm>
 #include <atomic>
+#include <unordered_map>
 
 using namespace ioremap;
 
@@ -65,16 +77,28 @@ public:
 			return;
 		}
 
-		for (auto &repr_pair: m_playlist->repr) {
-			err = request_track_info(repr_pair.second);
-			if (err) {
-				NLOG_ERROR("url: %s: repr: %s, could not request track info, error: %s [%d]",
-					req.url().to_human_readable().c_str(),
-					repr_pair.first.c_str(), err.message().c_str(), err.code());
-				this->send_reply(thevoid::http_response::bad_request);
+		// identical manifest requests share one playlist while it can still be started,
+		// new viewer gets at least half of the start window it has asked for
+		if (this->server()->manifest_dedup()) {
+			m_manifest_hash = manifest_hash();
+
+			auto now = std::chrono::system_clock::now();
+			if (this->server()->join_manifest(m_manifest_hash, now + (m_playlist->expires_at - now) / 2,
+					std::bind(&on_dash_manifest_base::on_manifest_joined, this->shared_from_this(),
+						std::placeholders::_1, std::placeholders::_2))) {
 				return;
 			}
 		}
+
+		request_tracks();
+	}
+
+	~on_dash_manifest_base() {
+		// waiters build their own playlists if this request has failed
+		if (!m_manifest_hash.empty()) {
+			this->server()->finish_manifest(m_manifest_hash, nulla::playlist_t(),
+					elliptics::create_error(-EAGAIN, "manifest request has failed"));
+		}
 	}
 
 	virtual void on_error(const boost::system::error_code &error) {
@@ -87,36 +111,90 @@ private:
 	uint64_t m_xreq = 0;
 	int m_trace = 0;
 
+	// hash of the manifest request this request builds playlist for, other requests wait for it
+	std::string m_manifest_hash;
+
+	void request_tracks() {
+		for (auto &repr_pair: m_playlist->repr) {
+			elliptics::error_info err = request_track_info(repr_pair.second);
+			if (err) {
+				NLOG_ERROR("url: %s: repr: %s, could not request track info, error: %s [%d]",
+					this->request().url().to_human_readable().c_str(),
+					repr_pair.first.c_str(), err.message().c_str(), err.code());
+				this->send_reply(thevoid::http_response::bad_request);
+				return;
+			}
+		}
+	}
+
+	// canonical form of the parsed request, it does not depend on json formatting, field order or skipped tracks
+	std::string manifest_hash() const {
+		std::string canonical;
+		auto append = [&canonical] (const std::string &str) {
+			canonical += std::to_string(str.size()) + ":" + str;
+		};
+
+		append(m_playlist->type);
+		append(std::to_string(m_playlist->chunk_duration_sec));
+
+		for (const auto &repr_pair: m_playlist->repr) {
+			append(repr_pair.first);
+			append(std::to_string(repr_pair.second.tracks.size()));
+
+			for (const auto &tr: repr_pair.second.tracks) {
+				append(tr.bucket);
+				append(tr.key);
+				append(tr.meta_key);
+				append(std::to_string(tr.start_msec));
+				append(std::to_string(tr.duration_msec));
+				append(std::to_string(tr.requested_track_number));
+			}
+		}
+
+		nulla::sha256 h;
+		h.update(canonical.data(), canonical.size());
+		return h.final_hex();
+	}
+
+	void on_manifest_joined(const nulla::playlist_t &playlist, const elliptics::error_info &error) {
+		if (error) {
+			NLOG_INFO("url: %s: manifest request which was being served has failed, building playlist: %s [%d]",
+				this->request().url().to_human_readable().c_str(), error.message().c_str(), error.code());
+
+			m_manifest_hash.clear();
+			request_tracks();
+			return;
+		}
+
+		m_playlist = playlist;
+		m_manifest_hash.clear();
+		send_manifest();
+	}
+
 	elliptics::error_info update_periods(nulla::representation &repr) {
 		repr.duration_msec = 0;
 		long dts_first_sample_offset = 0;
 		long number = 0;
 
 		for (auto &tr : repr.tracks) {
-			nulla::track &track = tr.media.tracks[tr.requested_track_index];
-
-			tr.dts_start = tr.start_msec * track.media_timescale / 1000;
-			ssize_t start_pos = track.sample_position_from_dts(tr.dts_start, true);
-			if (start_pos < 0) {
-				return elliptics::create_error(-EINVAL,
-						"could not locate sample for dts_start: %ld, track: %s",
-						tr.dts_start, track.str().c_str());
-			}
-			tr.dts_start = track.samples[start_pos].dts;
-
-			long dts_end = tr.dts_start + tr.duration_msec * track.media_timescale / 1000;
-			ssize_t end_pos = track.sample_position_from_dts(dts_end, false);
-			if (end_pos < 0)
-				end_pos = track.samples.size() - 1;
-
-			memmove((char *)track.samples.data(), track.samples.data() + start_pos,
-					sizeof(nulla::sample) * (end_pos - start_pos + 1));
-			track.samples.resize(end_pos - start_pos + 1);
+			const nulla::track &track = tr.track();
 
-			for (auto &s : track.samples) {
-				s.dts -= tr.dts_start;
+			// clip boundaries have been resolved when sample table has been read,
+			// chunks which contain them are loaded
+			u64 end_dts, near_dts;
+			int err = tr.samples->sample_dts(tr.sample_end, end_dts);
+			if (err) {
+				return elliptics::create_error(err, "could not read dts of the last sample %zd, track: %s",
+						tr.sample_end, track.str().c_str());
 			}
 
+			long last_diff_dts = 0;
+			if (tr.samples->sample_dts(tr.sample_end - 1, near_dts) == 0) {
+				last_diff_dts = end_dts - near_dts;
+			} else if (tr.samples->sample_dts(tr.sample_end + 1, near_dts) == 0) {
+				// the last sample is the first one in its chunk, previous chunk may not be loaded
+				last_diff_dts = near_dts - end_dts;
+			}
 
 			tr.dts_first_sample_offset = dts_first_sample_offset;
 			tr.start_number = number;
@@ -125,14 +203,11 @@ private:
 			number += (tr.duration_msec + 1000 * m_playlist->chunk_duration_sec - 1) /
 				(1000 * m_playlist->chunk_duration_sec);
 
-			const nulla::sample &end_sample = track.samples[track.samples.size() - 1];
-			const nulla::sample &prev_sample = track.samples[track.samples.size() - 2];
-			long last_diff_dts = end_sample.dts - prev_sample.dts;
+			dts_first_sample_offset += end_dts - tr.dts_start + last_diff_dts;
 
-			dts_first_sample_offset += end_sample.dts + last_diff_dts;
-
-			NLOG_INFO("track: %s, dts: [%lu, %lu), start_number: %ld, dts_first_sample_offset: %lu\n",
-					track.str().c_str(), track.samples[0].dts, end_sample.dts + last_diff_dts,
+			NLOG_INFO("track: %s, samples: [%zd, %zd], dts: [%lu, %lu), start_number: %ld, dts_first_sample_offset: %lu\n",
+					track.str().c_str(), tr.sample_start, tr.sample_end,
+					0ul, end_dts - tr.dts_start + last_diff_dts,
 					tr.start_number, tr.dts_first_sample_offset);
 		}
 
@@ -177,13 +252,32 @@ private:
 			truncate_duration(repr_pair.second);
 		}
 
-		m_playlist->id = this->server()->store_playlist(m_playlist);
-		m_playlist->base_url = this->server()->hostname() + "/stream/" + m_playlist->id + "/";
+		err = this->server()->admit_playlist(m_playlist);
+		if (err)
+			return err;
 
-		send_manifest();
+		this->server()->store_playlist(m_playlist,
+				std::bind(&on_dash_manifest_base::on_playlist_stored, this->shared_from_this(),
+					std::placeholders::_1));
 		return err;
 	}
 
+	void on_playlist_stored(const elliptics::error_info &error) {
+		if (error) {
+			NLOG_ERROR("playlist: %s: could not store playlist: %s [%d]",
+				m_playlist->id.c_str(), error.message().c_str(), error.code());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		if (!m_manifest_hash.empty()) {
+			this->server()->finish_manifest(m_manifest_hash, m_playlist, error);
+			m_manifest_hash.clear();
+		}
+
+		send_manifest();
+	}
+
 	void send_manifest() {
 		nulla::JsonValue ret;
 
@@ -207,12 +301,18 @@ private:
 		this->send_reply(std::move(reply), std::move(data));
 	}
 
-	void on_read_meta(const std::string &repr_id, size_t track_position,
-			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+	void on_read_meta(const std::string &repr_id, size_t track_position, bool aliased,
+			const elliptics::data_pointer &data, const elliptics::error_info &error) {
 		if (error) {
 			NLOG_ERROR("meta-read: repr: %s, track_position: %ld, error: %s [%d]",
 					repr_id.c_str(), track_position, error.message().c_str(), error.code());
 
+			// deduplicated upload only has an alias to the object with the same content
+			if (error.code() == -ENOENT && !aliased) {
+				request_alias(repr_id, track_position);
+				return;
+			}
+
 			if (error.code() == -ENOENT) {
 				this->send_reply(thevoid::http_response::not_found);
 			} else {
@@ -246,8 +346,7 @@ private:
 
 		nulla::track_request &tr = repr.tracks[track_position];
 
-		const elliptics::read_result_entry &entry = result[0];
-		elliptics::error_info err = meta_unpack(entry.file(), tr);
+		elliptics::error_info err = meta_unpack(data, tr);
 		if (err) {
 			NLOG_ERROR("meta-read: repr: %s, track_position: %zd, "
 				"track: bucket: %s, key: %s, could not unpack metadata: %s [%d]",
@@ -263,13 +362,171 @@ private:
 			return;
 		}
 
-		NLOG_INFO("meta-read: repr: %s, track_position: %zd: track: bucket: %s, key: %s, media-tracks: %zd",
-			repr_id.c_str(), track_position, tr.bucket.c_str(), tr.key.c_str(), tr.media.tracks.size());
+		NLOG_INFO("meta-read: repr: %s, track_position: %zd: track: bucket: %s, key: %s, media-tracks: %zd, version: %d",
+			repr_id.c_str(), track_position, tr.bucket.c_str(), tr.key.c_str(), tr.media.tracks.size(),
+			tr.media.version);
+
+		nulla::track &track = tr.media.tracks[tr.requested_track_index];
+
+		switch (tr.media.version) {
+		case nulla::media::serialization_version_3:
+			err = request_sample_table(repr_id, track_position, tr);
+			if (err) {
+				NLOG_ERROR("meta-read: repr: %s, track_position: %zd, could not request sample table: %s [%d]",
+					repr_id.c_str(), track_position, err.message().c_str(), err.code());
+				this->send_reply(thevoid::http_response::service_unavailable);
+			}
+			return;
+		case nulla::media::serialization_version_4:
+		case nulla::media::serialization_binary_1:
+			tr.samples->assign_directory(track.chunks);
+			break;
+		default:
+			tr.samples->assign(std::move(track.samples),
+					(u64)nulla::sample_chunk_duration_sec * track.media_timescale);
+
+			// v2 metadata contains samples of all tracks, only requested one is needed
+			for (auto &t: tr.media.tracks) {
+				std::vector<nulla::sample>().swap(t.samples);
+			}
+			break;
+		}
+
+		resolve_clip_start(repr_id, track_position);
+	}
+
+	void on_read_sample_table(const std::string &repr_id, size_t track_position,
+			const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error) {
+			NLOG_ERROR("sample-table-read: repr: %s, track_position: %ld, error: %s [%d]",
+					repr_id.c_str(), track_position, error.message().c_str(), error.code());
+
+			if (error.code() == -ENOENT) {
+				this->send_reply(thevoid::http_response::not_found);
+			} else {
+				this->send_reply(thevoid::http_response::service_unavailable);
+			}
+			return;
+		}
+
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
+		const nulla::track &track = tr.track();
+
+		std::vector<nulla::sample> samples;
+		try {
+			nulla::sample_table::unpack(dp.data<char>(), dp.size(), samples);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("sample-table-read: repr: %s, track_position: %zd, "
+				"track: bucket: %s, key: %s, number: %d, could not unpack sample table: %s",
+					repr_id.c_str(), track_position, tr.bucket.c_str(), tr.key.c_str(),
+					tr.requested_track_number, e.what());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		NLOG_INFO("sample-table-read: repr: %s, track_position: %zd: track: bucket: %s, key: %s, number: %d, "
+				"samples: %zd, size: %zd",
+			repr_id.c_str(), track_position, tr.bucket.c_str(), tr.key.c_str(), tr.requested_track_number,
+			samples.size(), dp.size());
+
+		tr.samples->assign(std::move(samples), (u64)nulla::sample_chunk_duration_sec * track.media_timescale);
+		resolve_clip_start(repr_id, track_position);
+	}
+
+	// representation and track request have already been checked in @on_read_meta()
+	nulla::track_request &get_track_request(const std::string &repr_id, size_t track_position) {
+		return m_playlist->repr.find(repr_id)->second.tracks[track_position];
+	}
+
+	void send_chunks_error(const char *stage, const std::string &repr_id, size_t track_position,
+			const elliptics::error_info &error) {
+		NLOG_ERROR("%s: repr: %s, track_position: %zd, could not load sample table chunks: %s [%d]",
+				stage, repr_id.c_str(), track_position, error.message().c_str(), error.code());
+
+		if (error.code() == -ENOENT) {
+			this->send_reply(thevoid::http_response::not_found);
+		} else {
+			this->send_reply(thevoid::http_response::service_unavailable);
+		}
+	}
+
+	// only sample table chunks which contain the first and the last samples of the clip are loaded,
+	// the rest will be read when playback reaches them,
+	// clip end depends on the first sample position, thus chunks are loaded one after another
+	void resolve_clip_start(const std::string &repr_id, size_t track_position) {
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
+		const nulla::track &track = tr.track();
+
+		if (tr.samples->total_samples() < 2) {
+			NLOG_ERROR("clip-start: repr: %s, track_position: %zd, "
+				"invalid track, number of sample %zd is too small, track: %s",
+					repr_id.c_str(), track_position, tr.samples->total_samples(), track.str().c_str());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		u64 dts_start = tr.start_msec * track.media_timescale / 1000;
+		this->server()->load_sample_chunks(tr, {tr.samples->chunk_index(dts_start)}, m_xreq, m_trace,
+				std::bind(&on_dash_manifest_base::on_clip_start_loaded, this->shared_from_this(),
+					repr_id, track_position, std::placeholders::_1));
+	}
+
+	void on_clip_start_loaded(const std::string &repr_id, size_t track_position, const elliptics::error_info &error) {
+		if (error) {
+			send_chunks_error("clip-start", repr_id, track_position, error);
+			return;
+		}
+
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
+		const nulla::track &track = tr.track();
+
+		u64 dts_start = tr.start_msec * track.media_timescale / 1000;
+		ssize_t start_pos = tr.samples->position_from_dts(dts_start, true);
+		if (start_pos < 0) {
+			NLOG_ERROR("clip-start: repr: %s, track_position: %zd, could not locate sample for dts_start: %lu, "
+					"track: %s: %zd",
+					repr_id.c_str(), track_position, dts_start, track.str().c_str(), start_pos);
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		tr.samples->sample_dts(start_pos, dts_start);
+		tr.dts_start = dts_start;
+		tr.sample_start = start_pos;
+
+		u64 dts_end = tr.dts_start + tr.duration_msec * track.media_timescale / 1000;
+		this->server()->load_sample_chunks(tr, {tr.samples->chunk_index(dts_end)}, m_xreq, m_trace,
+				std::bind(&on_dash_manifest_base::on_clip_end_loaded, this->shared_from_this(),
+					repr_id, track_position, std::placeholders::_1));
+	}
+
+	void on_clip_end_loaded(const std::string &repr_id, size_t track_position, const elliptics::error_info &error) {
+		if (error) {
+			send_chunks_error("clip-end", repr_id, track_position, error);
+			return;
+		}
+
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
+		const nulla::track &track = tr.track();
+
+		u64 dts_end = tr.dts_start + tr.duration_msec * track.media_timescale / 1000;
+		ssize_t end_pos = tr.samples->position_from_dts(dts_end, false);
+		if (end_pos < 0)
+			end_pos = tr.samples->total_samples() - 1;
+
+		if (end_pos <= (ssize_t)tr.sample_start) {
+			NLOG_ERROR("clip-end: repr: %s, track_position: %zd, clip is too short: samples: [%zd, %zd], track: %s",
+					repr_id.c_str(), track_position, tr.sample_start, end_pos, track.str().c_str());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		tr.sample_end = end_pos;
 
 		++m_playlist->meta_chunks_read;
-		err = check_and_send_manifest();
+		elliptics::error_info err = check_and_send_manifest();
 		if (err) {
-			NLOG_ERROR("meta-read: repr: %s, track_position: %zd, could not create and send manifest: %s [%d]",
+			NLOG_ERROR("clip-end: repr: %s, track_position: %zd, could not create and send manifest: %s [%d]",
 				repr_id.c_str(), track_position, err.message().c_str(), err.code());
 			this->send_reply(thevoid::http_response::service_unavailable);
 			return;
@@ -391,37 +648,128 @@ private:
 		elliptics::error_info err;
 
 		for (auto &tr: repr.tracks) {
-			ebucket::bucket b;
-			err = this->server()->bucket_processor()->find_bucket(tr.bucket, b);
-			if (err) {
-				return elliptics::create_error(err.code(),
-						"idx: %d, could not find bucket %s in bucket processor: %s [%d]",
-						idx, tr.bucket.c_str(), err.message().c_str(), err.code());
+			request_meta(repr.id, idx, tr, false);
+			++idx;
+		}
+
+		return err;
+	}
+
+	nulla::storage_trace trace() const {
+		nulla::storage_trace trace;
+		trace.id = m_xreq;
+		trace.bit = m_trace;
+		return trace;
+	}
+
+	void request_meta(const std::string &repr_id, size_t track_position,
+			const nulla::track_request &tr, bool aliased) {
+		this->server()->storage()->read_whole(tr.bucket, tr.meta_key, trace(),
+			std::bind(&on_dash_manifest_base::on_read_meta,
+				this->shared_from_this(), repr_id, track_position, aliased,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void request_alias(const std::string &repr_id, size_t track_position) {
+		const nulla::track_request &tr = get_track_request(repr_id, track_position);
+
+		this->server()->storage()->read_whole(std::string(), nulla::alias_key(tr.bucket, tr.key), trace(),
+			std::bind(&on_dash_manifest_base::on_read_alias,
+				this->shared_from_this(), repr_id, track_position,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_read_alias(const std::string &repr_id, size_t track_position,
+			const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error) {
+			NLOG_ERROR("alias-read: repr: %s, track_position: %zd, error: %s [%d]",
+					repr_id.c_str(), track_position, error.message().c_str(), error.code());
+
+			if (error.code() == -ENOENT) {
+				this->send_reply(thevoid::http_response::not_found);
+			} else {
+				this->send_reply(thevoid::http_response::service_unavailable);
 			}
+			return;
+		}
 
-			auto session = b->session();
-			session.set_filter(elliptics::filters::positive);
-			session.set_trace_id(m_xreq);
-			session.set_trace_bit(m_trace);
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
 
-			session.read_data(tr.meta_key, 0, 0).connect(
-				std::bind(&on_dash_manifest_base::on_read_meta,
-					this->shared_from_this(), repr.id, idx,
-					std::placeholders::_1, std::placeholders::_2));
+		nulla::content_ref ref;
+		try {
+			nulla::unpack_content_ref(dp.data<char>(), dp.size(), ref);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("alias-read: repr: %s, track_position: %zd, key: %s, could not unpack alias: %s",
+					repr_id.c_str(), track_position, tr.key.c_str(), e.what());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
 
-			++idx;
+		NLOG_INFO("alias-read: repr: %s, track_position: %zd, bucket: %s, key: %s -> bucket: %s, key: %s",
+				repr_id.c_str(), track_position, tr.bucket.c_str(), tr.key.c_str(),
+				ref.bucket.c_str(), ref.key.c_str());
+
+		// aliases written before content owners were recorded can not be checked
+		if (ref.sha256.empty()) {
+			follow_alias(repr_id, track_position, ref);
+			return;
 		}
 
-		return err;
+		// target could have been uploaded again with other content since the alias was written
+		this->server()->storage()->read_whole(std::string(), nulla::object_content_key(ref.bucket, ref.key), trace(),
+			std::bind(&on_dash_manifest_base::on_read_alias_owner,
+				this->shared_from_this(), repr_id, track_position, ref,
+				std::placeholders::_1, std::placeholders::_2));
+	}
+
+	void on_read_alias_owner(const std::string &repr_id, size_t track_position, const nulla::content_ref &ref,
+			const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		if (error && error.code() != -ENOENT) {
+			NLOG_ERROR("alias-owner-read: repr: %s, track_position: %zd, bucket: %s, key: %s, error: %s [%d]",
+					repr_id.c_str(), track_position, ref.bucket.c_str(), ref.key.c_str(),
+					error.message().c_str(), error.code());
+			this->send_reply(thevoid::http_response::service_unavailable);
+			return;
+		}
+
+		if (error || dp.to_string() != ref.sha256) {
+			NLOG_ERROR("alias-owner-read: repr: %s, track_position: %zd, bucket: %s, key: %s, "
+					"object does not hold content %s anymore",
+					repr_id.c_str(), track_position, ref.bucket.c_str(), ref.key.c_str(), ref.sha256.c_str());
+			this->send_reply(thevoid::http_response::not_found);
+			return;
+		}
+
+		follow_alias(repr_id, track_position, ref);
+	}
+
+	// data and metadata are read from the object which holds the content
+	void follow_alias(const std::string &repr_id, size_t track_position, const nulla::content_ref &ref) {
+		nulla::track_request &tr = get_track_request(repr_id, track_position);
+
+		tr.bucket = ref.bucket;
+		tr.key = ref.key;
+		tr.meta_key = nulla::metadata_key(ref.key);
+
+		request_meta(repr_id, track_position, tr, true);
+	}
+
+	// v3 metadata only contains track headers, sample table of the requested track
+	// lives in its own object, there is no need to read tables of the tracks which will not be played
+	elliptics::error_info request_sample_table(const std::string &repr_id, size_t track_position,
+			const nulla::track_request &tr) {
+		this->server()->storage()->read_whole(tr.bucket,
+			nulla::sample_table_key(tr.meta_key, tr.requested_track_number), trace(),
+			std::bind(&on_dash_manifest_base::on_read_sample_table,
+				this->shared_from_this(), repr_id, track_position,
+				std::placeholders::_1, std::placeholders::_2));
+
+		return elliptics::error_info();
 	}
 
 	elliptics::error_info meta_unpack(const elliptics::data_pointer &dp, nulla::track_request &tr) {
 		try {
-			msgpack::unpacked result;
-			msgpack::unpack(&result, dp.data<char>(), dp.size());
-			
-			msgpack::object deserialized = result.get();
-			deserialized.convert(&tr.media);
+			nulla::unpack_media(dp.data<char>(), dp.size(), tr.media);
 
 			for (auto it = tr.media.tracks.begin(), it_end = tr.media.tracks.end(); it != it_end; ++it) {
 				NLOG_INFO("meta-read: %s: url: %s, bucket: %s, key: %s, requested_track_number: %d, "
@@ -451,12 +799,6 @@ private:
 					if (tr.duration_msec > duration_msec - tr.start_msec)
 						tr.duration_msec = duration_msec - tr.start_msec;
 
-					if (it->samples.size() < 2) {
-						return elliptics::create_error(-EINVAL,
-								"invalid track, number of sample %ld is too small, track: %s",
-								it->samples.size(), it->str().c_str());
-					}
-
 					if (tr.duration_msec < m_playlist->chunk_duration_sec * 1000) {
 						m_playlist->chunk_duration_sec = tr.duration_msec / 1000;
 					}
@@ -516,14 +858,34 @@ public:
 			return;
 		}
 
-		m_playlist = this->server()->get_playlist(playlist_id);
-		if (!m_playlist) {
-			NLOG_ERROR("url: %s: there is no playlist_id: %s",
-					req.url().to_human_readable().c_str(), playlist_id.c_str());
-			this->send_reply(thevoid::http_response::bad_request);
+		this->server()->get_playlist(playlist_id, trace(),
+				std::bind(&on_dash_stream_base::on_playlist, this->shared_from_this(),
+					std::placeholders::_1, std::placeholders::_2));
+	}
+
+	// playlist created by another server is loaded from storage, it is already in memory otherwise
+	void on_playlist(const nulla::playlist_t &playlist, const elliptics::error_info &error) {
+		const auto &req = this->request();
+		const auto &path = req.url().path_components();
+		const std::string &playlist_id = path[1];
+		const std::string &operation = path[2];
+
+		if (error) {
+			NLOG_ERROR("url: %s: there is no playlist_id: %s: %s [%d]",
+					req.url().to_human_readable().c_str(), playlist_id.c_str(),
+					error.message().c_str(), error.code());
+
+			if (error.code() == -ENOENT) {
+				this->send_reply(thevoid::http_response::bad_request);
+			} else {
+				this->send_reply(thevoid::http_response::service_unavailable);
+			}
 			return;
 		}
 
+		m_playlist = playlist;
+		m_playlist->touch();
+
 		if (operation == "playlist") {
 			if (std::chrono::system_clock::now() > m_playlist->expires_at) {
 				NLOG_ERROR("url: %s: has already expired", req.url().to_human_readable().c_str());
@@ -675,8 +1037,8 @@ public:
 		request_track_data(tr, number);
 	}
 
-	void on_read_samples(nulla::writer_options &opt, const nulla::track_request &tr,
-			const elliptics::sync_read_result &result, const elliptics::error_info &error) {
+	void on_read_samples(nulla::writer_options &opt, const std::shared_ptr<nulla::track> &track,
+			const elliptics::data_pointer &sample_data, const elliptics::error_info &error) {
 		if (error) {
 			NLOG_ERROR("buffered-get: %s: url: %s: error: %s",
 					__func__, this->request().url().to_human_readable().c_str(), error.message().c_str());
@@ -685,22 +1047,17 @@ public:
 			return;
 		}
 
-		const elliptics::read_result_entry &entry = result[0];
-		const elliptics::data_pointer &sample_data = entry.file();
-
 		opt.sample_data = sample_data.data<char>();
 		opt.sample_data_size = sample_data.size();
 
-		const nulla::track &track = tr.track();
-
 		std::vector<char> movie_data;
 		int err;
 		if (m_playlist->type == "dash") {
 			std::vector<char> init_data;
-			nulla::iso_writer writer(this->server()->tmp_dir(), track);
+			nulla::iso_writer writer(this->server()->tmp_dir(), *track);
 			err = writer.create(opt, false, init_data, movie_data);
 		} else {
-			nulla::mpeg2ts_writer writer(this->server()->tmp_dir(), track);
+			nulla::mpeg2ts_writer writer(this->server()->tmp_dir(), *track);
 			err = writer.create(opt, movie_data);
 		}
 
@@ -723,23 +1080,42 @@ public:
 	void request_track_data(const nulla::track_request &tr, long number) {
 		const nulla::track &track = tr.track();
 
-		ebucket::bucket b;
-		elliptics::error_info err = this->server()->bucket_processor()->find_bucket(tr.bucket, b);
-		if (err) {
-			NLOG_ERROR("url: %s: could not find bucket %s in bucket processor: %s [%d]",
-					this->request().url().to_human_readable().c_str(), tr.bucket.c_str(),
-					err.message().c_str(), err.code());
-			this->send_reply(thevoid::http_response::bad_request);
+		number -= tr.start_number;
+		u64 dtime_start = tr.dts_start + number * m_playlist->chunk_duration_sec * track.media_timescale;
+		u64 dtime_end = tr.dts_start + (number + 1) * m_playlist->chunk_duration_sec * track.media_timescale;
+
+		// sample table chunks are loaded lazily, make sure that all chunks
+		// which contain samples of the requested segment are in memory
+		size_t first = tr.samples->chunk_index(dtime_start);
+		size_t last = std::min(tr.samples->chunk_index(dtime_end), tr.samples->chunk_index_by_position(tr.sample_end));
+
+		std::vector<size_t> chunks;
+		for (size_t idx = first; idx <= last; ++idx) {
+			chunks.push_back(idx);
+		}
+
+		this->server()->load_sample_chunks(tr, chunks, m_xreq, m_trace,
+				std::bind(&on_dash_stream_base::on_sample_chunks_loaded, this->shared_from_this(),
+					std::cref(tr), number, std::placeholders::_1));
+	}
+
+	void on_sample_chunks_loaded(const nulla::track_request &tr, long number, const elliptics::error_info &error) {
+		if (error) {
+			NLOG_ERROR("buffered-get: %s: url: %s: could not load sample table chunks: %s [%d]",
+					__func__, this->request().url().to_human_readable().c_str(),
+					error.message().c_str(), error.code());
+
+			this->send_reply(thevoid::http_response::service_unavailable);
 			return;
 		}
 
-		number -= tr.start_number;
+		const nulla::track &track = tr.track();
+
 		u64 dtime_start = number * m_playlist->chunk_duration_sec * track.media_timescale;
 		u64 dtime_end = (number + 1) * m_playlist->chunk_duration_sec * track.media_timescale;
 
-
-		ssize_t pos_start = track.sample_position_from_dts(dtime_start, true);
-		if (pos_start < 0) {
+		ssize_t pos_start = tr.samples->position_from_dts(tr.dts_start + dtime_start, true);
+		if (pos_start < 0 || pos_start >= (ssize_t)tr.sample_end) {
 			NLOG_ERROR("buffered-get: %s: url: %s: error: start offset is out of range, track_id: %d, track_number: %d, "
 					"dtime_start: %ld, number: %ld: %zd",
 					__func__, this->request().url().to_human_readable().c_str(), track.id, track.number,
@@ -749,13 +1125,39 @@ public:
 			return;
 		}
 
-		ssize_t pos_end = track.sample_position_from_dts(dtime_end, false);
-		if (pos_end < 0) {
-			pos_end = track.samples.size() - 1;
+		ssize_t pos_end = tr.samples->position_from_dts(tr.dts_start + dtime_end, false);
+		if (pos_end < 0 || pos_end > (ssize_t)tr.sample_end) {
+			pos_end = tr.sample_end;
+		}
+
+		// writer gets its own copy of the track, it only contains samples of the requested segment
+		// with timestamps relative to the beginning of the clip
+		std::shared_ptr<nulla::track> segment = std::make_shared<nulla::track>(track);
+
+		int serr = tr.samples->copy(pos_start, pos_end, segment->samples);
+		if (serr) {
+			NLOG_ERROR("buffered-get: %s: url: %s: could not copy samples [%zd, %zd]: %d",
+					__func__, this->request().url().to_human_readable().c_str(), pos_start, pos_end, serr);
+
+			this->send_reply(thevoid::http_response::internal_server_error);
+			return;
+		}
+
+		// the sample next to the last one is only needed to calculate duration of the last sample
+		u64 next_dts;
+		if (pos_end < (ssize_t)tr.sample_end && tr.samples->sample_dts(pos_end + 1, next_dts) == 0) {
+			nulla::sample next;
+			next.dts = next_dts;
+			segment->samples.push_back(next);
+		}
+
+		for (auto &s: segment->samples) {
+			s.dts -= tr.dts_start;
 		}
 
-		u64 start_offset = track.samples[pos_start].offset;
-		u64 end_offset = track.samples[pos_end].offset + track.samples[pos_end].length;
+		const nulla::sample &last_sample = segment->samples[pos_end - pos_start];
+		u64 start_offset = segment->samples.front().offset;
+		u64 end_offset = last_sample.offset + last_sample.length;
 
 		NLOG_INFO("buffered-get: %s: url: %s: track_id: %d, track_number: %d, samples: [%ld, %ld): "
 				"media_timescale: %d, media_duration: %ld, "
@@ -766,27 +1168,29 @@ public:
 				tr.dts_first_sample_offset, dtime_start, dtime_end, number, start_offset, end_offset);
 
 		nulla::writer_options opt;
-		opt.pos_start = pos_start;
-		opt.pos_end = pos_end;
+		opt.pos_start = 0;
+		opt.pos_end = pos_end - pos_start;
 		opt.dts_start = dtime_start;
 		opt.dts_end = dtime_end;
 		opt.fragment_duration = 1 * track.media_timescale; // 1 second
 		opt.dts_start_absolute = tr.dts_first_sample_offset;
 
-		auto session = b->session();
-		session.set_filter(elliptics::filters::positive);
-		session.set_trace_id(m_xreq);
-		session.set_trace_bit(m_trace);
-		session.read_data(tr.key, start_offset, end_offset - start_offset).connect(
+		this->server()->storage()->read(tr.bucket, tr.key, start_offset, end_offset - start_offset, trace(),
 				std::bind(&on_dash_stream_base::on_read_samples,
-					this->shared_from_this(), opt, std::cref(tr), std::placeholders::_1, std::placeholders::_2));
+					this->shared_from_this(), opt, segment, std::placeholders::_1, std::placeholders::_2));
 	}
 
-
 private:
 	nulla::playlist_t m_playlist;
 	uint64_t m_xreq = 0;
 	int m_trace = 0;
+
+	nulla::storage_trace trace() const {
+		nulla::storage_trace trace;
+		trace.id = m_xreq;
+		trace.bit = m_trace;
+		return trace;
+	}
 };
 
 template <typename Server>
@@ -802,7 +1206,7 @@ public:
 	virtual bool initialize(const rapidjson::Value &config) {
 		srand(time(NULL));
 
-		if (!elliptics_init(config))
+		if (!storage_init(config))
 			return false;
 
 		on<on_dash_manifest<nulla_server>>(
@@ -815,10 +1219,19 @@ public:
 			options::methods("GET")
 		);
 
-		on<nulla::on_upload<nulla_server>>(
-			options::prefix_match("/upload"),
-			options::methods("POST", "PUT")
-		);
+		// uploads use elliptics prepare/commit writes and report per-group results
+		if (m_bp) {
+			// must be registered before /upload, since it matches the same prefix
+			on<nulla::on_upload_session<nulla_server>>(
+				options::prefix_match("/upload-session"),
+				options::methods("POST", "GET")
+			);
+
+			on<nulla::on_upload<nulla_server>>(
+				options::prefix_match("/upload"),
+				options::methods("POST", "PUT")
+			);
+		}
 
 		return true;
 	}
@@ -827,38 +1240,312 @@ public:
 		return m_bp;
 	}
 
-	std::string store_playlist(nulla::playlist_t &playlist) {
-		elliptics::key k(std::to_string(m_playlist_seq++) + "." + std::to_string(rand()));
-		k.transform(*m_session);
+	const std::shared_ptr<nulla::storage> &storage() const {
+		return m_storage;
+	}
 
-		char dst[2*DNET_ID_SIZE+1];
-		playlist->id.assign(dnet_dump_id_len_raw(k.raw_id().id, DNET_ID_SIZE, dst));
+	typedef std::function<void (const elliptics::error_info &)> store_completion_t;
+	typedef std::function<void (const nulla::playlist_t &, const elliptics::error_info &)> playlist_completion_t;
 
-		auto expires_at = playlist->expires_at + std::chrono::milliseconds(playlist->duration_msec);
+	// assigns id to the admitted playlist, if playlists are persisted, it becomes available
+	// only when its definition has been written, so that any server can load it right after reply,
+	// signed self-contained id does not need any store
+	void store_playlist(const nulla::playlist_t &playlist, const store_completion_t &complete) {
+		if (!m_playlist_id_key.empty()) {
+			playlist->id = nulla::sign_playlist_id(nulla::pack_playlist(*playlist), m_playlist_id_key);
+		} else {
+			playlist->id = generate_id();
+		}
+		playlist->base_url = m_hostname + "/stream/" + playlist->id + "/";
+
+		if (!m_playlist_id_key.empty() || !m_playlist_persist) {
+			// identical manifest created within the same millisecond has the same signed id
+			if (!insert_playlist(playlist))
+				m_playlist_memory -= playlist->memory;
+
+			complete(elliptics::error_info());
+			return;
+		}
+
+		m_storage->write(std::string(), nulla::playlist_key(playlist->id),
+				elliptics::data_pointer::copy(nulla::pack_playlist(*playlist)), 0,
+				std::bind(&nulla_server::on_playlist_written, this, playlist, complete, std::placeholders::_1));
+	}
+
+	// playlist which is not in memory is reconstructed from its signed id or loaded from storage
+	// if playlists are persisted, concurrent requests for the same playlist share one load
+	void get_playlist(const std::string &id, const nulla::storage_trace &trace, const playlist_completion_t &complete) {
+		nulla::playlist_t playlist = m_playlists.find(id);
+		if (playlist) {
+			complete(playlist, elliptics::error_info());
+			return;
+		}
+
+		std::string definition;
+		if (!m_playlist_id_key.empty()) {
+			if (!nulla::verify_playlist_id(id, m_playlist_id_key, definition)) {
+				m_playlist_ids_rejected++;
+				complete(playlist, elliptics::create_error(-ENOENT, "playlist id is not valid"));
+				return;
+			}
+		} else if (!m_playlist_persist) {
+			complete(playlist, elliptics::create_error(-ENOENT, "there is no such playlist"));
+			return;
+		}
 
 		{
-			std::lock_guard<std::mutex> guard(m_playlists_lock);
-			m_playlists.insert(std::make_pair(playlist->id, playlist));
+			std::lock_guard<std::mutex> guard(m_playlist_loads_lock);
+			auto &waiters = m_playlist_loads[id];
+			waiters.push_back(complete);
+			if (waiters.size() != 1)
+				return;
+		}
+
+		auto loader = std::make_shared<nulla::playlist_loader>(m_storage, id, trace,
+				std::bind(&nulla_server::on_playlist_loaded, this, id,
+					std::placeholders::_1, std::placeholders::_2));
+		if (definition.empty()) {
+			loader->start();
+		} else {
+			loader->start(definition);
 		}
+	}
 
-		m_expiration.insert(expires_at, std::bind(&nulla_server::remove_playlist, this, playlist->id));
-		return playlist->id;
+	bool manifest_dedup() const {
+		return m_manifest_dedup;
+	}
+
+	typedef std::function<void (const nulla::playlist_t &, const elliptics::error_info &)> manifest_completion_t;
+
+	// returns true if there is a playlist for the manifest request @hash which is valid at least
+	// until @valid_until or if it is being built by another request, @complete is invoked with it then,
+	// otherwise caller builds the playlist and has to call @finish_manifest()
+	bool join_manifest(const std::string &hash, const std::chrono::system_clock::time_point &valid_until,
+			const manifest_completion_t &complete) {
+		nulla::playlist_t playlist;
+		{
+			std::lock_guard<std::mutex> guard(m_manifests_lock);
+
+			auto it = m_manifests.find(hash);
+			if (it != m_manifests.end()) {
+				playlist = m_playlists.find(it->second);
+				if (playlist && playlist->expires_at < valid_until)
+					playlist.reset();
+			}
+
+			if (!playlist) {
+				auto pending = m_manifests_pending.find(hash);
+				if (pending == m_manifests_pending.end()) {
+					m_manifests_pending[hash];
+					m_manifest_dedup_misses++;
+					return false;
+				}
+
+				pending->second.push_back(complete);
+				return true;
+			}
+		}
+
+		m_manifest_dedup_hits++;
+		complete(playlist, elliptics::error_info());
+		return true;
+	}
+
+	// completes requests which wait for the manifest @hash, successfully built playlist
+	// is reused by the next identical requests until it expires
+	void finish_manifest(const std::string &hash, const nulla::playlist_t &playlist, const elliptics::error_info &error) {
+		std::vector<manifest_completion_t> waiters;
+		{
+			std::lock_guard<std::mutex> guard(m_manifests_lock);
+
+			auto it = m_manifests_pending.find(hash);
+			if (it != m_manifests_pending.end()) {
+				waiters.swap(it->second);
+				m_manifests_pending.erase(it);
+			}
+
+			if (!error)
+				m_manifests[hash] = playlist->id;
+		}
+
+		if (!error) {
+			m_manifest_dedup_hits += waiters.size();
+			m_expiration.insert(playlist->expires_at,
+					std::bind(&nulla_server::forget_manifest, this, hash, playlist->id));
+		}
+
+		for (const auto &complete: waiters) {
+			complete(playlist, error);
+		}
+	}
+
+	// returns false if there is already a playlist with the same id
+	bool insert_playlist(const nulla::playlist_t &playlist) {
+		playlist->touch();
+		if (!m_playlists.insert(playlist->id, playlist))
+			return false;
+
+		m_expiration.insert(playlist_deadline(playlist), std::bind(&nulla_server::expire_playlist, this, playlist->id));
+		return true;
+	}
+
+	// accounts memory of the playlist against the budget, idle playlists are evicted
+	// least recently used first to make room for it, returns -ENOMEM if there is still not enough memory
+	elliptics::error_info admit_playlist(const nulla::playlist_t &playlist) {
+		playlist->memory = playlist->memory_footprint();
+
+		if (m_playlist_memory_budget == 0) {
+			m_playlist_memory += playlist->memory;
+			return elliptics::error_info();
+		}
+
+		std::lock_guard<std::mutex> guard(m_playlist_admit_lock);
+
+		if (m_playlist_memory + playlist->memory > m_playlist_memory_budget)
+			evict_idle_playlists(m_playlist_memory + playlist->memory - m_playlist_memory_budget);
+
+		if (m_playlist_memory + playlist->memory > m_playlist_memory_budget) {
+			m_playlists_rejected++;
+			return elliptics::create_error(-ENOMEM, "playlist memory budget exhausted: used: %lu, budget: %lu, "
+					"playlist needs: %zd", (unsigned long)m_playlist_memory,
+					(unsigned long)m_playlist_memory_budget, playlist->memory);
+		}
+
+		m_playlist_memory += playlist->memory;
+		return elliptics::error_info();
 	}
 
 	nulla::playlist_t get_playlist(const std::string &id) {
-		std::lock_guard<std::mutex> guard(m_playlists_lock);
-		auto it = m_playlists.find(id);
-		if (it != m_playlists.end()) {
+		return m_playlists.find(id);
+	}
+
+	void store_upload_session(const nulla::upload_session_t &session) {
+		session->set_id(generate_id());
+
+		{
+			std::lock_guard<std::mutex> guard(m_upload_sessions_lock);
+			m_upload_sessions.insert(std::make_pair(session->id(), session));
+		}
+
+		m_expiration.insert(session->expires_at(),
+				std::bind(&nulla_server::expire_upload_session, this, session->id()));
+	}
+
+	nulla::upload_session_t get_upload_session(const std::string &id) {
+		std::lock_guard<std::mutex> guard(m_upload_sessions_lock);
+		auto it = m_upload_sessions.find(id);
+		if (it != m_upload_sessions.end()) {
 			return it->second;
 		}
 
-		return nulla::playlist_t();
+		return nulla::upload_session_t();
+	}
+
+	long upload_session_timeout() const {
+		return m_upload_session_timeout;
+	}
+
+	typedef std::function<void (const elliptics::error_info &)> chunks_completion_t;
+
+	// reads sample table chunks @chunks of the @tr which have not been loaded yet,
+	// @complete is invoked once all of them are in memory or when the first read fails
+	void load_sample_chunks(const nulla::track_request &tr, const std::vector<size_t> &chunks,
+			uint64_t xreq, int trace, const chunks_completion_t &complete) {
+		std::vector<size_t> missing;
+		for (size_t idx: chunks) {
+			if (!tr.samples->chunk(idx))
+				missing.push_back(idx);
+		}
+
+		if (missing.empty()) {
+			complete(elliptics::error_info());
+			return;
+		}
+
+		std::vector<std::string> keys;
+		keys.reserve(missing.size());
+		for (size_t idx: missing) {
+			keys.emplace_back(nulla::sample_chunk_key(tr.meta_key, tr.requested_track_number, idx));
+		}
+
+		nulla::storage_trace st;
+		st.id = xreq;
+		st.bit = trace;
+
+		auto state = std::make_shared<chunks_load_state>(missing.size(), complete);
+		m_storage->bulk_read(tr.bucket, keys, st,
+			std::bind(&nulla_server::on_read_sample_chunk, this, tr.samples, missing, state,
+				std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
 	}
 
 	const std::string &tmp_dir() const {
 		return m_tmp_dir;
 	}
 
+	const nulla::upload_metadata_options &upload_metadata() const {
+		return m_upload_metadata;
+	}
+
+	size_t upload_inflight_bytes() const {
+		return m_upload_inflight_bytes;
+	}
+
+	bool upload_dedup() const {
+		return m_upload_dedup;
+	}
+
+	// content index and aliases live in metadata groups, they do not belong to any bucket
+	elliptics::session index_session() const {
+		elliptics::session session(*m_node);
+		session.set_groups(m_metadata_groups);
+		session.set_timeout(m_write_timeout);
+		return session;
+	}
+
+	void account_dedup(uint64_t size, bool duplicate) {
+		m_dedup_uploads++;
+		m_dedup_bytes += size;
+
+		if (duplicate) {
+			m_dedup_duplicates++;
+			m_dedup_saved_bytes += size;
+		}
+	}
+
+	// part of the uploaded bytes which have not been stored since the same content already existed
+	double dedup_ratio() const {
+		uint64_t bytes = m_dedup_bytes;
+		if (bytes == 0)
+			return 0;
+
+		return (double)m_dedup_saved_bytes / (double)bytes;
+	}
+
+	virtual std::map<std::string, std::string> get_statistics() const {
+		std::map<std::string, std::string> stats = thevoid::server<nulla_server>::get_statistics();
+
+		stats["dedup_uploads"] = std::to_string(m_dedup_uploads);
+		stats["dedup_duplicates"] = std::to_string(m_dedup_duplicates);
+		stats["dedup_bytes"] = std::to_string(m_dedup_bytes);
+		stats["dedup_saved_bytes"] = std::to_string(m_dedup_saved_bytes);
+		stats["dedup_ratio"] = std::to_string(dedup_ratio());
+
+		m_playlists.get_statistics("playlists", stats);
+		stats["playlists_idle_expired"] = std::to_string(m_playlists_idle_expired);
+		stats["playlists_memory_bytes"] = std::to_string(m_playlist_memory);
+		stats["playlists_memory_budget"] = std::to_string(m_playlist_memory_budget);
+		stats["playlists_evicted"] = std::to_string(m_playlists_evicted);
+		stats["playlists_rejected"] = std::to_string(m_playlists_rejected);
+		stats["playlists_stored"] = std::to_string(m_playlists_stored);
+		stats["playlists_loaded"] = std::to_string(m_playlists_loaded);
+		stats["playlist_ids_rejected"] = std::to_string(m_playlist_ids_rejected);
+		stats["manifest_dedup_hits"] = std::to_string(m_manifest_dedup_hits);
+		stats["manifest_dedup_misses"] = std::to_string(m_manifest_dedup_misses);
+		m_storage->get_statistics(stats);
+
+		return stats;
+	}
+
 	const std::string &hostname() const {
 		return m_hostname;
 	}
@@ -867,10 +1554,46 @@ private:
 	std::shared_ptr<elliptics::node> m_node;
 	std::unique_ptr<elliptics::session> m_session;
 	std::shared_ptr<ebucket::bucket_processor> m_bp;
+	std::shared_ptr<nulla::storage> m_storage;
 
-	std::mutex m_playlists_lock;
 	std::atomic_long m_playlist_seq;
-	std::map<std::string, nulla::playlist_t> m_playlists;
+	nulla::registry<nulla::playlist_t> m_playlists;
+	// 0 means playlists live until they expire whether they are being played or not
+	long m_playlist_idle_timeout = 0;
+	std::atomic<uint64_t> m_playlists_idle_expired{0};
+
+	// memory held by stored playlists as accounted at creation, 0 budget means unlimited
+	std::atomic<uint64_t> m_playlist_memory{0};
+	uint64_t m_playlist_memory_budget = 0;
+	// playlist which has not been requested for this many seconds may be evicted to admit a new one
+	long m_playlist_evict_idle_sec = 30;
+	std::mutex m_playlist_admit_lock;
+	std::atomic<uint64_t> m_playlists_evicted{0};
+	std::atomic<uint64_t> m_playlists_rejected{0};
+
+	// playlist definitions are written to storage, so that playlist can be served by any server
+	bool m_playlist_persist = false;
+	std::mutex m_playlist_loads_lock;
+	std::map<std::string, std::vector<playlist_completion_t>> m_playlist_loads;
+	std::atomic<uint64_t> m_playlists_stored{0};
+	std::atomic<uint64_t> m_playlists_loaded{0};
+
+	// if set, playlist ids carry the signed playlist definition, see nulla/playlist_store.hpp
+	std::string m_playlist_id_key;
+	std::atomic<uint64_t> m_playlist_ids_rejected{0};
+
+	// playlist ids of the manifest requests by their canonical hash and requests waiting for the playlist
+	// which is being built, see @join_manifest()
+	bool m_manifest_dedup = false;
+	std::mutex m_manifests_lock;
+	std::unordered_map<std::string, std::string> m_manifests;
+	std::map<std::string, std::vector<manifest_completion_t>> m_manifests_pending;
+	std::atomic<uint64_t> m_manifest_dedup_hits{0};
+	std::atomic<uint64_t> m_manifest_dedup_misses{0};
+
+	std::mutex m_upload_sessions_lock;
+	std::map<std::string, nulla::upload_session_t> m_upload_sessions;
+	long m_upload_session_timeout = 24 * 3600;
 
 	long m_read_timeout = 60;
 	long m_write_timeout = 60;
@@ -878,11 +1601,389 @@ private:
 	std::string m_tmp_dir;
 	std::string m_hostname;
 
+	nulla::upload_metadata_options m_upload_metadata;
+
+	// 0 means chunks of the uploaded file are written one after another
+	size_t m_upload_inflight_bytes = 0;
+
+	bool m_upload_dedup = false;
+	std::vector<int> m_metadata_groups;
+
+	std::atomic<uint64_t> m_dedup_uploads{0};
+	std::atomic<uint64_t> m_dedup_duplicates{0};
+	std::atomic<uint64_t> m_dedup_bytes{0};
+	std::atomic<uint64_t> m_dedup_saved_bytes{0};
+
 	nulla::expiration m_expiration;
 
-	void remove_playlist(const std::string &cookie) {
-		std::lock_guard<std::mutex> guard(m_playlists_lock);
-		m_playlists.erase(cookie);
+	struct chunks_load_state {
+		std::atomic_int		pending;
+		std::atomic_bool	failed;
+		chunks_completion_t	complete;
+
+		chunks_load_state(int num, const chunks_completion_t &c) : pending(num), failed(false), complete(c) {}
+	};
+
+	void on_read_sample_chunk(const std::shared_ptr<nulla::chunked_sample_table> &table,
+			const std::vector<size_t> &chunks, const std::shared_ptr<chunks_load_state> &state,
+			size_t index, const elliptics::data_pointer &dp, const elliptics::error_info &error) {
+		const size_t idx = chunks[index];
+		elliptics::error_info err = error;
+
+		if (!err) {
+			try {
+				// binary chunks are used right from the read buffer, it is kept alive by the span
+				auto owner = std::make_shared<elliptics::data_pointer>(dp);
+				table->set_chunk(idx, nulla::unpack_sample_table(dp.data<char>(), dp.size(), owner));
+			} catch (const std::exception &e) {
+				err = elliptics::create_error(-EINVAL, "could not unpack sample table chunk %zd: %s", idx, e.what());
+			}
+		}
+
+		if (err) {
+			if (!state->failed.exchange(true))
+				state->complete(err);
+			return;
+		}
+
+		if (--state->pending == 0)
+			state->complete(elliptics::error_info());
+	}
+
+	void on_playlist_written(const nulla::playlist_t &playlist, const store_completion_t &complete,
+			const elliptics::error_info &error) {
+		if (error) {
+			m_playlist_memory -= playlist->memory;
+			complete(error);
+			return;
+		}
+
+		m_playlists_stored++;
+		insert_playlist(playlist);
+		complete(error);
+	}
+
+	// playlist loaded from storage is accounted and expires the same way as the one created locally
+	void on_playlist_loaded(const std::string &id, const nulla::playlist_t &loaded, const elliptics::error_info &error) {
+		nulla::playlist_t playlist = loaded;
+		elliptics::error_info err = error;
+
+		if (!err && std::chrono::system_clock::now() >
+				playlist->expires_at + std::chrono::milliseconds(playlist->duration_msec)) {
+			err = elliptics::create_error(-ENOENT, "playlist has expired");
+		}
+
+		if (!err) {
+			playlist->base_url = m_hostname + "/stream/" + id + "/";
+			err = admit_playlist(playlist);
+		}
+
+		if (!err) {
+			m_playlists_loaded++;
+
+			// the same playlist could have been loaded by the request which came after this load had finished
+			if (!insert_playlist(playlist)) {
+				m_playlist_memory -= playlist->memory;
+				playlist = m_playlists.find(id);
+			}
+		} else {
+			playlist.reset();
+		}
+
+		std::vector<playlist_completion_t> waiters;
+		{
+			std::lock_guard<std::mutex> guard(m_playlist_loads_lock);
+			auto it = m_playlist_loads.find(id);
+			if (it != m_playlist_loads.end()) {
+				waiters.swap(it->second);
+				m_playlist_loads.erase(it);
+			}
+		}
+
+		for (const auto &complete: waiters) {
+			complete(playlist, err);
+		}
+	}
+
+	// playlist can not be started after it has expired, the next identical request builds a new one
+	void forget_manifest(const std::string &hash, const std::string &id) {
+		std::lock_guard<std::mutex> guard(m_manifests_lock);
+
+		auto it = m_manifests.find(hash);
+		if (it != m_manifests.end() && it->second == id)
+			m_manifests.erase(it);
+	}
+
+	// playlist is removed when it expires or when it has not been requested for the idle timeout,
+	// idle timeout is at least two chunks long, so that player fetching chunk after chunk is never idle
+	std::chrono::system_clock::time_point playlist_deadline(const nulla::playlist_t &playlist) const {
+		auto expires_at = playlist->expires_at + std::chrono::milliseconds(playlist->duration_msec);
+		if (m_playlist_idle_timeout == 0)
+			return expires_at;
+
+		long idle_timeout = std::max(m_playlist_idle_timeout, 2L * playlist->chunk_duration_sec);
+		return std::min(expires_at, playlist->last_access() + std::chrono::seconds(idle_timeout));
+	}
+
+	// stream requests only update access time of the playlist, timer is rearmed lazily when it fires
+	void expire_playlist(const std::string &id) {
+		nulla::playlist_t playlist = m_playlists.find(id);
+		if (!playlist)
+			return;
+
+		auto now = std::chrono::system_clock::now();
+		auto deadline = playlist_deadline(playlist);
+		if (deadline > now) {
+			m_expiration.insert(deadline, std::bind(&nulla_server::expire_playlist, this, id));
+			return;
+		}
+
+		if (now < playlist->expires_at + std::chrono::milliseconds(playlist->duration_msec)) {
+			NLOG_INFO("playlist: %s: has not been requested for %ld seconds, removing",
+					id.c_str(), (long)std::chrono::duration_cast<std::chrono::seconds>(
+						now - playlist->last_access()).count());
+			m_playlists_idle_expired++;
+		}
+
+		if (m_playlists.erase(id)) {
+			m_playlist_memory -= playlist->memory;
+			remove_playlist_definition(playlist);
+		}
+	}
+
+	// persisted definition of the playlist dropped from memory before it has expired is still loaded
+	// by the next request, it is removed from storage when playlist expires
+	void remove_playlist_definition(const nulla::playlist_t &playlist) {
+		if (!m_playlist_id_key.empty() || !m_playlist_persist)
+			return;
+
+		auto expires_at = playlist->expires_at + std::chrono::milliseconds(playlist->duration_msec);
+		if (expires_at > std::chrono::system_clock::now()) {
+			m_expiration.insert(expires_at, std::bind(&nulla_server::on_playlist_definition_expired, this, playlist->id));
+			return;
+		}
+
+		on_playlist_definition_expired(playlist->id);
+	}
+
+	void on_playlist_definition_expired(const std::string &id) {
+		// playlist loaded again is expired by its own timer
+		if (m_playlists.find(id))
+			return;
+
+		m_storage->remove(std::string(), nulla::playlist_key(id), [this, id] (const elliptics::error_info &error) {
+				if (error && error.code() != -ENOENT) {
+					NLOG_ERROR("playlist: %s: could not remove definition: %s [%d]",
+							id.c_str(), error.message().c_str(), error.code());
+				}
+			});
+	}
+
+	// removes idle playlists least recently used first until @need bytes are freed,
+	// playlist is idle if it has not been requested for two chunks and at least @m_playlist_evict_idle_sec
+	void evict_idle_playlists(uint64_t need) {
+		auto now = std::chrono::system_clock::now();
+
+		std::vector<std::pair<std::chrono::system_clock::time_point, nulla::playlist_t>> idle;
+		m_playlists.for_each([&] (const std::string &, const nulla::playlist_t &playlist) {
+			long idle_timeout = std::max(m_playlist_evict_idle_sec, 2L * playlist->chunk_duration_sec);
+			auto last_access = playlist->last_access();
+			if (last_access + std::chrono::seconds(idle_timeout) <= now)
+				idle.emplace_back(last_access, playlist);
+		});
+
+		std::sort(idle.begin(), idle.end(),
+			[] (const std::pair<std::chrono::system_clock::time_point, nulla::playlist_t> &a,
+			    const std::pair<std::chrono::system_clock::time_point, nulla::playlist_t> &b) {
+				return a.first < b.first;
+			});
+
+		uint64_t freed = 0;
+		for (const auto &p: idle) {
+			if (freed >= need)
+				break;
+
+			if (!m_playlists.erase(p.second->id))
+				continue;
+
+			NLOG_INFO("playlist: %s: evicted to free memory, idle for %ld seconds, memory: %zd",
+					p.second->id.c_str(), (long)std::chrono::duration_cast<std::chrono::seconds>(
+						now - p.first).count(), p.second->memory);
+
+			m_playlist_memory -= p.second->memory;
+			m_playlists_evicted++;
+			freed += p.second->memory;
+
+			remove_playlist_definition(p.second);
+		}
+	}
+
+	// every upload request postpones session expiration, session which is being uploaded is never removed
+	void expire_upload_session(const std::string &id) {
+		std::unique_lock<std::mutex> guard(m_upload_sessions_lock);
+		auto it = m_upload_sessions.find(id);
+		if (it == m_upload_sessions.end())
+			return;
+
+		nulla::upload_session_t session = it->second;
+
+		auto expires_at = session->expires_at();
+		if (session->busy()) {
+			expires_at = std::chrono::system_clock::now() + std::chrono::seconds(m_upload_session_timeout);
+		} else if (expires_at <= std::chrono::system_clock::now()) {
+			NLOG_INFO("upload-session: id: %s, key: %s, committed: %lu/%lu: session has expired",
+					id.c_str(), session->key().c_str(), session->committed(), session->size());
+			m_upload_sessions.erase(it);
+			return;
+		}
+
+		guard.unlock();
+		m_expiration.insert(expires_at, std::bind(&nulla_server::expire_upload_session, this, id));
+	}
+
+	// elliptics session is not available with local storage, so id is not an elliptics key transformation
+	std::string generate_id() {
+		// persisted playlists are shared among servers, their ids must not collide
+		std::string seed = std::to_string(m_playlist_seq++) + "." + std::to_string(rand()) + "." +
+			std::to_string(getpid()) + "." +
+			std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+
+		nulla::sha256 h;
+		h.update(seed.data(), seed.size());
+		return h.final_hex();
+	}
+
+	bool storage_init(const rapidjson::Value &config) {
+		const std::string type = ebucket::get_string(config, "storage", "elliptics");
+
+		if (type == "elliptics") {
+			if (!elliptics_init(config))
+				return false;
+
+			nulla::hedge_options hedge;
+			if (!hedge_init(config, hedge))
+				return false;
+
+			nulla::group_stats_options groups;
+			if (config.HasMember("read_group_ordering")) {
+				auto &ordering = config["read_group_ordering"];
+				if (ordering.IsBool())
+					groups.enabled = ordering.GetBool();
+			}
+			groups.error_threshold = ebucket::get_int64(config, "read_group_error_threshold", groups.error_threshold);
+			groups.cooldown_sec = ebucket::get_int64(config, "read_group_cooldown_sec", groups.cooldown_sec);
+
+			nulla::split_options split;
+			split.threshold = ebucket::get_int64(config, "read_split_threshold", split.threshold);
+			split.part_size = ebucket::get_int64(config, "read_split_part_size", split.part_size);
+			split.max_parts = ebucket::get_int64(config, "read_split_max_parts", split.max_parts);
+			if (split.threshold && split.part_size == 0) {
+				NLOG_ERROR("\"application.read_split_part_size\" must be positive");
+				return false;
+			}
+
+			m_storage.reset(new nulla::elliptics_storage(m_bp, m_node, m_metadata_groups, m_read_timeout,
+						hedge, groups, split));
+		} else if (type == "local") {
+			if (!prepare_server(config))
+				return false;
+
+			const char *root = ebucket::get_string(config, "storage_root");
+			if (!root) {
+				NLOG_ERROR("\"application.storage_root\" field is missed");
+				return false;
+			}
+
+			int threads = ebucket::get_int64(config, "storage_threads", 8);
+			m_storage.reset(new nulla::local_storage(root, threads));
+		} else {
+			NLOG_ERROR("\"application.storage\": unsupported storage %s, must be elliptics or local", type.c_str());
+			return false;
+		}
+
+		NLOG_INFO("storage: %s", m_storage->name());
+		return disk_cache_init(config) && block_cache_init(config);
+	}
+
+	bool hedge_init(const rapidjson::Value &config, nulla::hedge_options &hedge) {
+		if (config.HasMember("read_hedge")) {
+			auto &h = config["read_hedge"];
+			if (h.IsBool())
+				hedge.enabled = h.GetBool();
+		}
+
+		if (!hedge.enabled)
+			return true;
+
+		hedge.percentile = ebucket::get_int64(config, "read_hedge_percentile", hedge.percentile * 100) / 100.0;
+		hedge.min_delay_ms = ebucket::get_int64(config, "read_hedge_min_delay_ms", hedge.min_delay_ms);
+		hedge.max_ratio = ebucket::get_int64(config, "read_hedge_max_percent", hedge.max_ratio * 100) / 100.0;
+
+		if (hedge.percentile <= 0 || hedge.percentile > 1 || hedge.max_ratio < 0) {
+			NLOG_ERROR("\"application.read_hedge_percentile\" must be in (0, 100], "
+					"\"application.read_hedge_max_percent\" must not be negative");
+			return false;
+		}
+
+		NLOG_INFO("hedged reads: percentile: %.2f, min delay: %ld ms, max ratio: %.2f",
+				hedge.percentile, hedge.min_delay_ms, hedge.max_ratio);
+		return true;
+	}
+
+	bool disk_cache_init(const rapidjson::Value &config) {
+		const char *path = ebucket::get_string(config, "disk_cache_path");
+		if (!path || !*path)
+			return true;
+
+		nulla::disk_cache_options opt;
+		opt.path = path;
+		opt.size = ebucket::get_int64(config, "disk_cache_size", 0);
+		opt.block_size = ebucket::get_int64(config, "disk_cache_block_size", opt.block_size);
+		opt.admit_hits = ebucket::get_int64(config, "disk_cache_admit_hits", opt.admit_hits);
+		opt.threads = ebucket::get_int64(config, "disk_cache_threads", opt.threads);
+		opt.ttl_sec = ebucket::get_int64(config, "disk_cache_ttl_sec", opt.ttl_sec);
+
+		if (opt.size == 0 || opt.block_size == 0 || opt.threads <= 0 || opt.ttl_sec < 0) {
+			NLOG_ERROR("\"application.disk_cache_path\": %s: disk_cache_size, disk_cache_block_size "
+					"and disk_cache_threads must be positive, disk_cache_ttl_sec must not be negative", path);
+			return false;
+		}
+
+		try {
+			m_storage = std::make_shared<nulla::disk_cache_storage>(m_storage, opt);
+		} catch (const std::exception &e) {
+			NLOG_ERROR("disk cache: %s", e.what());
+			return false;
+		}
+
+		NLOG_INFO("disk cache: path: %s, size: %lu, block size: %lu, admit hits: %d, threads: %d, ttl: %ld sec",
+				path, opt.size, opt.block_size, opt.admit_hits, opt.threads, opt.ttl_sec);
+		return true;
+	}
+
+	// memory cache is put in front of the disk cache, its block reads are aligned
+	// to the disk cache blocks when block sizes are multiples of each other
+	bool block_cache_init(const rapidjson::Value &config) {
+		uint64_t size = ebucket::get_int64(config, "block_cache_size", 0);
+		if (size == 0)
+			return true;
+
+		uint64_t block_size = ebucket::get_int64(config, "block_cache_block_size", 2 * 1024 * 1024);
+		if (block_size == 0) {
+			NLOG_ERROR("\"application.block_cache_block_size\" must be positive");
+			return false;
+		}
+
+		long ttl_sec = ebucket::get_int64(config, "block_cache_ttl_sec", 300);
+		if (ttl_sec < 0) {
+			NLOG_ERROR("\"application.block_cache_ttl_sec\" must not be negative");
+			return false;
+		}
+
+		m_storage = std::make_shared<nulla::block_cache_storage>(m_storage, size, block_size, ttl_sec);
+
+		NLOG_INFO("block cache: size: %lu, block size: %lu, ttl: %ld sec", size, block_size, ttl_sec);
+		return true;
 	}
 
 	bool elliptics_init(const rapidjson::Value &config) {
@@ -1007,6 +2108,8 @@ private:
 		if (!m_bp->init(mgroups, std::vector<std::string>(bnames.begin(), bnames.end())))
 			return false;
 
+		m_metadata_groups = mgroups;
+
 		return true;
 	}
 
@@ -1022,6 +2125,49 @@ private:
 
 		m_hostname.assign(hostname);
 
+		m_playlist_idle_timeout = ebucket::get_int64(config, "playlist_idle_timeout_sec", m_playlist_idle_timeout);
+		m_playlist_memory_budget = ebucket::get_int64(config, "playlist_memory_budget", m_playlist_memory_budget);
+		m_playlist_evict_idle_sec = ebucket::get_int64(config, "playlist_evict_idle_sec", m_playlist_evict_idle_sec);
+
+		m_playlist_id_key.assign(ebucket::get_string(config, "playlist_id_key", ""));
+
+		if (config.HasMember("manifest_dedup")) {
+			auto &dedup = config["manifest_dedup"];
+			if (dedup.IsBool())
+				m_manifest_dedup = dedup.GetBool();
+		}
+
+		if (config.HasMember("playlist_persist")) {
+			auto &persist = config["playlist_persist"];
+			if (persist.IsBool())
+				m_playlist_persist = persist.GetBool();
+		}
+
+		if (config.HasMember("upload_metadata")) {
+			auto &enabled = config["upload_metadata"];
+			if (enabled.IsBool())
+				m_upload_metadata.enabled = enabled.GetBool();
+		}
+
+		m_upload_metadata.chunk_duration_sec = ebucket::get_int64(config, "upload_metadata_chunk_duration_sec",
+				nulla::sample_chunk_duration_sec);
+
+		const char *format = ebucket::get_string(config, "upload_metadata_format", "msgpack");
+		if (!nulla::parse_metadata_format(format, m_upload_metadata.format)) {
+			NLOG_ERROR("\"upload_metadata_format\": unsupported metadata format %s", format);
+			return false;
+		}
+
+		m_upload_inflight_bytes = ebucket::get_int64(config, "upload_inflight_bytes", 0);
+
+		m_upload_session_timeout = ebucket::get_int64(config, "upload_session_timeout_sec", m_upload_session_timeout);
+
+		if (config.HasMember("upload_dedup")) {
+			auto &dedup = config["upload_dedup"];
+			if (dedup.IsBool())
+				m_upload_dedup = dedup.GetBool();
+		}
+
 		av_register_all();
 		//av_log_set_level(AV_LOG_VERBOSE);
 
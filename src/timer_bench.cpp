@@ -0,0 +1,154 @@
+#include "nulla/expiration.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Benchmark of the playlist expiration timers.
+//
+// Inserts @count long timers (playlists living for up to an hour), cancels and extends part of them,
+// then inserts @count short timers and waits until all of them fire, measuring how late they are.
+// Timer which fires before its expiration time is an error.
+// Insertion into the map of vectors which was used for expiration before is measured for comparison.
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ms(const bench_clock::time_point &start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count() / 1000.0;
+}
+
+void report(const char *name, size_t count, double ms) {
+	std::cout << name << ": " << count << " ops, " << ms << " ms, " <<
+		(ms > 0 ? (long)(count / ms * 1000) : 0) << " ops/s" << std::endl;
+}
+
+void map_insert(size_t count) {
+	std::mutex lock;
+	std::map<std::chrono::system_clock::time_point, std::vector<std::function<void ()>>> timeouts;
+
+	auto now = std::chrono::system_clock::now();
+	auto start = bench_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		auto expires_at = now + std::chrono::milliseconds(1000 + rand() % 3600000);
+
+		std::lock_guard<std::mutex> guard(lock);
+		timeouts[expires_at].emplace_back([] {});
+	}
+	report("map insert", count, elapsed_ms(start));
+}
+
+void wheel_long(size_t count) {
+	nulla::expiration exp;
+	std::vector<nulla::expiration::timer_id_t> ids(count);
+
+	auto start = bench_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		ids[i] = exp.insert(std::chrono::milliseconds(1000 + rand() % 3600000), [] {});
+	}
+	report("wheel insert", count, elapsed_ms(start));
+
+	start = bench_clock::now();
+	for (size_t i = 0; i < count; i += 2) {
+		exp.cancel(ids[i]);
+	}
+	report("wheel cancel", count / 2, elapsed_ms(start));
+
+	start = bench_clock::now();
+	for (size_t i = 1; i < count; i += 4) {
+		exp.extend(ids[i], std::chrono::milliseconds(1000 + rand() % 3600000));
+	}
+	report("wheel extend", count / 4, elapsed_ms(start));
+}
+
+// returns number of timers which have fired early
+size_t wheel_fire(size_t count, long spread_ms) {
+	nulla::expiration exp;
+
+	std::atomic<size_t> fired(0);
+	std::atomic<size_t> early(0);
+	std::atomic<long> max_late(0);
+	std::atomic<long> total_late(0);
+
+	const auto base = bench_clock::now();
+
+	auto start = bench_clock::now();
+	for (size_t i = 0; i < count; ++i) {
+		long timeout = rand() % spread_ms;
+		auto due = bench_clock::now() + std::chrono::milliseconds(timeout);
+
+		exp.insert(std::chrono::milliseconds(timeout), [&, due] () {
+			long late = std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - due).count();
+			total_late += late;
+			if (late < 0)
+				early++;
+
+			long prev = max_late;
+			while (late > prev && !max_late.compare_exchange_weak(prev, late)) {
+			}
+
+			fired++;
+		});
+	}
+	report("wheel insert short", count, elapsed_ms(start));
+
+	while (fired != count) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	std::cout << "wheel fire: " << count << " timers over " << spread_ms << " ms fired in " << elapsed_ms(base) <<
+		" ms, average lateness: " << total_late / (long)count << " us, max lateness: " << max_late << " us" <<
+		", fired early: " << early << std::endl;
+
+	return early;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	size_t count;
+	long spread;
+
+	bpo::options_description generic("Timer benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("count", bpo::value<size_t>(&count)->default_value(1000000), "number of timers")
+		("spread", bpo::value<long>(&spread)->default_value(5000), "short timers expire within this many milliseconds")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (vm.count("help") || spread <= 0) {
+		std::cerr << generic << std::endl;
+		return -1;
+	}
+
+	map_insert(count);
+	wheel_long(count);
+	if (wheel_fire(count, spread) != 0) {
+		std::cerr << "timers must never fire before their expiration time" << std::endl;
+		return -1;
+	}
+
+	return 0;
+}
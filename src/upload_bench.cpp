@@ -0,0 +1,235 @@
+#include "nulla/expiration.hpp"
+#include "nulla/local_storage.hpp"
+#include "nulla/write_pipeline.hpp"
+
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+
+#include <boost/program_options.hpp>
+
+using namespace ioremap;
+
+// Benchmark of the chunk writes of a large upload.
+//
+// Object of @size bytes is written in @chunk byte chunks into local storage the way upload handler
+// writes it: sequentially, every chunk waits for the previous one to complete, and pipelined,
+// chunk writes are driven by the same nulla::write_pipeline upload handler uses with @inflight budget.
+// Local writes land in the page cache, so elliptics replica round trip is emulated by delaying
+// every completion for @latency milliseconds.
+
+namespace {
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed_ms(const bench_clock::time_point &start) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(bench_clock::now() - start).count() / 1000.0;
+}
+
+struct bench_options {
+	std::string	root;
+	uint64_t	size = 0;
+	uint64_t	chunk = 0;
+	uint64_t	inflight = 0;
+	int		threads = 0;
+	long		latency_ms = 0;
+};
+
+class delayed_writer {
+public:
+	delayed_writer(const bench_options &opt) : m_opt(opt), m_storage(opt.root, opt.threads) {
+	}
+
+	void write(const std::string &key, const elliptics::data_pointer &data, uint64_t offset,
+			const nulla::storage::write_handler_t &handler) {
+		m_storage.write("bench", key, data, offset, [this, handler] (const elliptics::error_info &error) {
+				if (m_opt.latency_ms <= 0) {
+					handler(error);
+					return;
+				}
+
+				m_expiration.insert(std::chrono::milliseconds(m_opt.latency_ms), std::bind(handler, error));
+			});
+	}
+
+private:
+	const bench_options &m_opt;
+	nulla::local_storage m_storage;
+	nulla::expiration m_expiration;
+};
+
+// request stream of the upload handler: the next chunk is only read when the previous one allows it
+class upload : public std::enable_shared_from_this<upload> {
+public:
+	upload(delayed_writer &writer, const std::string &key, const elliptics::data_pointer &chunk,
+			const bench_options &opt, uint64_t inflight) :
+		m_writer(writer), m_key(key), m_chunk(chunk), m_opt(opt)
+	{
+		m_pipeline.set_budget(inflight);
+	}
+
+	// returns false if any write has failed
+	bool run() {
+		next_chunk();
+		return m_done.get_future().get();
+	}
+
+private:
+	delayed_writer &m_writer;
+	std::string m_key;
+	elliptics::data_pointer m_chunk;
+	const bench_options &m_opt;
+
+	nulla::write_pipeline m_pipeline;
+	uint64_t m_offset = 0;
+	uint64_t m_read = 0;
+	std::promise<bool> m_done;
+
+	// the first chunk is always waited for, see on_upload_base::pipelined()
+	void next_chunk() {
+		while (m_read < m_opt.size) {
+			const uint64_t size = std::min(m_opt.chunk, m_opt.size - m_read);
+			const bool first = m_read == 0;
+			const bool last = m_read + size >= m_opt.size;
+			m_read += size;
+
+			if (first || !m_pipeline.budget()) {
+				const uint64_t offset = m_offset;
+				m_offset += size;
+				m_writer.write(m_key, m_chunk.slice(0, size), offset,
+						std::bind(&upload::on_write, shared_from_this(), last, std::placeholders::_1));
+				return;
+			}
+
+			std::unique_lock<std::mutex> guard(m_pipeline.lock());
+
+			if (last) {
+				if (m_pipeline.finish_locked() == nulla::write_pipeline::commit) {
+					guard.unlock();
+					commit();
+				}
+				return;
+			}
+
+			uint64_t offset;
+			bool next;
+			if (!m_pipeline.start_locked(m_offset, size, offset, next))
+				return;
+			guard.unlock();
+
+			m_writer.write(m_key, m_chunk.slice(0, size), offset,
+					std::bind(&upload::on_write_pipelined, shared_from_this(), size, std::placeholders::_1));
+
+			if (!next)
+				return;
+		}
+	}
+
+	void on_write(bool last, const elliptics::error_info &error) {
+		if (error || last) {
+			m_done.set_value(!error);
+			return;
+		}
+
+		next_chunk();
+	}
+
+	void on_write_pipelined(uint64_t size, const elliptics::error_info &error) {
+		nulla::write_pipeline::action action;
+		{
+			std::lock_guard<std::mutex> guard(m_pipeline.lock());
+			action = m_pipeline.complete_locked(size, !error);
+		}
+
+		switch (action) {
+		case nulla::write_pipeline::failed:
+			m_done.set_value(false);
+			break;
+		case nulla::write_pipeline::commit:
+			commit();
+			break;
+		case nulla::write_pipeline::next_chunk:
+			next_chunk();
+			break;
+		case nulla::write_pipeline::none:
+		case nulla::write_pipeline::ignored:
+			break;
+		}
+	}
+
+	// all plain writes have completed, nobody else touches the offset
+	void commit() {
+		const uint64_t size = m_opt.size - m_offset;
+		const uint64_t offset = m_offset;
+		m_offset += size;
+
+		m_writer.write(m_key, m_chunk.slice(0, size), offset,
+				std::bind(&upload::on_write, shared_from_this(), true, std::placeholders::_1));
+	}
+};
+
+bool run(delayed_writer &writer, const char *name, const elliptics::data_pointer &chunk,
+		const bench_options &opt, uint64_t inflight) {
+	auto start = bench_clock::now();
+	if (!std::make_shared<upload>(writer, name, chunk, opt, inflight)->run()) {
+		std::cerr << name << ": write failed" << std::endl;
+		return false;
+	}
+
+	const double ms = elapsed_ms(start);
+	std::cout << name << ": " << opt.size << " bytes in " << opt.size / opt.chunk << " chunks, " << ms << " ms, " <<
+		(ms > 0 ? (long)(opt.size / ms * 1000 / (1024 * 1024)) : 0) << " MB/s" << std::endl;
+	return true;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	namespace bpo = boost::program_options;
+
+	bench_options opt;
+
+	bpo::options_description generic("Upload benchmark options");
+	generic.add_options()
+		("help", "this help message")
+		("root", bpo::value<std::string>(&opt.root)->default_value("/tmp/nulla-upload-bench"), "local storage directory")
+		("size", bpo::value<uint64_t>(&opt.size)->default_value(256 * 1024 * 1024), "object size")
+		("chunk", bpo::value<uint64_t>(&opt.chunk)->default_value(10 * 1024 * 1024), "chunk size")
+		("inflight", bpo::value<uint64_t>(&opt.inflight)->default_value(40 * 1024 * 1024),
+			"bytes being written by pipelined upload, see upload_inflight_bytes")
+		("threads", bpo::value<int>(&opt.threads)->default_value(8), "local storage threads")
+		("latency", bpo::value<long>(&opt.latency_ms)->default_value(5), "emulated write latency in milliseconds")
+		;
+
+	bpo::variables_map vm;
+
+	try {
+		bpo::store(bpo::command_line_parser(argc, argv).options(generic).run(), vm);
+		bpo::notify(vm);
+	} catch (const std::exception &e) {
+		std::cerr << "Invalid options: " << e.what() << "\n" << generic << std::endl;
+		return -1;
+	}
+
+	if (vm.count("help") || opt.size == 0 || opt.chunk == 0 || opt.inflight < opt.chunk) {
+		std::cerr << generic << std::endl;
+		return -1;
+	}
+
+	elliptics::data_pointer chunk = elliptics::data_pointer::allocate(opt.chunk);
+	for (uint64_t i = 0; i < opt.chunk; ++i) {
+		chunk.data<char>()[i] = i;
+	}
+
+	delayed_writer writer(opt);
+
+	if (!run(writer, "sequential", chunk, opt, 0))
+		return -1;
+	if (!run(writer, "pipelined", chunk, opt, opt.inflight))
+		return -1;
+
+	return 0;
+}